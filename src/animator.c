@@ -0,0 +1,200 @@
+/*
+ * animator.c
+ * Running animations on the frame clock
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ * Every animation is advanced from one tick callback on the widget's
+ * frame clock, at most once per frame and by the frame time, so that it
+ * runs at the same speed whatever the frame rate.  An animation that
+ * has nothing to do until later says when, and while every animation
+ * is waiting, the frame clock is left alone and a single timeout wakes
+ * the animator up again.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <gtk/gtk.h>
+#include "trace.h"
+#include "animator.h"
+
+// Waits shorter than this are done by just waiting for frames
+static const gint64 animator_min_sleep = G_USEC_PER_SEC / 20;
+
+static gboolean on_tick (GtkWidget *widget, GdkFrameClock *frame_clock,
+			 gpointer user_data);
+static gboolean on_timeout (gpointer user_data);
+
+static gint64
+get_wake_time (ToddlerFunAnimator *animator)
+{
+    gint64 wake_time = G_MAXINT64;
+    GList *l;
+
+    for (l = animator->animations; l != NULL; l = l->next) {
+	ToddlerFunAnimation *animation = l->data;
+	if (!animation->removed)
+	    wake_time = MIN (wake_time, animation->wake_time);
+    }
+
+    return wake_time;
+}
+
+static void
+remove_animations (ToddlerFunAnimator *animator)
+{
+    GList *l, *next;
+
+    for (l = animator->animations; l != NULL; l = next) {
+	ToddlerFunAnimation *animation = l->data;
+
+	next = l->next;
+	if (animation->removed) {
+	    animator->animations =
+		g_list_delete_link (animator->animations, l);
+	    g_free (animation);
+	}
+    }
+}
+
+/*
+ * Tick on the next frame if any animation wants to run by then, and
+ * otherwise sleep until the earliest wake time.  While ticking, the
+ * tick callback decides this itself after each frame.
+ */
+static void
+schedule (ToddlerFunAnimator *animator)
+{
+    gint64 now, wake_time;
+
+    if (animator->tick_id != 0)
+	return;
+
+    if (animator->timeout_id != 0) {
+	g_source_remove (animator->timeout_id);
+	animator->timeout_id = 0;
+    }
+
+    now = g_get_monotonic_time ();
+    wake_time = get_wake_time (animator);
+    if (wake_time == G_MAXINT64)
+	return;
+
+    if (wake_time - now < animator_min_sleep)
+	animator->tick_id =
+	    gtk_widget_add_tick_callback (animator->widget, on_tick,
+					  animator, NULL);
+    else
+	animator->timeout_id = g_timeout_add ((wake_time - now) / 1000,
+					      on_timeout, animator);
+}
+
+static gboolean
+on_timeout (gpointer user_data)
+{
+    ToddlerFunAnimator *animator = user_data;
+
+    animator->timeout_id = 0;
+    schedule (animator);
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean
+on_tick (GtkWidget *widget, GdkFrameClock *frame_clock, gpointer user_data)
+{
+    ToddlerFunAnimator *animator = user_data;
+    gint64 now = gdk_frame_clock_get_frame_time (frame_clock);
+    gint64 wake_time, start = trace_begin (animator->trace);
+    GList *l;
+
+    animator->running = TRUE;
+    animator->frame_time = now;
+    for (l = animator->animations; l != NULL; l = l->next) {
+	ToddlerFunAnimation *animation = l->data;
+
+	if (animation->removed || animation->wake_time > now)
+	    continue;
+
+	animation->wake_time = animation->func (now, animation->user_data);
+	if (animation->wake_time == ANIMATOR_DONE)
+	    animation->removed = TRUE;
+    }
+    animator->running = FALSE;
+    remove_animations (animator);
+    trace_end (animator->trace, "on_tick", start, "frame",
+	       gdk_frame_clock_get_frame_counter (frame_clock));
+
+    wake_time = get_wake_time (animator);
+    if (wake_time != G_MAXINT64 && wake_time - now < animator_min_sleep)
+	return G_SOURCE_CONTINUE;
+
+    animator->tick_id = 0;
+    schedule (animator);
+
+    return G_SOURCE_REMOVE;
+}
+
+ToddlerFunAnimator *
+animator_new (GtkWidget *widget)
+{
+    ToddlerFunAnimator *animator;
+
+    animator = g_new0 (ToddlerFunAnimator, 1);
+    animator->widget = widget;
+    animator->next_id = 1;
+
+    return animator;
+}
+
+void
+animator_free (ToddlerFunAnimator *animator)
+{
+    if (animator->tick_id != 0)
+	gtk_widget_remove_tick_callback (animator->widget,
+					 animator->tick_id);
+    if (animator->timeout_id != 0)
+	g_source_remove (animator->timeout_id);
+    g_list_free_full (animator->animations, g_free);
+    g_free (animator);
+}
+
+/*
+ * Start calling FUNC from the next frame on, until it returns
+ * ANIMATOR_DONE or the animation is removed
+ */
+guint
+animator_add (ToddlerFunAnimator *animator,
+	      ToddlerFunAnimationFunc func,
+	      gpointer user_data)
+{
+    ToddlerFunAnimation *animation;
+
+    animation = g_new0 (ToddlerFunAnimation, 1);
+    animation->id = animator->next_id++;
+    animation->func = func;
+    animation->user_data = user_data;
+    animator->animations = g_list_append (animator->animations, animation);
+
+    // Not again in the frame that is being run
+    if (animator->running)
+	animation->wake_time = animator->frame_time + 1;
+    else
+	schedule (animator);
+
+    return animation->id;
+}
+
+void
+animator_remove (ToddlerFunAnimator *animator, guint id)
+{
+    GList *l;
+
+    for (l = animator->animations; l != NULL; l = l->next) {
+	ToddlerFunAnimation *animation = l->data;
+	if (animation->id == id)
+	    animation->removed = TRUE;
+    }
+
+    if (!animator->running)
+	remove_animations (animator);
+}
@@ -0,0 +1,47 @@
+/*
+ * animator.h
+ * Running animations on the frame clock
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ */
+
+// What an animation function returns, other than the time it wants to
+// run again at
+#define ANIMATOR_NEXT_FRAME 0
+#define ANIMATOR_DONE (-1)
+
+/*
+ * Advance an animation to NOW, the monotonic time in microseconds of
+ * the frame being drawn.  Returns ANIMATOR_NEXT_FRAME, ANIMATOR_DONE,
+ * or the time it wants to run again at.
+ */
+typedef gint64 (*ToddlerFunAnimationFunc) (gint64 now, gpointer user_data);
+
+typedef struct {
+    guint id;
+    ToddlerFunAnimationFunc func;
+    gpointer user_data;
+    gint64 wake_time;
+    gboolean removed;
+} ToddlerFunAnimation;
+
+typedef struct {
+    GtkWidget *widget;
+    ToddlerFunTrace *trace;		// or NULL
+    GList *animations;
+    guint next_id;
+    gboolean running;
+    gint64 frame_time;
+
+    // Either a tick callback while something wants the next frame, or
+    // a timeout until the earliest wake time
+    guint tick_id;
+    guint timeout_id;
+} ToddlerFunAnimator;
+
+ToddlerFunAnimator *animator_new (GtkWidget *widget);
+void animator_free (ToddlerFunAnimator *animator);
+guint animator_add (ToddlerFunAnimator *animator,
+		    ToddlerFunAnimationFunc func,
+		    gpointer user_data);
+void animator_remove (ToddlerFunAnimator *animator, guint id);
@@ -0,0 +1,659 @@
+/*
+ * bench.c
+ * Benchmarks for the drawing primitives
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ * Times the drawing functions of main.c on an offscreen canvas, for
+ * every mirror effect and a few common screen sizes, and prints one
+ * JSON object per result.  Each drawing benchmark can also render a
+ * fixed scene for every mirror effect and compare it to a golden image,
+ * so that a faster implementation can be checked to draw the same
+ * pixels.  The scenes are drawn at one small size, to keep the golden
+ * images in bench/golden small.  The round brush, which stands in for
+ * cairo's stroker, is also checked against it: the same segments, with
+ * round caps at both ends, are drawn by both, and their mean difference
+ * is reported as "vs_line" and fails the benchmark if it is more than
+ * bench_brush_tolerance.
+ *
+ * main.c is included rather than linked, to get at its static
+ * functions.
+ */
+
+#define TODDLERFUN_NO_MAIN
+#include "main.c"
+#include <string.h>
+
+typedef struct {
+    const gchar *name;
+    gboolean per_effect;
+    void (*run) (ToddlerFun *toddlerfun, cairo_t *cr);
+} BenchCase;
+
+typedef struct {
+    gint width;
+    gint height;
+} BenchSize;
+
+static const BenchSize bench_sizes[] = {
+    { 1920, 1080 },
+    { 2560, 1440 },
+    { 3840, 2160 }
+};
+
+// Number of operations drawn for a golden image, and its size
+static const gint bench_golden_ops = 64;
+static const BenchSize bench_golden_size = { 640, 360 };
+
+/*
+ * How far the round brush may be from cairo's stroker: the mean over
+ * the pixels that either of them drew on of the difference of each
+ * color channel, from 0 to 255.  Against exactly covered capsules the
+ * brush is 0.8 to 0.95 off for every effect, all of it at the
+ * antialiased edges, while a missing cap gives about 7 and half a
+ * pixel too wide or narrow about 15.
+ */
+static const gdouble bench_brush_tolerance = 2.0;
+
+static void
+random_position (ToddlerFun *toddlerfun)
+{
+    toddlerfun->x = g_rand_int_range (toddlerfun->rand, 0,
+				      toddlerfun->canvas->width);
+    toddlerfun->y = g_rand_int_range (toddlerfun->rand, 0,
+				      toddlerfun->canvas->height);
+}
+
+/*
+ * Set up a segment of up to 50 pixels in each direction from a random
+ * position, in a random hue
+ */
+static void
+random_segment (ToddlerFun *toddlerfun, cairo_t *cr)
+{
+    random_position (toddlerfun);
+    toddlerfun->previous_x = toddlerfun->x +
+	g_rand_int_range (toddlerfun->rand, -50, 50);
+    toddlerfun->previous_y = toddlerfun->y +
+	g_rand_int_range (toddlerfun->rand, -50, 50);
+    toddlerfun->has_previous = TRUE;
+
+    cairo_set_line_width (cr, toddlerfun_line_width);
+    set_line_source (cr, g_rand_double (toddlerfun->rand));
+}
+
+/*
+ * Draw a random segment, DRAW being as for render_effect
+ */
+static void
+bench_segment (ToddlerFun *toddlerfun, cairo_t *cr, ToddlerFunDrawFunc draw)
+{
+    random_segment (toddlerfun, cr);
+    render_effect (toddlerfun, cr, draw);
+    queue_damage (toddlerfun);
+}
+
+static void
+bench_line (ToddlerFun *toddlerfun, cairo_t *cr)
+{
+    bench_segment (toddlerfun, cr, &draw_line);
+}
+
+static void
+bench_line_batched (ToddlerFun *toddlerfun, cairo_t *cr)
+{
+    bench_segment (toddlerfun, cr, NULL);
+}
+
+/*
+ * The segments of bench_line, painted by the brush engine
+ */
+static void
+bench_brush (ToddlerFun *toddlerfun, cairo_t *cr, ToddlerFunBrushType brush)
+{
+    toddlerfun->brush = brush;
+    bench_segment (toddlerfun, cr, &draw_brush);
+}
+
+static void
+bench_brush_round (ToddlerFun *toddlerfun, cairo_t *cr)
+{
+    bench_brush (toddlerfun, cr, BRUSH_ROUND);
+}
+
+static void
+bench_brush_airbrush (ToddlerFun *toddlerfun, cairo_t *cr)
+{
+    bench_brush (toddlerfun, cr, BRUSH_AIRBRUSH);
+}
+
+static void
+bench_brush_stamp (ToddlerFun *toddlerfun, cairo_t *cr)
+{
+    bench_brush (toddlerfun, cr, BRUSH_STAMP);
+}
+
+/*
+ * The segments of bench_line with round caps at both ends, drawn by
+ * cairo and by the round brush, for bench_difference.  They go
+ * straight to draw_effect, since the render pool does not pass on the
+ * line cap.
+ */
+static void
+draw_brush_capped (ToddlerFun *toddlerfun, cairo_t *cr)
+{
+    ToddlerFunSegment segment;
+
+    current_segment (toddlerfun, &segment);
+    paint_brush_segment (toddlerfun, cr, &segment, TRUE);
+}
+
+static void
+bench_capped_line (ToddlerFun *toddlerfun, cairo_t *cr)
+{
+    random_segment (toddlerfun, cr);
+    cairo_set_line_cap (cr, CAIRO_LINE_CAP_ROUND);
+    draw_effect (toddlerfun, cr, &draw_line);
+}
+
+static void
+bench_capped_brush (ToddlerFun *toddlerfun, cairo_t *cr)
+{
+    random_segment (toddlerfun, cr);
+    toddlerfun->brush = BRUSH_ROUND;
+    draw_effect (toddlerfun, cr, &draw_brush_capped);
+}
+
+static void
+bench_image (ToddlerFun *toddlerfun, cairo_t *cr)
+{
+    random_position (toddlerfun);
+    toddlerfun->object_num =
+	g_rand_int_range (toddlerfun->rand, 0,
+			  theme_get_n_objects (toddlerfun->theme));
+    toddlerfun->image_rotation =
+	g_rand_double_range (toddlerfun->rand, toddlerfun_min_rotation,
+			     toddlerfun_max_rotation);
+
+    toddlerfun->sprite = lookup_sprite (toddlerfun);
+    render_effect (toddlerfun, cr, &draw_image);
+    toddlerfun->sprite = NULL;
+    queue_damage (toddlerfun);
+}
+
+static void
+bench_string (ToddlerFun *toddlerfun, cairo_t *cr)
+{
+    gchar s[2];
+
+    random_position (toddlerfun);
+    toddlerfun->letter_x = toddlerfun->x;
+    toddlerfun->letter_y = toddlerfun->y;
+    s[0] = 'A' + g_rand_int_range (toddlerfun->rand, 0, 26);
+    s[1] = '\0';
+
+    toddlerfun->glyph = glyph_cache_get (toddlerfun->glyphs, s);
+    set_letter_source (cr, g_rand_double (toddlerfun->rand));
+    draw_effect (toddlerfun, cr, &draw_string);
+    toddlerfun->glyph = NULL;
+    queue_damage (toddlerfun);
+}
+
+/*
+ * Fade a canvas that is inked all over, which is the worst case
+ */
+static void
+bench_brighten (ToddlerFun *toddlerfun, cairo_t *cr)
+{
+    canvas_touch (toddlerfun->canvas, 0, 0,
+		  toddlerfun->canvas->width, toddlerfun->canvas->height);
+    surface_brighten (toddlerfun);
+    queue_damage (toddlerfun);
+}
+
+static void
+bench_clear (ToddlerFun *toddlerfun, cairo_t *cr)
+{
+    canvas_clear (toddlerfun->canvas);
+    queue_damage (toddlerfun);
+}
+
+static const BenchCase bench_cases[] = {
+    { "line", TRUE, bench_line },
+    { "line-batched", TRUE, bench_line_batched },
+    { "brush-round", TRUE, bench_brush_round },
+    { "brush-airbrush", TRUE, bench_brush_airbrush },
+    { "brush-stamp", TRUE, bench_brush_stamp },
+    { "image", TRUE, bench_image },
+    { "string", TRUE, bench_string },
+    { "brighten", FALSE, bench_brighten },
+    { "clear", FALSE, bench_clear }
+};
+
+static ToddlerFun *
+bench_toddlerfun_new (gint render_threads)
+{
+    ToddlerFun *toddlerfun;
+
+    toddlerfun = g_new0 (ToddlerFun, 1);
+    toddlerfun->motion_points = g_array_new (FALSE, FALSE,
+					     sizeof (ToddlerFunPoint));
+    toddlerfun->display_list = display_list_new ();
+    toddlerfun->glyphs = glyph_cache_new (toddlerfun_letter_font,
+					  toddlerfun_max_glyphs);
+    toddlerfun->rand = g_rand_new_with_seed (1);
+    toddlerfun->batch_strokes = TRUE;
+    if (render_threads > 0)
+	toddlerfun->render_pool = render_pool_new (render_threads);
+
+    load_theme (toddlerfun, toddlerfun_default_theme_file, 0);
+
+    return toddlerfun;
+}
+
+/*
+ * Start over from an empty canvas of the given size, with the random
+ * sequence from the beginning.
+ */
+static void
+bench_reset (ToddlerFun *toddlerfun, gint width, gint height)
+{
+    if (toddlerfun->canvas == NULL ||
+	toddlerfun->canvas->width != width ||
+	toddlerfun->canvas->height != height) {
+	if (toddlerfun->canvas != NULL)
+	    canvas_free (toddlerfun->canvas);
+	toddlerfun->canvas = NULL;
+	resize_canvas (toddlerfun, width, height);
+    }
+    canvas_clear (toddlerfun->canvas);
+    canvas_materialize_all (toddlerfun->canvas);
+    cairo_region_destroy (canvas_take_damage (toddlerfun->canvas));
+    g_rand_set_seed (toddlerfun->rand, 1);
+    toddlerfun->has_previous = FALSE;
+}
+
+/*
+ * Draw the golden scene of FUNC on an empty canvas of SIZE
+ */
+static void
+bench_draw_scene (ToddlerFun *toddlerfun, const BenchSize *size,
+		  void (*func) (ToddlerFun *toddlerfun, cairo_t *cr))
+{
+    cairo_t *cr;
+    gint i;
+
+    bench_reset (toddlerfun, size->width, size->height);
+    cr = cairo_create (toddlerfun->canvas->surface);
+    for (i = 0; i < bench_golden_ops; i++)
+	(*func) (toddlerfun, cr);
+    cairo_destroy (cr);
+    canvas_materialize_all (toddlerfun->canvas);
+    cairo_surface_flush (toddlerfun->canvas->surface);
+}
+
+/*
+ * Call FUNC until MIN_TIME seconds have passed.  Returns the number of
+ * calls, and the time they took in nanoseconds in ELAPSED.
+ */
+static guint
+bench_time (ToddlerFun *toddlerfun, cairo_t *cr,
+	    void (*func) (ToddlerFun *toddlerfun, cairo_t *cr),
+	    gdouble min_time, gdouble *elapsed)
+{
+    gint64 start, now, end;
+    guint n = 0;
+    gint i;
+
+    // Warm up caches, both ours and the CPU's
+    for (i = 0; i < 8; i++)
+	(*func) (toddlerfun, cr);
+
+    start = g_get_monotonic_time ();
+    end = start + min_time * G_USEC_PER_SEC;
+    do {
+	(*func) (toddlerfun, cr);
+	n++;
+	now = g_get_monotonic_time ();
+    } while (now < end);
+
+    *elapsed = (now - start) * 1000.0;
+    return n;
+}
+
+/*
+ * Compare the canvas to the golden image PATHNAME, or write it there if
+ * UPDATE is set.  Returns a word describing the result.
+ */
+static const gchar *
+bench_golden (ToddlerFunCanvas *canvas, const gchar *pathname,
+	      gboolean update)
+{
+    cairo_surface_t *golden;
+    guchar *a, *b;
+    gint stride_a, stride_b, x, y;
+
+    canvas_materialize_all (canvas);
+    cairo_surface_flush (canvas->surface);
+
+    if (update) {
+	if (cairo_surface_write_to_png (canvas->surface, pathname) !=
+	    CAIRO_STATUS_SUCCESS)
+	    return "error";
+	return "written";
+    }
+
+    golden = cairo_image_surface_create_from_png (pathname);
+    if (cairo_surface_status (golden) != CAIRO_STATUS_SUCCESS) {
+	cairo_surface_destroy (golden);
+	return "missing";
+    }
+
+    if (cairo_image_surface_get_width (golden) != canvas->width ||
+	cairo_image_surface_get_height (golden) != canvas->height) {
+	cairo_surface_destroy (golden);
+	return "mismatch";
+    }
+
+    a = cairo_image_surface_get_data (canvas->surface);
+    b = cairo_image_surface_get_data (golden);
+    stride_a = cairo_image_surface_get_stride (canvas->surface);
+    stride_b = cairo_image_surface_get_stride (golden);
+
+    // Only the color channels are meaningful in RGB24
+    for (y = 0; y < canvas->height; y++) {
+	guint32 *row_a = (guint32 *) (a + y * stride_a);
+	guint32 *row_b = (guint32 *) (b + y * stride_b);
+	for (x = 0; x < canvas->width; x++) {
+	    if ((row_a[x] ^ row_b[x]) & 0x00ffffff) {
+		cairo_surface_destroy (golden);
+		return "mismatch";
+	    }
+	}
+    }
+
+    cairo_surface_destroy (golden);
+    return "match";
+}
+
+/*
+ * The mean difference of the color channels of the golden scenes of
+ * FUNC_A and FUNC_B, from 0 to 255, over the pixels that either of
+ * them drew on
+ */
+static gdouble
+bench_difference (ToddlerFun *toddlerfun, const BenchSize *size,
+		  void (*func_a) (ToddlerFun *toddlerfun, cairo_t *cr),
+		  void (*func_b) (ToddlerFun *toddlerfun, cairo_t *cr))
+{
+    cairo_surface_t *drawn;
+    guchar *a, *b;
+    gint stride_a, stride_b, x, y, i;
+    gdouble sum = 0;
+    gint64 n = 0;
+
+    bench_draw_scene (toddlerfun, size, func_a);
+    drawn = canvas_snapshot (toddlerfun->canvas);
+    bench_draw_scene (toddlerfun, size, func_b);
+
+    a = cairo_image_surface_get_data (drawn);
+    b = cairo_image_surface_get_data (toddlerfun->canvas->surface);
+    stride_a = cairo_image_surface_get_stride (drawn);
+    stride_b = cairo_image_surface_get_stride (toddlerfun->canvas->surface);
+
+    // The canvas is cleared to white
+    for (y = 0; y < size->height; y++) {
+	guint32 *row_a = (guint32 *) (a + y * stride_a);
+	guint32 *row_b = (guint32 *) (b + y * stride_b);
+	for (x = 0; x < size->width; x++) {
+	    if ((row_a[x] & row_b[x] & 0x00ffffff) == 0x00ffffff)
+		continue;
+	    for (i = 0; i < 24; i += 8)
+		sum += ABS ((gint) ((row_a[x] >> i) & 0xff) -
+			    (gint) ((row_b[x] >> i) & 0xff));
+	    n++;
+	}
+    }
+
+    cairo_surface_destroy (drawn);
+    return n == 0 ? 0 : sum / (n * 3.0);
+}
+
+static void
+bench_print (const gchar *name, gint effect_num, const BenchSize *size,
+	     gint threads, guint n, gdouble elapsed)
+{
+    gchar ns[G_ASCII_DTOSTR_BUF_SIZE];
+    gchar ops[G_ASCII_DTOSTR_BUF_SIZE];
+
+    // Not printf, which would use the locale's decimal point
+    g_ascii_formatd (ns, sizeof (ns), "%.1f", elapsed / n);
+    g_ascii_formatd (ops, sizeof (ops), "%.1f", n / (elapsed / 1e9));
+
+    g_print ("{\"name\": \"%s\", \"effect\": %d, \"width\": %d, "
+	     "\"height\": %d, \"threads\": %d, \"iterations\": %u, "
+	     "\"ns_per_op\": %s, \"ops_per_s\": %s",
+	     name, effect_num, size->width, size->height, threads, n,
+	     ns, ops);
+    g_print ("}\n");
+}
+
+static void
+bench_print_golden (const gchar *name, gint effect_num,
+		    const BenchSize *size, const gchar *golden,
+		    gdouble vs_line)
+{
+    gchar diff[G_ASCII_DTOSTR_BUF_SIZE];
+
+    g_print ("{\"name\": \"%s\", \"effect\": %d, \"width\": %d, "
+	     "\"height\": %d, \"golden\": \"%s\"",
+	     name, effect_num, size->width, size->height, golden);
+    if (vs_line >= 0) {
+	g_ascii_formatd (diff, sizeof (diff), "%.3f", vs_line);
+	g_print (", \"vs_line\": %s", diff);
+    }
+    g_print ("}\n");
+}
+
+/*
+ * Draw the scene of BENCH for every effect at the golden size, and
+ * compare it to the images in GOLDEN_DIR, or write them there if
+ * UPDATE is set.  Returns FALSE if any of them differ or are missing,
+ * unless ALLOW_MISSING is set, or if the round brush is too far from
+ * cairo's stroker.
+ */
+static gboolean
+bench_check_golden (ToddlerFun *toddlerfun, const BenchCase *bench,
+		    const gchar *golden_dir, gboolean update,
+		    gboolean allow_missing)
+{
+    const BenchSize *size = &bench_golden_size;
+    gboolean ok = TRUE;
+    gint effect_num;
+
+    for (effect_num = 0; effect_num <= toddlerfun_effect_max; effect_num++) {
+	gchar *filename, *pathname;
+	const gchar *golden;
+	gdouble vs_line = -1;
+
+	toddlerfun->effect_num = effect_num;
+	bench_draw_scene (toddlerfun, size, bench->run);
+
+	filename = g_strdup_printf ("%s-%d.png", bench->name, effect_num);
+	pathname = g_build_filename (golden_dir, filename, NULL);
+	golden = bench_golden (toddlerfun->canvas, pathname, update);
+	if (g_strcmp0 (golden, "match") != 0 &&
+	    g_strcmp0 (golden, "written") != 0 &&
+	    !(allow_missing && g_strcmp0 (golden, "missing") == 0))
+	    ok = FALSE;
+	g_free (pathname);
+	g_free (filename);
+
+	// How far the brush that stands in for cairo's stroker is from
+	// it
+	if (bench->run == bench_brush_round) {
+	    vs_line = bench_difference (toddlerfun, size, bench_capped_brush,
+					bench_capped_line);
+	    if (vs_line > bench_brush_tolerance)
+		ok = FALSE;
+	}
+
+	bench_print_golden (bench->name, effect_num, size, golden, vs_line);
+    }
+
+    return ok;
+}
+
+/*
+ * Resizing draws the whole display list again, so fill it with strokes
+ * first and then go back and forth between two sizes.
+ */
+static void
+bench_configure (ToddlerFun *toddlerfun, const BenchSize *size,
+		 gint threads, gdouble min_time)
+{
+    gint64 start, now, end;
+    guint n = 0;
+    gint i;
+
+    bench_reset (toddlerfun, size->width, size->height);
+    for (i = 0; i < 1000; i++) {
+	ToddlerFunPoint point;
+	point.x = g_rand_int_range (toddlerfun->rand, 0, size->width);
+	point.y = g_rand_int_range (toddlerfun->rand, 0, size->height);
+	g_array_append_val (toddlerfun->motion_points, point);
+    }
+    drain_motion (toddlerfun);
+
+    start = g_get_monotonic_time ();
+    end = start + min_time * G_USEC_PER_SEC;
+    do {
+	if (n % 2 == 0)
+	    resize_canvas (toddlerfun, size->width * 3 / 4,
+			   size->height * 3 / 4);
+	else
+	    resize_canvas (toddlerfun, size->width, size->height);
+	canvas_materialize_all (toddlerfun->canvas);
+	n++;
+	now = g_get_monotonic_time ();
+    } while (now < end);
+
+    bench_print ("configure", toddlerfun->effect_num, size, threads, n,
+		 (now - start) * 1000.0);
+
+    // Don't leave the strokes in for the next benchmark
+    display_list_free (toddlerfun->display_list);
+    toddlerfun->display_list = display_list_new ();
+}
+
+int
+main (int argc, char *argv[])
+{
+    ToddlerFun *toddlerfun;
+    GOptionContext *option_context;
+    GError *error = NULL;
+    gdouble min_time = 0.25;
+    gchar *golden_dir = NULL;
+    gboolean update_golden = FALSE;
+    gboolean allow_missing_golden = FALSE;
+    gchar *filter = NULL;
+    gint render_threads = 0;
+    gboolean failed = FALSE;
+    guint c, s;
+    gint effect_num;
+
+    GOptionEntry options [] =
+	{
+	    { "min-time", 't', 0, G_OPTION_ARG_DOUBLE, &min_time,
+	      "Run each benchmark for at least SECONDS", "SECONDS" },
+	    { "filter", 'f', 0, G_OPTION_ARG_STRING, &filter,
+	      "Only run benchmarks whose name contains NAME", "NAME" },
+	    { "render-threads", 0, 0, G_OPTION_ARG_INT, &render_threads,
+	      "Draw mirror effects using N threads", "N" },
+	    { "golden-dir", 'g', 0, G_OPTION_ARG_FILENAME, &golden_dir,
+	      "Compare drawings to the golden images in DIR", "DIR" },
+	    { "update-golden", 0, 0, G_OPTION_ARG_NONE, &update_golden,
+	      "Write the golden images instead of comparing", NULL },
+	    { "allow-missing-golden", 0, 0, G_OPTION_ARG_NONE,
+	      &allow_missing_golden,
+	      "Don't fail for drawings that have no golden image", NULL },
+	    { NULL }
+	};
+
+    setlocale (LC_ALL, "");
+
+    option_context = g_option_context_new (NULL);
+    g_option_context_set_summary (option_context,
+				  "Benchmarks for the drawing primitives "
+				  "of Toddler Fun.");
+    g_option_context_add_main_entries (option_context, options, NULL);
+    if (!g_option_context_parse (option_context, &argc, &argv, &error)) {
+	g_printerr ("option parsing failed: %s\n", error->message);
+	return 1;
+    }
+
+    if (golden_dir != NULL && update_golden)
+	g_mkdir_with_parents (golden_dir, 0755);
+
+    toddlerfun = bench_toddlerfun_new (render_threads);
+
+    for (s = 0; s < G_N_ELEMENTS (bench_sizes); s++) {
+	const BenchSize *size = &bench_sizes[s];
+
+	for (c = 0; c < G_N_ELEMENTS (bench_cases); c++) {
+	    const BenchCase *bench = &bench_cases[c];
+	    gint max_effect;
+
+	    if (filter != NULL && strstr (bench->name, filter) == NULL)
+		continue;
+	    if (bench->run == bench_image &&
+		theme_get_n_objects (toddlerfun->theme) == 0) {
+		if (s == 0)
+		    g_printerr ("No theme images found, skipping image\n");
+		continue;
+	    }
+
+	    max_effect = bench->per_effect ? toddlerfun_effect_max : 0;
+	    for (effect_num = 0; effect_num <= max_effect; effect_num++) {
+		cairo_t *cr;
+		gdouble elapsed;
+		guint n;
+
+		toddlerfun->effect_num = effect_num;
+		bench_reset (toddlerfun, size->width, size->height);
+		cr = cairo_create (toddlerfun->canvas->surface);
+		n = bench_time (toddlerfun, cr, bench->run, min_time,
+				&elapsed);
+		cairo_destroy (cr);
+
+		bench_print (bench->name, effect_num, size, render_threads,
+			     n, elapsed);
+	    }
+	}
+
+	if (filter == NULL || strstr ("configure", filter) != NULL) {
+	    for (effect_num = 0; effect_num <= toddlerfun_effect_max;
+		 effect_num++) {
+		toddlerfun->effect_num = effect_num;
+		bench_configure (toddlerfun, size, render_threads, min_time);
+	    }
+	}
+    }
+
+    if (golden_dir != NULL) {
+	for (c = 0; c < G_N_ELEMENTS (bench_cases); c++) {
+	    const BenchCase *bench = &bench_cases[c];
+
+	    if (!bench->per_effect ||
+		(filter != NULL && strstr (bench->name, filter) == NULL))
+		continue;
+	    if (bench->run == bench_image &&
+		theme_get_n_objects (toddlerfun->theme) == 0)
+		continue;
+	    if (!bench_check_golden (toddlerfun, bench, golden_dir,
+				     update_golden, allow_missing_golden))
+		failed = TRUE;
+	}
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,21 @@
+/*
+ * brush.h
+ * Painting strokes straight into the canvas pixels
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ */
+
+typedef enum {
+    BRUSH_ROUND,
+    BRUSH_AIRBRUSH,
+    BRUSH_STAMP,
+    BRUSH_N_TYPES
+} ToddlerFunBrushType;
+
+gboolean brush_type_from_name (const gchar *name, ToddlerFunBrushType *type);
+gdouble brush_get_reach (ToddlerFunBrushType type, gdouble radius);
+void brush_stroke (guchar *data, gint stride, gint width, gint height,
+		   ToddlerFunBrushType type, gdouble radius,
+		   gdouble x1, gdouble y1, gdouble x2, gdouble y2,
+		   gboolean start_cap,
+		   gdouble red, gdouble green, gdouble blue, gdouble alpha);
@@ -0,0 +1,346 @@
+/*
+ * canvas.c
+ * The drawing surface, with fading and damage tracked per tile
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ * Fading the whole picture every couple of seconds would mean
+ * rewriting every pixel even when almost nothing has been drawn.
+ * Instead, canvas_fade only counts the fade.  Each tile remembers how
+ * many fades it has seen, and the missing ones are applied in one go,
+ * through a lookup table, when the tile is drawn to, shown or saved.
+ * Tiles that have never been drawn on, or that have faded as far as
+ * they ever will, are just brought up to date without touching pixels.
+ *
+ * The same tiles are used for damage: drawing and fading mark the tiles
+ * that change as dirty, and canvas_take_damage turns those into the
+ * region that needs to be repainted on screen.
+ */
+
+#include <config.h>
+#include <string.h>
+#include <glib.h>
+#include <cairo.h>
+#include "fade.h"
+#include "canvas.h"
+
+static const gdouble canvas_fade_alpha = 0.1;
+
+static FadeLut *fade_luts = NULL;
+static gint fade_settle_steps = 0;
+
+static void
+ensure_fade_luts (void)
+{
+    if (fade_luts == NULL)
+	fade_settle_steps = fade_build_luts (&fade_luts, canvas_fade_alpha);
+}
+
+/*
+ * The number of fades after which nothing drawn is visible any more,
+ * or at least will never change again.
+ */
+gint
+canvas_get_fades_to_settle (void)
+{
+    ensure_fade_luts ();
+    return fade_settle_steps;
+}
+
+ToddlerFunCanvas *
+canvas_new (gint width, gint height)
+{
+    return canvas_new_for_surface (
+	cairo_image_surface_create (CAIRO_FORMAT_RGB24, width, height));
+}
+
+/*
+ * Make a canvas of SURFACE, which must be an RGB24 image surface, and
+ * take over the reference to it.  Lets the surface come from somewhere
+ * the display can show it from without converting it.
+ */
+ToddlerFunCanvas *
+canvas_new_for_surface (cairo_surface_t *surface)
+{
+    ToddlerFunCanvas *canvas;
+    gint width, height;
+
+    ensure_fade_luts ();
+
+    width = cairo_image_surface_get_width (surface);
+    height = cairo_image_surface_get_height (surface);
+
+    canvas = g_new0 (ToddlerFunCanvas, 1);
+    canvas->surface = surface;
+    canvas->width = width;
+    canvas->height = height;
+    canvas->tiles_x = (width + CANVAS_TILE_SIZE - 1) / CANVAS_TILE_SIZE;
+    canvas->tiles_y = (height + CANVAS_TILE_SIZE - 1) / CANVAS_TILE_SIZE;
+    canvas->tiles = g_new0 (ToddlerFunTile, canvas->tiles_x * canvas->tiles_y);
+
+    canvas_clear (canvas);
+
+    return canvas;
+}
+
+void
+canvas_free (ToddlerFunCanvas *canvas)
+{
+    cairo_surface_destroy (canvas->surface);
+    g_free (canvas->tiles);
+    g_free (canvas);
+}
+
+void
+canvas_clear (ToddlerFunCanvas *canvas)
+{
+    gint i;
+
+    cairo_surface_flush (canvas->surface);
+    fade_clear (cairo_image_surface_get_data (canvas->surface),
+		cairo_image_surface_get_stride (canvas->surface),
+		0, 0, canvas->width, canvas->height);
+    cairo_surface_mark_dirty (canvas->surface);
+
+    for (i = 0; i < canvas->tiles_x * canvas->tiles_y; i++) {
+	canvas->tiles[i].fade_epoch = canvas->fade_epoch;
+	canvas->tiles[i].inked = FALSE;
+	canvas->tiles[i].dirty = TRUE;
+    }
+}
+
+/*
+ * Fade the whole picture 10% towards white.  Nothing is done to the
+ * pixels until they are needed; only the tiles that have ink in them
+ * are marked as needing a repaint.
+ */
+void
+canvas_fade (ToddlerFunCanvas *canvas)
+{
+    gint i;
+
+    canvas->fade_epoch++;
+
+    for (i = 0; i < canvas->tiles_x * canvas->tiles_y; i++) {
+	if (canvas->tiles[i].inked)
+	    canvas->tiles[i].dirty = TRUE;
+    }
+}
+
+/*
+ * Apply the fades a tile has missed.  Returns TRUE if any pixels were
+ * changed.
+ */
+static gboolean
+materialize_tile (ToddlerFunCanvas *canvas, guchar *data, gint stride,
+		  gint tx, gint ty)
+{
+    ToddlerFunTile *tile = &canvas->tiles[ty * canvas->tiles_x + tx];
+    guint pending = canvas->fade_epoch - tile->fade_epoch;
+    gint x, y, width, height;
+
+    if (pending == 0)
+	return FALSE;
+
+    tile->fade_epoch = canvas->fade_epoch;
+    if (!tile->inked)
+	return FALSE;
+
+    x = tx * CANVAS_TILE_SIZE;
+    y = ty * CANVAS_TILE_SIZE;
+    width = MIN (CANVAS_TILE_SIZE, canvas->width - x);
+    height = MIN (CANVAS_TILE_SIZE, canvas->height - y);
+
+    if (pending == 1)
+	fade_brighten (data, stride, x, y, width, height, canvas_fade_alpha);
+    else
+	fade_apply_lut (data, stride, x, y, width, height,
+			fade_luts[MIN (pending, (guint) fade_settle_steps)]);
+
+    // Nothing left to fade in this tile
+    if (pending >= (guint) fade_settle_steps)
+	tile->inked = FALSE;
+
+    return TRUE;
+}
+
+/*
+ * Make the pixels within the given rectangle, limited to rows MIN_Y up
+ * to MAX_Y, reflect all fades so far.  If SYNC is TRUE, the surface is
+ * flushed and marked dirty around the change.  The tile range covering
+ * the rectangle is returned through the last arguments; FALSE is
+ * returned if the rectangle is outside the canvas.
+ */
+static gboolean
+materialize_area (ToddlerFunCanvas *canvas,
+		  gint x, gint y, gint width, gint height,
+		  gint min_y, gint max_y, gboolean sync,
+		  gint *tx1, gint *ty1, gint *tx2, gint *ty2)
+{
+    guchar *data;
+    gint stride, tx, ty;
+    gboolean changed = FALSE;
+
+    if (width <= 0 || height <= 0)
+	return FALSE;
+
+    *tx1 = MAX (x, 0) / CANVAS_TILE_SIZE;
+    *ty1 = MAX (y, min_y) / CANVAS_TILE_SIZE;
+    *tx2 = MIN (x + width - 1, canvas->width - 1) / CANVAS_TILE_SIZE;
+    *ty2 = MIN (y + height - 1, max_y) / CANVAS_TILE_SIZE;
+
+    if (x + width <= 0 || y + height <= min_y || *tx1 > *tx2 || *ty1 > *ty2)
+	return FALSE;
+
+    if (sync)
+	cairo_surface_flush (canvas->surface);
+    data = cairo_image_surface_get_data (canvas->surface);
+    stride = cairo_image_surface_get_stride (canvas->surface);
+
+    for (ty = *ty1; ty <= *ty2; ty++)
+	for (tx = *tx1; tx <= *tx2; tx++)
+	    changed |= materialize_tile (canvas, data, stride, tx, ty);
+
+    if (changed && sync) {
+	gint px = *tx1 * CANVAS_TILE_SIZE;
+	gint py = *ty1 * CANVAS_TILE_SIZE;
+	cairo_surface_mark_dirty_rectangle (canvas->surface, px, py,
+					    MIN ((*tx2 + 1) * CANVAS_TILE_SIZE,
+						 canvas->width) - px,
+					    MIN ((*ty2 + 1) * CANVAS_TILE_SIZE,
+						 canvas->height) - py);
+    }
+
+    return TRUE;
+}
+
+void
+canvas_materialize (ToddlerFunCanvas *canvas,
+		    gint x, gint y, gint width, gint height)
+{
+    gint tx1, ty1, tx2, ty2;
+
+    materialize_area (canvas, x, y, width, height, 0, canvas->height - 1,
+		      TRUE, &tx1, &ty1, &tx2, &ty2);
+}
+
+void
+canvas_materialize_all (ToddlerFunCanvas *canvas)
+{
+    canvas_materialize (canvas, 0, 0, canvas->width, canvas->height);
+}
+
+/*
+ * Get a copy of the canvas as it looks now, with all fades applied.
+ */
+cairo_surface_t *
+canvas_snapshot (ToddlerFunCanvas *canvas)
+{
+    cairo_surface_t *snapshot;
+    guchar *src, *dst;
+    gint src_stride, dst_stride, row;
+
+    canvas_materialize_all (canvas);
+
+    snapshot = cairo_image_surface_create (CAIRO_FORMAT_RGB24,
+					   canvas->width, canvas->height);
+
+    cairo_surface_flush (canvas->surface);
+    src = cairo_image_surface_get_data (canvas->surface);
+    src_stride = cairo_image_surface_get_stride (canvas->surface);
+    dst = cairo_image_surface_get_data (snapshot);
+    dst_stride = cairo_image_surface_get_stride (snapshot);
+
+    for (row = 0; row < canvas->height; row++)
+	memcpy (dst + row * dst_stride, src + row * src_stride,
+		canvas->width * 4);
+    cairo_surface_mark_dirty (snapshot);
+
+    return snapshot;
+}
+
+static void
+touch_area (ToddlerFunCanvas *canvas,
+	    gint x, gint y, gint width, gint height,
+	    gint min_y, gint max_y, gboolean sync)
+{
+    gint tx1, ty1, tx2, ty2, tx, ty;
+
+    if (!materialize_area (canvas, x, y, width, height, min_y, max_y, sync,
+			   &tx1, &ty1, &tx2, &ty2))
+	return;
+
+    for (ty = ty1; ty <= ty2; ty++)
+	for (tx = tx1; tx <= tx2; tx++) {
+	    ToddlerFunTile *tile = &canvas->tiles[ty * canvas->tiles_x + tx];
+	    tile->inked = TRUE;
+	    tile->dirty = TRUE;
+	}
+}
+
+/*
+ * Call before drawing within the given rectangle: brings it up to date,
+ * remembers that it now has ink that will need fading and marks it as
+ * damaged.
+ */
+void
+canvas_touch (ToddlerFunCanvas *canvas,
+	      gint x, gint y, gint width, gint height)
+{
+    touch_area (canvas, x, y, width, height, 0, canvas->height - 1, TRUE);
+}
+
+/*
+ * Same as canvas_touch, for one band of a drawing split by rows
+ * between threads.  Only tiles within the band are touched, and the
+ * surface is not flushed or marked dirty; that has to be done once
+ * around the whole drawing.  The band must start and end on tile
+ * boundaries, so that no two threads touch the same tile.
+ */
+void
+canvas_touch_band (ToddlerFunCanvas *canvas,
+		   gint x, gint y, gint width, gint height,
+		   gint band_y, gint band_height)
+{
+    touch_area (canvas, x, y, width, height,
+		band_y, MIN (band_y + band_height, canvas->height) - 1, FALSE);
+}
+
+/*
+ * Get the region covered by all tiles damaged since the last call, and
+ * reset the damage.  Runs of dirty tiles on a row become one rectangle;
+ * cairo merges identical runs on neighbouring rows.
+ */
+cairo_region_t *
+canvas_take_damage (ToddlerFunCanvas *canvas)
+{
+    cairo_region_t *region = cairo_region_create ();
+    cairo_rectangle_int_t rectangle;
+    gint tx, ty, run_start;
+
+    for (ty = 0; ty < canvas->tiles_y; ty++) {
+	run_start = -1;
+	for (tx = 0; tx <= canvas->tiles_x; tx++) {
+	    ToddlerFunTile *tile = NULL;
+
+	    if (tx < canvas->tiles_x)
+		tile = &canvas->tiles[ty * canvas->tiles_x + tx];
+
+	    if (tile != NULL && tile->dirty) {
+		tile->dirty = FALSE;
+		if (run_start < 0)
+		    run_start = tx;
+	    } else if (run_start >= 0) {
+		rectangle.x = run_start * CANVAS_TILE_SIZE;
+		rectangle.y = ty * CANVAS_TILE_SIZE;
+		rectangle.width = MIN (tx * CANVAS_TILE_SIZE,
+				       canvas->width) - rectangle.x;
+		rectangle.height = MIN ((ty + 1) * CANVAS_TILE_SIZE,
+					canvas->height) - rectangle.y;
+		cairo_region_union_rectangle (region, &rectangle);
+		run_start = -1;
+	    }
+	}
+    }
+
+    return region;
+}
@@ -0,0 +1,45 @@
+/*
+ * canvas.h
+ * The drawing surface, with fading and damage tracked per tile
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ */
+
+#define CANVAS_TILE_SIZE 64
+
+typedef struct {
+    guint fade_epoch;
+    gboolean inked;
+    gboolean dirty;
+} ToddlerFunTile;
+
+typedef struct {
+    cairo_surface_t *surface;
+    gint width;
+    gint height;
+
+    // Tile grid
+    gint tiles_x;
+    gint tiles_y;
+    ToddlerFunTile *tiles;
+
+    // Number of fades requested so far
+    guint fade_epoch;
+} ToddlerFunCanvas;
+
+gint canvas_get_fades_to_settle (void);
+ToddlerFunCanvas *canvas_new (gint width, gint height);
+ToddlerFunCanvas *canvas_new_for_surface (cairo_surface_t *surface);
+void canvas_free (ToddlerFunCanvas *canvas);
+void canvas_clear (ToddlerFunCanvas *canvas);
+void canvas_fade (ToddlerFunCanvas *canvas);
+void canvas_materialize (ToddlerFunCanvas *canvas,
+			 gint x, gint y, gint width, gint height);
+void canvas_materialize_all (ToddlerFunCanvas *canvas);
+cairo_surface_t *canvas_snapshot (ToddlerFunCanvas *canvas);
+void canvas_touch (ToddlerFunCanvas *canvas,
+		   gint x, gint y, gint width, gint height);
+void canvas_touch_band (ToddlerFunCanvas *canvas,
+			gint x, gint y, gint width, gint height,
+			gint band_y, gint band_height);
+cairo_region_t *canvas_take_damage (ToddlerFunCanvas *canvas);
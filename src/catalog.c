@@ -0,0 +1,277 @@
+/*
+ * catalog.c
+ * Finding the installed themes
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ * Themes are directories with a theme.xml, in a "themes" directory
+ * under the user's and the system's data directories.  A theme in the
+ * user's directory hides one with the same name further down.  The
+ * default theme that comes with Toddler Fun is always there, as
+ * "default".
+ *
+ * What was found is kept in an index in the user's cache directory,
+ * along with the modification times of the directories it came from.
+ * Only directories that have changed since are read again, so starting
+ * doesn't mean parsing every theme.xml.
+ */
+
+#include <config.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <librsvg/rsvg.h>
+#include "theme.h"
+#include "catalog.h"
+
+#define CATALOG_DEFAULT_ID "default"
+#define CATALOG_THEME_FILE "theme.xml"
+
+static gint64
+get_mtime (const gchar *path)
+{
+    GStatBuf buf;
+
+    if (g_stat (path, &buf) != 0)
+	return 0;
+    return buf.st_mtime;
+}
+
+static gchar *
+get_index_file (void)
+{
+    return g_build_filename (g_get_user_cache_dir (), PACKAGE,
+			     "themes.index", NULL);
+}
+
+static gint
+compare_names (gconstpointer a, gconstpointer b)
+{
+    return strcmp (*(const gchar **) a, *(const gchar **) b);
+}
+
+static void
+entry_free (ToddlerFunCatalogEntry *entry)
+{
+    g_free (entry->id);
+    g_free (entry->name);
+    g_free (entry->filename);
+    g_free (entry);
+}
+
+/*
+ * Add the theme ID in DIR, from the index if it hasn't changed since it
+ * was indexed, and otherwise by reading its theme.xml.  Sets *DIRTY if
+ * the index was updated.
+ */
+static void
+add_theme (ToddlerFunCatalog *catalog, GKeyFile *index,
+	   const gchar *id, const gchar *dir, gboolean *dirty)
+{
+    ToddlerFunCatalogEntry *entry;
+    gchar *group;
+    gint64 mtime;
+
+    if (catalog_find (catalog, id) != NULL)
+	return;
+
+    entry = g_new0 (ToddlerFunCatalogEntry, 1);
+    entry->id = g_strdup (id);
+    entry->filename = g_build_filename (dir, CATALOG_THEME_FILE, NULL);
+
+    // The directory changes when files are added or replaced, but not
+    // when theme.xml is edited in place
+    mtime = MAX (get_mtime (dir), get_mtime (entry->filename));
+    if (mtime == 0) {
+	entry_free (entry);
+	return;
+    }
+
+    group = g_strconcat ("theme ", dir, NULL);
+    if (g_key_file_get_int64 (index, group, "mtime", NULL) == mtime) {
+	entry->name = g_key_file_get_string (index, group, "name", NULL);
+	entry->n_objects = g_key_file_get_integer (index, group,
+						   "objects", NULL);
+    } else {
+	ToddlerFunTheme *theme = theme_new ();
+
+	theme_read_xml (theme, entry->filename);
+	if (theme->parsed_ok) {
+	    entry->name = g_strdup (theme->name);
+	    entry->n_objects = theme_get_n_objects (theme);
+	}
+	theme_free (theme);
+
+	g_key_file_set_int64 (index, group, "mtime", mtime);
+	g_key_file_set_string (index, group, "name",
+			       entry->name != NULL ? entry->name : "");
+	g_key_file_set_integer (index, group, "objects", entry->n_objects);
+	*dirty = TRUE;
+    }
+    g_free (group);
+
+    // Themes that don't parse are left out, but stay in the index so
+    // that they aren't read again until they change
+    if (entry->n_objects == 0) {
+	entry_free (entry);
+	return;
+    }
+
+    if (entry->name == NULL || entry->name[0] == '\0') {
+	g_free (entry->name);
+	entry->name = g_strdup (id);
+    }
+
+    g_ptr_array_add (catalog->entries, entry);
+}
+
+/*
+ * Add the themes in the directory DIR, listing it again if it has
+ * changed since it was indexed
+ */
+static void
+add_themes_in (ToddlerFunCatalog *catalog, GKeyFile *index,
+	       const gchar *dir, gboolean *dirty)
+{
+    gchar **names;
+    gchar *group;
+    gint64 mtime;
+    gint i;
+
+    mtime = get_mtime (dir);
+    if (mtime == 0)
+	return;
+
+    group = g_strconcat ("dir ", dir, NULL);
+    if (g_key_file_get_int64 (index, group, "mtime", NULL) == mtime) {
+	names = g_key_file_get_string_list (index, group, "themes",
+					    NULL, NULL);
+    } else {
+	GPtrArray *found = g_ptr_array_new ();
+	const gchar *name;
+	GDir *gdir;
+
+	gdir = g_dir_open (dir, 0, NULL);
+	while (gdir != NULL && (name = g_dir_read_name (gdir)) != NULL) {
+	    gchar *filename;
+
+	    filename = g_build_filename (dir, name, CATALOG_THEME_FILE,
+					 NULL);
+	    if (g_file_test (filename, G_FILE_TEST_IS_REGULAR))
+		g_ptr_array_add (found, g_strdup (name));
+	    g_free (filename);
+	}
+	if (gdir != NULL)
+	    g_dir_close (gdir);
+
+	g_ptr_array_sort (found, compare_names);
+	g_ptr_array_add (found, NULL);
+	names = (gchar **) g_ptr_array_free (found, FALSE);
+
+	g_key_file_set_int64 (index, group, "mtime", mtime);
+	g_key_file_set_string_list (index, group, "themes",
+				    (const gchar * const *) names,
+				    g_strv_length (names));
+	*dirty = TRUE;
+    }
+    g_free (group);
+
+    for (i = 0; names != NULL && names[i] != NULL; i++) {
+	gchar *theme_dir = g_build_filename (dir, names[i], NULL);
+	add_theme (catalog, index, names[i], theme_dir, dirty);
+	g_free (theme_dir);
+    }
+    g_strfreev (names);
+}
+
+/*
+ * Find the themes, using the index where it is up to date and writing
+ * it back if it wasn't
+ */
+ToddlerFunCatalog *
+catalog_new (void)
+{
+    ToddlerFunCatalog *catalog;
+    const gchar * const *system_dirs;
+    GKeyFile *index;
+    gchar *index_file, *dir;
+    gboolean dirty = FALSE;
+    gint i;
+
+    catalog = g_new0 (ToddlerFunCatalog, 1);
+    catalog->entries = g_ptr_array_new_with_free_func ((GDestroyNotify)
+						       entry_free);
+
+    index_file = get_index_file ();
+    index = g_key_file_new ();
+    g_key_file_load_from_file (index, index_file, G_KEY_FILE_NONE, NULL);
+
+    add_theme (catalog, index, CATALOG_DEFAULT_ID,
+	       DATADIR "/defaulttheme", &dirty);
+
+    dir = g_build_filename (g_get_user_data_dir (), PACKAGE, "themes", NULL);
+    add_themes_in (catalog, index, dir, &dirty);
+    g_free (dir);
+
+    system_dirs = g_get_system_data_dirs ();
+    for (i = 0; system_dirs[i] != NULL; i++) {
+	dir = g_build_filename (system_dirs[i], PACKAGE, "themes", NULL);
+	add_themes_in (catalog, index, dir, &dirty);
+	g_free (dir);
+    }
+
+    if (dirty) {
+	gchar *data, *index_dir;
+	gsize length;
+
+	index_dir = g_path_get_dirname (index_file);
+	g_mkdir_with_parents (index_dir, 0755);
+	data = g_key_file_to_data (index, &length, NULL);
+	g_file_set_contents (index_file, data, length, NULL);
+	g_free (data);
+	g_free (index_dir);
+    }
+
+    g_key_file_free (index);
+    g_free (index_file);
+
+    return catalog;
+}
+
+void
+catalog_free (ToddlerFunCatalog *catalog)
+{
+    g_ptr_array_free (catalog->entries, TRUE);
+    g_free (catalog);
+}
+
+ToddlerFunCatalogEntry *
+catalog_find (ToddlerFunCatalog *catalog, const gchar *id)
+{
+    guint i;
+
+    for (i = 0; i < catalog->entries->len; i++) {
+	ToddlerFunCatalogEntry *entry;
+
+	entry = g_ptr_array_index (catalog->entries, i);
+	if (strcmp (entry->id, id) == 0)
+	    return entry;
+    }
+
+    return NULL;
+}
+
+ToddlerFunCatalogEntry *
+catalog_find_file (ToddlerFunCatalog *catalog, const gchar *filename)
+{
+    guint i;
+
+    for (i = 0; i < catalog->entries->len; i++) {
+	ToddlerFunCatalogEntry *entry;
+
+	entry = g_ptr_array_index (catalog->entries, i);
+	if (strcmp (entry->filename, filename) == 0)
+	    return entry;
+    }
+
+    return NULL;
+}
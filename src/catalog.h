@@ -0,0 +1,24 @@
+/*
+ * catalog.h
+ * Finding the installed themes
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ */
+
+typedef struct {
+    gchar *id;			// name of the theme directory
+    gchar *name;		// from theme.xml, or the id
+    gchar *filename;		// the theme.xml
+    gint n_objects;
+} ToddlerFunCatalogEntry;
+
+typedef struct {
+    GPtrArray *entries;
+} ToddlerFunCatalog;
+
+ToddlerFunCatalog *catalog_new (void);
+void catalog_free (ToddlerFunCatalog *catalog);
+ToddlerFunCatalogEntry *catalog_find (ToddlerFunCatalog *catalog,
+				      const gchar *id);
+ToddlerFunCatalogEntry *catalog_find_file (ToddlerFunCatalog *catalog,
+					   const gchar *filename);
@@ -0,0 +1,132 @@
+/*
+ * displaylist.c
+ * Record of everything drawn on the canvas
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ * Every line, image and letter drawn is appended here together with
+ * the effect it was drawn with and the number of fades done before it.
+ * That is enough to draw the picture again at any size or to a vector
+ * surface.  Positions stay as they were recorded, and are scaled to
+ * the canvas when drawn, so resizing back and forth loses nothing.
+ * Operations that have been faded away completely are dropped from the
+ * front, so the list does not grow without bound.
+ */
+
+#include <config.h>
+#include <glib.h>
+#include "displaylist.h"
+
+ToddlerFunDisplayList *
+display_list_new (void)
+{
+    ToddlerFunDisplayList *list = g_new0 (ToddlerFunDisplayList, 1);
+    list->ops = g_array_new (FALSE, FALSE, sizeof (ToddlerFunOp));
+    return list;
+}
+
+/*
+ * A copy of the operations in LIST that are still there, which can be
+ * read from another thread
+ */
+ToddlerFunDisplayList *
+display_list_copy (ToddlerFunDisplayList *list)
+{
+    ToddlerFunDisplayList *copy = display_list_new ();
+
+    if (display_list_get_n_ops (list) > 0)
+	g_array_append_vals (copy->ops, display_list_get_op (list, 0),
+			     display_list_get_n_ops (list));
+    copy->width = list->width;
+    copy->height = list->height;
+
+    return copy;
+}
+
+void
+display_list_free (ToddlerFunDisplayList *list)
+{
+    g_array_free (list->ops, TRUE);
+    g_free (list);
+}
+
+/*
+ * Append OP, drawn on a canvas of WIDTH x HEIGHT.  Positions are kept
+ * for the size of the canvas when the oldest operation in the list was
+ * drawn, so OP is only scaled if the canvas has been resized since.
+ */
+void
+display_list_append (ToddlerFunDisplayList *list, const ToddlerFunOp *op,
+		     gint width, gint height)
+{
+    ToddlerFunOp *copy;
+    gdouble scale_x, scale_y;
+
+    if (display_list_get_n_ops (list) == 0) {
+	list->width = width;
+	list->height = height;
+    }
+
+    g_array_append_vals (list->ops, op, 1);
+    if (width == list->width && height == list->height)
+	return;
+
+    scale_x = (gdouble) list->width / width;
+    scale_y = (gdouble) list->height / height;
+    copy = &g_array_index (list->ops, ToddlerFunOp, list->ops->len - 1);
+    copy->x *= scale_x;
+    copy->y *= scale_y;
+    if (copy->type == TODDLERFUN_OP_LINE) {
+	copy->u.line.from_x *= scale_x;
+	copy->u.line.from_y *= scale_y;
+    }
+}
+
+guint
+display_list_get_n_ops (ToddlerFunDisplayList *list)
+{
+    return list->ops->len - list->start;
+}
+
+ToddlerFunOp *
+display_list_get_op (ToddlerFunDisplayList *list, guint i)
+{
+    return &g_array_index (list->ops, ToddlerFunOp, list->start + i);
+}
+
+/*
+ * Drop the operations that have been through at least MAX_FADES fades,
+ * with FADE_COUNT fades done so far.  Operations are appended in order,
+ * so these are all at the front.
+ */
+void
+display_list_prune (ToddlerFunDisplayList *list,
+		    guint fade_count, guint max_fades)
+{
+    while (list->start < list->ops->len) {
+	ToddlerFunOp *op = &g_array_index (list->ops, ToddlerFunOp,
+					   list->start);
+	if (fade_count - op->fade_count < max_fades)
+	    break;
+	list->start++;
+    }
+
+    // Move the live operations down once the dead ones take up more
+    // than half of the array
+    if (list->start > 0 && list->start >= list->ops->len / 2) {
+	g_array_remove_range (list->ops, 0, list->start);
+	list->start = 0;
+    }
+}
+
+/*
+ * Get the factors that positions in LIST are multiplied by to draw
+ * them on a canvas of WIDTH x HEIGHT
+ */
+void
+display_list_get_scale (ToddlerFunDisplayList *list,
+			gint width, gint height,
+			gdouble *scale_x, gdouble *scale_y)
+{
+    *scale_x = list->width > 0 ? (gdouble) width / list->width : 1;
+    *scale_y = list->height > 0 ? (gdouble) height / list->height : 1;
+}
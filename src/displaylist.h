@@ -0,0 +1,57 @@
+/*
+ * displaylist.h
+ * Record of everything drawn on the canvas
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ */
+
+typedef enum {
+    TODDLERFUN_OP_LINE,
+    TODDLERFUN_OP_IMAGE,
+    TODDLERFUN_OP_STRING
+} ToddlerFunOpType;
+
+typedef struct {
+    guint8 type;
+    guint8 effect_num;
+    guint fade_count;
+    gfloat x;
+    gfloat y;
+    union {
+	struct {
+	    gfloat from_x;
+	    gfloat from_y;
+	    gfloat hue;
+	} line;
+	struct {
+	    const gchar *image_file;	// interned
+	    gfloat rotation;
+	} image;
+	struct {
+	    gchar text[8];
+	    gfloat hue;
+	} string;
+    } u;
+} ToddlerFunOp;
+
+typedef struct {
+    GArray *ops;
+    guint start;
+
+    // Size of the canvas the positions are for
+    gint width;
+    gint height;
+} ToddlerFunDisplayList;
+
+ToddlerFunDisplayList *display_list_new (void);
+ToddlerFunDisplayList *display_list_copy (ToddlerFunDisplayList *list);
+void display_list_free (ToddlerFunDisplayList *list);
+void display_list_append (ToddlerFunDisplayList *list, const ToddlerFunOp *op,
+			  gint width, gint height);
+guint display_list_get_n_ops (ToddlerFunDisplayList *list);
+ToddlerFunOp *display_list_get_op (ToddlerFunDisplayList *list, guint i);
+void display_list_prune (ToddlerFunDisplayList *list,
+			 guint fade_count, guint max_fades);
+void display_list_get_scale (ToddlerFunDisplayList *list,
+			     gint width, gint height,
+			     gdouble *scale_x, gdouble *scale_y);
@@ -0,0 +1,219 @@
+/*
+ * fade.c
+ * Pixel kernels for fading and clearing the canvas
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ * These work directly on the data of a CAIRO_FORMAT_RGB24 image
+ * surface.  fade_brighten gives the same result as painting white with
+ * cairo_paint_with_alpha: every byte d becomes a + d * (255 - a) / 255,
+ * rounded the way pixman does it, where a is the alpha as an 8-bit
+ * value.  Callers must flush the surface before and mark it dirty
+ * after.
+ */
+
+#include <config.h>
+#include <string.h>
+#include <glib.h>
+#include "fade.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FADE_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+typedef void (*FadeRowFunc) (guchar *p, gint n_bytes, guint alpha);
+
+static FadeRowFunc brighten_row = NULL;
+
+static guint
+alpha_to_8bit (gdouble alpha)
+{
+    // Same conversion as cairo does for a solid color: to 16 bits,
+    // then pixman keeps the high byte.
+    return ((guint) (CLAMP (alpha, 0.0, 1.0) * 65535 + 0.5)) >> 8;
+}
+
+static inline guchar
+brighten_byte (guchar d, guint alpha)
+{
+    guint t = d * (255 - alpha) + 0x80;
+    return alpha + (((t >> 8) + t) >> 8);
+}
+
+static void
+brighten_row_scalar (guchar *p, gint n_bytes, guint alpha)
+{
+    gint i;
+    for (i = 0; i < n_bytes; i++)
+	p[i] = brighten_byte (p[i], alpha);
+}
+
+#ifdef FADE_X86_DISPATCH
+
+__attribute__((target("sse2")))
+static void
+brighten_row_sse2 (guchar *p, gint n_bytes, guint alpha)
+{
+    const __m128i zero = _mm_setzero_si128 ();
+    const __m128i inverse = _mm_set1_epi16 (255 - alpha);
+    const __m128i half = _mm_set1_epi16 (0x80);
+    const __m128i div255 = _mm_set1_epi16 (0x0101);
+    const __m128i add = _mm_set1_epi8 ((char) alpha);
+    gint i;
+
+    for (i = 0; i + 16 <= n_bytes; i += 16) {
+	__m128i v = _mm_loadu_si128 ((__m128i *) (p + i));
+	__m128i lo = _mm_unpacklo_epi8 (v, zero);
+	__m128i hi = _mm_unpackhi_epi8 (v, zero);
+
+	lo = _mm_mulhi_epu16 (_mm_add_epi16 (_mm_mullo_epi16 (lo, inverse),
+					     half), div255);
+	hi = _mm_mulhi_epu16 (_mm_add_epi16 (_mm_mullo_epi16 (hi, inverse),
+					     half), div255);
+	v = _mm_adds_epu8 (_mm_packus_epi16 (lo, hi), add);
+	_mm_storeu_si128 ((__m128i *) (p + i), v);
+    }
+
+    brighten_row_scalar (p + i, n_bytes - i, alpha);
+}
+
+__attribute__((target("avx2")))
+static void
+brighten_row_avx2 (guchar *p, gint n_bytes, guint alpha)
+{
+    const __m256i zero = _mm256_setzero_si256 ();
+    const __m256i inverse = _mm256_set1_epi16 (255 - alpha);
+    const __m256i half = _mm256_set1_epi16 (0x80);
+    const __m256i div255 = _mm256_set1_epi16 (0x0101);
+    const __m256i add = _mm256_set1_epi8 ((char) alpha);
+    gint i;
+
+    // Unpacking and packing both work within 128-bit lanes, so the
+    // bytes come back out in their original order.
+    for (i = 0; i + 32 <= n_bytes; i += 32) {
+	__m256i v = _mm256_loadu_si256 ((__m256i *) (p + i));
+	__m256i lo = _mm256_unpacklo_epi8 (v, zero);
+	__m256i hi = _mm256_unpackhi_epi8 (v, zero);
+
+	lo = _mm256_mulhi_epu16 (_mm256_add_epi16 (_mm256_mullo_epi16 (lo, inverse),
+						   half), div255);
+	hi = _mm256_mulhi_epu16 (_mm256_add_epi16 (_mm256_mullo_epi16 (hi, inverse),
+						   half), div255);
+	v = _mm256_adds_epu8 (_mm256_packus_epi16 (lo, hi), add);
+	_mm256_storeu_si256 ((__m256i *) (p + i), v);
+    }
+
+    brighten_row_scalar (p + i, n_bytes - i, alpha);
+}
+
+#endif /* FADE_X86_DISPATCH */
+
+static FadeRowFunc
+get_brighten_row (void)
+{
+    static gsize initialized = 0;
+
+    if (g_once_init_enter (&initialized)) {
+	brighten_row = brighten_row_scalar;
+#ifdef FADE_X86_DISPATCH
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("avx2"))
+	    brighten_row = brighten_row_avx2;
+	else if (__builtin_cpu_supports ("sse2"))
+	    brighten_row = brighten_row_sse2;
+#endif
+	g_once_init_leave (&initialized, 1);
+    }
+
+    return brighten_row;
+}
+
+/*
+ * Fill a rectangle with white.  The row stores are left to memset,
+ * which the C library already vectorizes for the running CPU.
+ */
+void
+fade_clear (guchar *data, gint stride,
+	    gint x, gint y, gint width, gint height)
+{
+    gint row;
+
+    if (x == 0 && stride == width * 4) {
+	memset (data + y * stride, 0xff, (gsize) stride * height);
+	return;
+    }
+
+    for (row = y; row < y + height; row++)
+	memset (data + row * stride + x * 4, 0xff, width * 4);
+}
+
+/*
+ * Paint white over a rectangle with the given alpha.
+ */
+void
+fade_brighten (guchar *data, gint stride,
+	       gint x, gint y, gint width, gint height,
+	       gdouble alpha)
+{
+    FadeRowFunc func = get_brighten_row ();
+    guint alpha8 = alpha_to_8bit (alpha);
+    gint row;
+
+    for (row = y; row < y + height; row++)
+	func (data + row * stride + x * 4, width * 4, alpha8);
+}
+
+/*
+ * Build lookup tables giving the value of a byte after n successive
+ * calls to fade_brighten, for n from 0 up to the number of steps after
+ * which further fading no longer changes any value.  That number is
+ * returned, and *LUTS is set to a newly allocated array of that many
+ * plus one tables.
+ *
+ * This is the rounded integer version of white - (white - ink) * (1 - a)^n,
+ * so applying table n gives exactly what n separate fades would give.
+ */
+gint
+fade_build_luts (FadeLut **luts, gdouble alpha)
+{
+    guint alpha8 = alpha_to_8bit (alpha);
+    FadeLut *tables = NULL;
+    gint n = 0;
+    gint v;
+
+    tables = g_renew (FadeLut, tables, 1);
+    for (v = 0; v < 256; v++)
+	tables[0][v] = v;
+
+    for (;;) {
+	gboolean changed = FALSE;
+
+	tables = g_renew (FadeLut, tables, n + 2);
+	for (v = 0; v < 256; v++) {
+	    tables[n + 1][v] = brighten_byte (tables[n][v], alpha8);
+	    if (tables[n + 1][v] != tables[n][v])
+		changed = TRUE;
+	}
+
+	if (!changed)
+	    break;
+	n++;
+    }
+
+    *luts = tables;
+    return n;
+}
+
+void
+fade_apply_lut (guchar *data, gint stride,
+		gint x, gint y, gint width, gint height,
+		const FadeLut lut)
+{
+    gint row, i;
+
+    for (row = y; row < y + height; row++) {
+	guchar *p = data + row * stride + x * 4;
+	for (i = 0; i < width * 4; i++)
+	    p[i] = lut[p[i]];
+    }
+}
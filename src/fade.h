@@ -0,0 +1,18 @@
+/*
+ * fade.h
+ * Pixel kernels for fading and clearing the canvas
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ */
+
+typedef guchar FadeLut[256];
+
+void fade_clear (guchar *data, gint stride,
+		 gint x, gint y, gint width, gint height);
+void fade_brighten (guchar *data, gint stride,
+		    gint x, gint y, gint width, gint height,
+		    gdouble alpha);
+gint fade_build_luts (FadeLut **luts, gdouble alpha);
+void fade_apply_lut (guchar *data, gint stride,
+		     gint x, gint y, gint width, gint height,
+		     const FadeLut lut);
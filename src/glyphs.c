@@ -0,0 +1,130 @@
+/*
+ * glyphs.c
+ * Cache of rasterized letters
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ * Letters are drawn with the same font every time, only in different
+ * colors.  Each string is shaped and rendered once to an alpha mask,
+ * and then drawn by painting the current source through the mask.
+ * The least recently used masks are dropped when there are more than
+ * max_glyphs of them, which only happens with large alphabets.
+ */
+
+#include <config.h>
+#include <glib.h>
+#include <pango/pangocairo.h>
+#include "glyphs.h"
+
+static void
+glyph_free (gpointer data)
+{
+    ToddlerFunGlyph *glyph = data;
+
+    cairo_surface_destroy (glyph->mask);
+    g_free (glyph->text);
+    g_free (glyph);
+}
+
+/*
+ * Create a cache for strings in the font described by FONT, holding at
+ * most MAX_GLYPHS masks.
+ */
+ToddlerFunGlyphCache *
+glyph_cache_new (const gchar *font, guint max_glyphs)
+{
+    ToddlerFunGlyphCache *cache;
+
+    cache = g_new0 (ToddlerFunGlyphCache, 1);
+    cache->context = pango_font_map_create_context (
+	pango_cairo_font_map_get_default ());
+    cache->font = pango_font_description_from_string (font);
+    cache->glyphs = g_hash_table_new_full (g_str_hash, g_str_equal,
+					   NULL, glyph_free);
+    cache->lru = g_queue_new ();
+    cache->max_glyphs = MAX (max_glyphs, 1);
+
+    return cache;
+}
+
+void
+glyph_cache_free (ToddlerFunGlyphCache *cache)
+{
+    g_queue_free (cache->lru);
+    g_hash_table_destroy (cache->glyphs);
+    pango_font_description_free (cache->font);
+    g_object_unref (cache->context);
+    g_free (cache);
+}
+
+/*
+ * Render TEXT the way draw_string used to: centered on the origin by
+ * its logical size.  The mask also covers any ink outside the logical
+ * rectangle.
+ */
+static ToddlerFunGlyph *
+glyph_render (ToddlerFunGlyphCache *cache, const gchar *text)
+{
+    ToddlerFunGlyph *glyph;
+    PangoLayout *layout;
+    PangoRectangle ink, logical;
+    gint x1, y1, x2, y2;
+    cairo_t *cr;
+
+    layout = pango_layout_new (cache->context);
+    pango_layout_set_font_description (layout, cache->font);
+    pango_layout_set_text (layout, text, -1);
+    pango_layout_get_pixel_extents (layout, &ink, &logical);
+
+    x1 = MIN (ink.x, logical.x);
+    y1 = MIN (ink.y, logical.y);
+    x2 = MAX (ink.x + ink.width, logical.x + logical.width);
+    y2 = MAX (ink.y + ink.height, logical.y + logical.height);
+
+    glyph = g_new0 (ToddlerFunGlyph, 1);
+    glyph->text = g_strdup (text);
+    glyph->x_offset = x1 - logical.width / 2;
+    glyph->y_offset = y1 - logical.height / 2;
+    glyph->width = MAX (x2 - x1, 1);
+    glyph->height = MAX (y2 - y1, 1);
+    glyph->mask = cairo_image_surface_create (CAIRO_FORMAT_A8,
+					      glyph->width, glyph->height);
+
+    cr = cairo_create (glyph->mask);
+    cairo_move_to (cr, -x1, -y1);
+    pango_cairo_show_layout (cr, layout);
+    cairo_destroy (cr);
+
+    g_object_unref (layout);
+
+    return glyph;
+}
+
+/*
+ * Get the mask for TEXT, rendering it if needed.  It should be drawn
+ * with its offset relative to the center of the letter, and stays
+ * valid until the next call.
+ */
+ToddlerFunGlyph *
+glyph_cache_get (ToddlerFunGlyphCache *cache, const gchar *text)
+{
+    ToddlerFunGlyph *glyph;
+
+    glyph = g_hash_table_lookup (cache->glyphs, text);
+    if (glyph != NULL) {
+	g_queue_unlink (cache->lru, glyph->link);
+	g_queue_push_head_link (cache->lru, glyph->link);
+	return glyph;
+    }
+
+    while (g_queue_get_length (cache->lru) >= cache->max_glyphs) {
+	ToddlerFunGlyph *oldest = g_queue_pop_tail (cache->lru);
+	g_hash_table_remove (cache->glyphs, oldest->text);
+    }
+
+    glyph = glyph_render (cache, text);
+    g_queue_push_head (cache->lru, glyph);
+    glyph->link = g_queue_peek_head_link (cache->lru);
+    g_hash_table_insert (cache->glyphs, glyph->text, glyph);
+
+    return glyph;
+}
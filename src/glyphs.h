@@ -0,0 +1,29 @@
+/*
+ * glyphs.h
+ * Cache of rasterized letters
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ */
+
+typedef struct {
+    gchar *text;
+    cairo_surface_t *mask;
+    gint x_offset;
+    gint y_offset;
+    gint width;
+    gint height;
+    GList *link;
+} ToddlerFunGlyph;
+
+typedef struct {
+    PangoContext *context;
+    PangoFontDescription *font;
+    GHashTable *glyphs;
+    GQueue *lru;
+    guint max_glyphs;
+} ToddlerFunGlyphCache;
+
+ToddlerFunGlyphCache *glyph_cache_new (const gchar *font, guint max_glyphs);
+void glyph_cache_free (ToddlerFunGlyphCache *cache);
+ToddlerFunGlyph *glyph_cache_get (ToddlerFunGlyphCache *cache,
+				  const gchar *text);
@@ -0,0 +1,185 @@
+/*
+ * journal.c
+ * Recording input events to a file and reading them back
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ * A journal starts with a magic string and the random seed of the
+ * session, followed by fixed size little endian event records.  Playing
+ * the events back through the same handlers with the same seed draws
+ * the same picture, which makes sessions reproducible and comparable
+ * between builds.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gi18n.h>
+#include <glib/gstdio.h>
+#include "journal.h"
+
+#define JOURNAL_MAGIC "TFJ1"
+#define JOURNAL_MAGIC_LEN 4
+#define JOURNAL_RECORD_LEN 16
+
+static void
+set_errno_error (GError **error, const gchar *filename)
+{
+    int saved_errno = errno;
+
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+		 "%s: %s", filename, g_strerror (saved_errno));
+}
+
+static void
+put_uint16 (guchar *p, guint16 value)
+{
+    value = GUINT16_TO_LE (value);
+    memcpy (p, &value, sizeof (value));
+}
+
+static void
+put_uint32 (guchar *p, guint32 value)
+{
+    value = GUINT32_TO_LE (value);
+    memcpy (p, &value, sizeof (value));
+}
+
+static guint16
+get_uint16 (const guchar *p)
+{
+    guint16 value;
+
+    memcpy (&value, p, sizeof (value));
+    return GUINT16_FROM_LE (value);
+}
+
+static guint32
+get_uint32 (const guchar *p)
+{
+    guint32 value;
+
+    memcpy (&value, p, sizeof (value));
+    return GUINT32_FROM_LE (value);
+}
+
+/*
+ * Create FILENAME and write the header of a journal for a session
+ * using the random SEED.
+ */
+ToddlerFunJournal *
+journal_create (const gchar *filename, guint32 seed, GError **error)
+{
+    ToddlerFunJournal *journal;
+    guchar header[JOURNAL_MAGIC_LEN + 4];
+    FILE *file;
+
+    file = g_fopen (filename, "wb");
+    if (file == NULL) {
+	set_errno_error (error, filename);
+	return NULL;
+    }
+
+    memcpy (header, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN);
+    put_uint32 (header + JOURNAL_MAGIC_LEN, seed);
+    if (fwrite (header, sizeof (header), 1, file) != 1) {
+	set_errno_error (error, filename);
+	fclose (file);
+	return NULL;
+    }
+
+    journal = g_new0 (ToddlerFunJournal, 1);
+    journal->file = file;
+    journal->seed = seed;
+    journal->start_time = g_get_monotonic_time ();
+
+    return journal;
+}
+
+/*
+ * Open the journal FILENAME for reading.  The seed of the recorded
+ * session is available in the seed field.
+ */
+ToddlerFunJournal *
+journal_open (const gchar *filename, GError **error)
+{
+    ToddlerFunJournal *journal;
+    guchar header[JOURNAL_MAGIC_LEN + 4];
+    FILE *file;
+
+    file = g_fopen (filename, "rb");
+    if (file == NULL) {
+	set_errno_error (error, filename);
+	return NULL;
+    }
+
+    if (fread (header, sizeof (header), 1, file) != 1 ||
+	memcmp (header, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) != 0) {
+	g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+		     _("'%s' is not a Toddler Fun journal"), filename);
+	fclose (file);
+	return NULL;
+    }
+
+    journal = g_new0 (ToddlerFunJournal, 1);
+    journal->file = file;
+    journal->seed = get_uint32 (header + JOURNAL_MAGIC_LEN);
+    journal->start_time = g_get_monotonic_time ();
+
+    return journal;
+}
+
+void
+journal_close (ToddlerFunJournal *journal)
+{
+    fclose (journal->file);
+    g_free (journal);
+}
+
+/*
+ * Append an event.  What DETAIL, A and B mean depends on TYPE; they are
+ * the parts of the GDK event that the handler looks at.
+ */
+void
+journal_write (ToddlerFunJournal *journal,
+	       ToddlerFunJournalType type, guint detail,
+	       gint32 a, gint32 b)
+{
+    guchar record[JOURNAL_RECORD_LEN];
+    gint64 elapsed;
+
+    elapsed = (g_get_monotonic_time () - journal->start_time) / 1000;
+
+    put_uint32 (record, (guint32) elapsed);
+    put_uint16 (record + 4, type);
+    put_uint16 (record + 6, detail);
+    put_uint32 (record + 8, (guint32) a);
+    put_uint32 (record + 12, (guint32) b);
+
+    // Written through stdio's buffer; it is flushed when the journal
+    // is closed
+    fwrite (record, sizeof (record), 1, journal->file);
+}
+
+/*
+ * Read the next event into EVENT.  Returns FALSE at the end of the
+ * journal.
+ */
+gboolean
+journal_read (ToddlerFunJournal *journal,
+	      ToddlerFunJournalEvent *event)
+{
+    guchar record[JOURNAL_RECORD_LEN];
+
+    if (fread (record, sizeof (record), 1, journal->file) != 1)
+	return FALSE;
+
+    event->time = get_uint32 (record);
+    event->type = get_uint16 (record + 4);
+    event->detail = get_uint16 (record + 6);
+    event->a = (gint32) get_uint32 (record + 8);
+    event->b = (gint32) get_uint32 (record + 12);
+
+    return TRUE;
+}
@@ -0,0 +1,43 @@
+/*
+ * journal.h
+ * Recording input events to a file and reading them back
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ */
+
+typedef enum {
+    TODDLERFUN_JOURNAL_CONFIGURE = 1,
+    TODDLERFUN_JOURNAL_MOTION,
+    TODDLERFUN_JOURNAL_FRAME,
+    TODDLERFUN_JOURNAL_BUTTON,
+    TODDLERFUN_JOURNAL_SCROLL,
+    TODDLERFUN_JOURNAL_KEY_PRESS,
+    TODDLERFUN_JOURNAL_KEY_RELEASE,
+    TODDLERFUN_JOURNAL_TICK,
+    TODDLERFUN_JOURNAL_BRIGHTEN,
+    TODDLERFUN_JOURNAL_N_TYPES
+} ToddlerFunJournalType;
+
+typedef struct {
+    guint32 time;		// milliseconds since the journal was created
+    guint16 type;
+    guint16 detail;
+    gint32 a;
+    gint32 b;
+} ToddlerFunJournalEvent;
+
+typedef struct {
+    FILE *file;
+    guint32 seed;
+    gint64 start_time;
+} ToddlerFunJournal;
+
+ToddlerFunJournal *journal_create (const gchar *filename, guint32 seed,
+				   GError **error);
+ToddlerFunJournal *journal_open (const gchar *filename, GError **error);
+void journal_close (ToddlerFunJournal *journal);
+void journal_write (ToddlerFunJournal *journal,
+		    ToddlerFunJournalType type, guint detail,
+		    gint32 a, gint32 b);
+gboolean journal_read (ToddlerFunJournal *journal,
+		       ToddlerFunJournalEvent *event);
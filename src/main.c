@@ -13,6 +13,21 @@
 #include <pango/pangocairo.h>
 #include <gst/gst.h>
 #include "theme.h"
+#include "catalog.h"
+#include "sprites.h"
+#include "canvas.h"
+#include "render.h"
+#include "brush.h"
+#include "saver.h"
+#include "displaylist.h"
+#include "journal.h"
+#include "glyphs.h"
+#include "synth.h"
+#include "sound.h"
+#include "music.h"
+#include "trace.h"
+#include "animator.h"
+#include "perf.h"
 
 /* 
  * Constants 
@@ -21,9 +36,38 @@
 static const gint toddlerfun_effect_min = 0;
 static const gint toddlerfun_effect_max = 8;
 static const gdouble toddlerfun_color_cycle_distance = 2000;
+static const gdouble toddlerfun_line_width = 5;
 static const gdouble toddlerfun_svg_size = 100;
-static const gdouble toddlerfun_min_rotation = G_PI * -0.2;
-static const gdouble toddlerfun_max_rotation = G_PI * 0.2;
+static const gdouble toddlerfun_min_rotation = -SPRITE_MAX_ROTATION;
+static const gdouble toddlerfun_max_rotation = SPRITE_MAX_ROTATION;
+static const gint toddlerfun_threaded_effect_min = 6;
+static const gchar *toddlerfun_letter_font = "Sans Bold 60px";
+static const guint toddlerfun_max_glyphs = 256;
+static const gdouble toddlerfun_message_duration = 5;
+static const gdouble toddlerfun_message_fade_time = 0.5;
+static const gdouble toddlerfun_message_alpha = 0.8;
+static const gdouble toddlerfun_sound_fx_gain = 1.0;
+static const gint64 toddlerfun_fade_interval = 2 * G_USEC_PER_SEC;
+static const gint64 toddlerfun_brighten_interval = G_USEC_PER_SEC / 30;
+static const gint toddlerfun_brighten_steps = 40;
+static const gchar *toddlerfun_default_theme_file =
+    DATADIR "/defaulttheme/theme.xml";
+static const guint toddlerfun_theme_reload_delay = 250;
+static const guint toddlerfun_parent_modifiers =
+    GDK_CONTROL_MASK | GDK_MOD1_MASK;
+static const gint64 toddlerfun_perf_hud_interval = G_USEC_PER_SEC / 2;
+static const gchar *toddlerfun_perf_hud_font = "Monospace 10";
+
+#define MAX_SYMMETRY_COPIES 16
+
+//
+// The transforms that make up one mirror effect - one or two per rotation
+//
+
+typedef struct {
+    gint n_copies;
+    cairo_matrix_t copies[MAX_SYMMETRY_COPIES];
+} ToddlerFunSymmetry;
 
 //
 // ToddlerFun structure - contains all the state for the game
@@ -32,23 +76,87 @@ static const gdouble toddlerfun_max_rotation = G_PI * 0.2;
 typedef struct { 
     GtkWidget *window;
     GtkWidget *darea;
-    cairo_surface_t *surface;
+    ToddlerFunCanvas *canvas;
     gboolean has_previous;
     gint previous_x;
     gint previous_y;
+    GArray *motion_points;
+    guint motion_frame_id;
+    guint32 last_motion_time;
+
+    // Everything that moves on its own is run by the animator
+    ToddlerFunAnimator *animator;
+    gint64 next_fade_time;
+    guint brighten_id;
     gint brighten_count;
+    gint64 next_brighten_time;
     gint effect_num;
+    ToddlerFunSymmetry *symmetries;
+    gboolean batch_strokes;
+    gboolean use_brush;
+    ToddlerFunBrushType brush;
+    gboolean native_surface;
+    ToddlerFunRenderPool *render_pool;
     gdouble traveled_distance;
 
+    // Everything drawn, for drawing it again
+    ToddlerFunDisplayList *display_list;
+    guint fade_count;
+
     gboolean play_sound_fx;
+    ToddlerFunSoundMixer *mixer;
+    ToddlerFunSynth *synth;
+    ToddlerFunMusic *music;
+    ToddlerFunSaver *saver;
+    gchar *save_format;
+    gdouble save_scale;
+    gboolean play_music;
+    ToddlerFunCatalog *catalog;
     ToddlerFunTheme *theme;
+    gchar *theme_file;
+    ToddlerFunSpriteCache *sprites;
+    ToddlerFunGlyphCache *glyphs;
+    gint load_threads;
+
+    // Theme being loaded, swapped in when all of it is loaded, and the
+    // one to load after it
+    GFileMonitor *theme_monitor;
+    guint theme_reload_id;
+    ToddlerFunTheme *next_theme;
+    gchar *next_theme_file;
+    gint n_reloading;
+    gchar *queued_theme_file;
+
+    // Randomness comes from here only, so that a journal can be
+    // replayed exactly
+    GRand *rand;
+    ToddlerFunJournal *journal;
+
+    // Startup
+    gint n_loading;
+    gint64 start_time;
+    gboolean report_startup;
+    gboolean shown;
 
     // Messages
     gint message_num;
     gboolean has_message;
-    cairo_surface_t *message_surface;
+    cairo_surface_t *message_atlas;
+    cairo_rectangle_int_t *message_rects;
     gdouble message_alpha;
-    GTimer *message_timer;
+    gint64 message_start;
+    guint message_id;
+
+    // Always counted; shown on request
+    ToddlerFunPerf perf;
+    gboolean show_perf_hud;
+    guint perf_hud_id;
+    cairo_rectangle_int_t perf_hud_area;
+
+    // Timeline of the handlers, and the GDK time of the earliest input
+    // not yet drawn
+    ToddlerFunTrace *trace;
+    gint64 trace_input_time;
 	
     // Letters
     guint last_keyval;
@@ -56,20 +164,46 @@ typedef struct {
     gint letter_y;
     gdouble letter_hue;
 
+    // SVGs of the images in the display list, and what its positions
+    // are multiplied by, while replaying it
+    GHashTable *replay_images;
+    gdouble replay_scale_x;
+    gdouble replay_scale_y;
+
     // These are active during a draw
-    cairo_region_t *region;
     gint x;
     gint y;
     gint object_num;
     gdouble image_rotation;
+    ToddlerFunSprite *sprite;
+    RsvgHandle *image_handle;
+    ToddlerFunGlyph *glyph;
     PangoLayout *layout;
+    gboolean exporting;
 } ToddlerFun;
 
 typedef void (*ToddlerFunDrawFunc) (ToddlerFun *toddlerfun, cairo_t *cr);
 
+typedef struct {
+    gint x;
+    gint y;
+} ToddlerFunPoint;
+
+// One queued line segment, drawn with its own hue
+typedef struct {
+    gint from_x;
+    gint from_y;
+    gint x;
+    gint y;
+    gboolean has_previous;
+    gdouble hue;
+} ToddlerFunSegment;
+
+typedef void (*ToddlerFunSegmentFunc) (ToddlerFun *toddlerfun, cairo_t *cr,
+				       const ToddlerFunSegment *segment);
+
 typedef struct {
     GstElement *element;
-    gboolean repeat;
 } ToddlerFunSound;
 
 gchar *toddlerfun_messages [] = {
@@ -86,50 +220,51 @@ gchar *toddlerfun_messages [] = {
 // Sound
 //
 
+// Sound effects played without the mixer, one pipeline each
+static gint n_sound_pipelines = 0;
+
 static void
 eos_message_received (GstBus *bus, GstMessage *message, ToddlerFunSound *sound)
 {
-    if (sound->repeat == TRUE) {
-        gst_element_set_state (GST_ELEMENT(sound->element), GST_STATE_NULL);
-        gst_element_set_state (GST_ELEMENT(sound->element), GST_STATE_PLAYING);
-    } else {
-        gst_element_set_state (GST_ELEMENT(sound->element), GST_STATE_NULL);
-        gst_object_unref (GST_OBJECT(sound->element));
-        sound->element = NULL;
-    }
+    n_sound_pipelines--;
+    gst_bus_remove_signal_watch (bus);
+    gst_element_set_state (GST_ELEMENT(sound->element), GST_STATE_NULL);
+    gst_object_unref (GST_OBJECT(sound->element));
+    g_free (sound);
 }
 
 static void
-play_sound (gchar *filesnd, gboolean repeat)
+play_sound (gchar *filesnd)
 {
     gchar *filename;
     GstElement *pipeline;
     GstBus *bus;
 
+    if (!g_file_test (filesnd, G_FILE_TEST_EXISTS)) {
+        g_printerr(_("Sound file '%s' does not exist\n"), filesnd);
+        return;
+    }
+
     pipeline = gst_element_factory_make("playbin", "playbin");
     if (pipeline != NULL) {
         ToddlerFunSound *sound = g_new (ToddlerFunSound, 1);
         sound->element = pipeline;
-        sound->repeat = repeat;
+        n_sound_pipelines++;
         bus = gst_pipeline_get_bus (GST_PIPELINE (pipeline));
         gst_bus_add_signal_watch_full (bus, G_PRIORITY_HIGH);
         g_signal_connect (bus, "message::eos", 
 			  (GCallback) eos_message_received, sound);
         gst_object_unref (bus);
 
-        if (!g_file_test (filesnd, G_FILE_TEST_EXISTS))
-            g_printerr(_("Sound file '%s' does not exist\n"), filesnd);
-        else {
-            filename = g_strdup_printf("file://%s", filesnd);
-            g_object_set (G_OBJECT(pipeline), "uri", filename, NULL);
-            gst_element_set_state (GST_ELEMENT(pipeline), GST_STATE_PLAYING);
-	    g_free (filename);
-        }
+        filename = g_strdup_printf("file://%s", filesnd);
+        g_object_set (G_OBJECT(pipeline), "uri", filename, NULL);
+        gst_element_set_state (GST_ELEMENT(pipeline), GST_STATE_PLAYING);
+        g_free (filename);
     }
 }
 
 //
-// Region handling
+// Damage handling
 //
 
 static double
@@ -161,7 +296,7 @@ max_doubles (double *arr, int n)
 }
 
 static void
-add_user_rectangle_to_region (ToddlerFun *toddlerfun, cairo_t *cr,
+add_user_rectangle_to_damage (ToddlerFun *toddlerfun, cairo_t *cr,
 			      double x1, double y1, double x2, double y2)
 {
     const int TOP_LEFT = 0;
@@ -170,9 +305,13 @@ add_user_rectangle_to_region (ToddlerFun *toddlerfun, cairo_t *cr,
     const int BOTTOM_LEFT = 3;
     double x[4], y[4];
     cairo_rectangle_int_t rectangle;
-    cairo_status_t status;
+    gint band_y, band_height;
     int i;
 
+    // Not drawing to the canvas
+    if (toddlerfun->exporting)
+	return;
+
     x[TOP_LEFT] = x[BOTTOM_LEFT] = x1;
     y[TOP_LEFT] = y[TOP_RIGHT] = y1;
     x[BOTTOM_RIGHT] = x[TOP_RIGHT] = x2;
@@ -181,55 +320,234 @@ add_user_rectangle_to_region (ToddlerFun *toddlerfun, cairo_t *cr,
     for (i = 0; i < 4; i++)
 	cairo_user_to_device (cr, &x[i], &y[i]);
 
-    rectangle.x = min_doubles(x, 4);
-    rectangle.y = min_doubles(y, 4);
-    rectangle.width = max_doubles(x, 4) - rectangle.x;
-    rectangle.height = max_doubles(y, 4) - rectangle.y;
-
-    status = cairo_region_union_rectangle(toddlerfun->region, &rectangle);
-    g_assert(status == CAIRO_STATUS_SUCCESS);
+    rectangle.x = floor (min_doubles(x, 4));
+    rectangle.y = floor (min_doubles(y, 4));
+    rectangle.width = ceil (max_doubles(x, 4)) - rectangle.x;
+    rectangle.height = ceil (max_doubles(y, 4)) - rectangle.y;
+
+    // Bring pending fades up to date before anything is drawn here,
+    // and mark the tiles as damaged
+    if (render_get_band (cr, &band_y, &band_height))
+	canvas_touch_band (toddlerfun->canvas, rectangle.x, rectangle.y + band_y,
+			   rectangle.width, rectangle.height,
+			   band_y, band_height);
+    else
+	canvas_touch (toddlerfun->canvas, rectangle.x, rectangle.y,
+		      rectangle.width, rectangle.height);
 }
 
 static void 
-add_stroke_to_region(ToddlerFun *toddlerfun, cairo_t *cr)
+add_stroke_to_damage(ToddlerFun *toddlerfun, cairo_t *cr)
 {
     double x1, y1, x2, y2;
     cairo_stroke_extents (cr, &x1, &y1, &x2, &y2);
-    add_user_rectangle_to_region (toddlerfun, cr, x1, y1, x2, y2);
+    add_user_rectangle_to_damage (toddlerfun, cr, x1, y1, x2, y2);
+}
+
+/*
+ * Queue a repaint of the tiles drawn to or faded since the last call
+ */
+static void
+queue_damage (ToddlerFun *toddlerfun)
+{
+    cairo_region_t *region;
+
+    region = canvas_take_damage (toddlerfun->canvas);
+    if (cairo_region_is_empty (region)) {
+	// Nothing to do
+    } else if (toddlerfun->darea != NULL) {
+	gtk_widget_queue_draw_region (toddlerfun->darea, region);
+    } else {
+	// Replaying without a window; do the work on_draw would have
+	// done on the canvas
+	gint i, n = cairo_region_num_rectangles (region);
+	for (i = 0; i < n; i++) {
+	    cairo_rectangle_int_t r;
+	    cairo_region_get_rectangle (region, i, &r);
+	    canvas_materialize (toddlerfun->canvas, r.x, r.y,
+				r.width, r.height);
+	}
+    }
+    cairo_region_destroy (region);
+}
+
+static void
+record_event (ToddlerFun *toddlerfun, ToddlerFunJournalType type,
+	      guint detail, gint32 a, gint32 b)
+{
+    if (toddlerfun->journal != NULL)
+	journal_write (toddlerfun->journal, type, detail, a, b);
 }
 
 //
-// Draw functions - these all match the ToddlerDrawFunc signature
+// Draw functions - these all match the ToddlerDrawFunc signature, or
+// ToddlerFunSegmentFunc for the ones given a segment to draw
 //
 
+/*
+ * The segment from the previous position to the current one
+ */
+static void
+current_segment (const ToddlerFun *toddlerfun, ToddlerFunSegment *segment)
+{
+    segment->from_x = toddlerfun->has_previous ?
+	toddlerfun->previous_x : toddlerfun->x;
+    segment->from_y = toddlerfun->has_previous ?
+	toddlerfun->previous_y : toddlerfun->y;
+    segment->x = toddlerfun->x;
+    segment->y = toddlerfun->y;
+    segment->has_previous = toddlerfun->has_previous;
+    segment->hue = 0;
+}
+
+static void
+stroke_segment (ToddlerFun *toddlerfun, cairo_t *cr,
+		const ToddlerFunSegment *segment)
+{
+    cairo_move_to (cr, segment->from_x, segment->from_y);
+    cairo_line_to (cr, segment->x, segment->y);
+    add_stroke_to_damage (toddlerfun, cr);
+    cairo_stroke (cr);
+}
+
 static void 
 draw_line(ToddlerFun *toddlerfun, cairo_t *cr) 
 {
-    if (toddlerfun->has_previous)
-	cairo_move_to (cr, toddlerfun->previous_x, toddlerfun->previous_y);
-    else
-	cairo_move_to (cr, toddlerfun->x, toddlerfun->y);
-    cairo_line_to (cr, toddlerfun->x, toddlerfun->y);
-    add_stroke_to_region (toddlerfun, cr);
-    cairo_stroke (cr);
+    ToddlerFunSegment segment;
+
+    current_segment (toddlerfun, &segment);
+    stroke_segment (toddlerfun, cr, &segment);
 }
 
+/*
+ * Same segment as stroke_segment, but painted by the brush engine
+ * right into the pixels of the target instead of through cairo's
+ * stroker.  The start of the segment is left out unless START_CAP is
+ * set, since the end of the one before already covers it.  Targets
+ * that are not images, and sources that are not a color, get
+ * stroke_segment.
+ */
 static void
-draw_image(ToddlerFun *toddlerfun, cairo_t *cr)
+paint_brush_segment (ToddlerFun *toddlerfun, cairo_t *cr,
+		     const ToddlerFunSegment *segment, gboolean start_cap)
 {
-    ToddlerFunThemeObject *obj;
+    cairo_surface_t *target = cairo_get_target (cr);
+    double x1, y1, x2, y2, radius, reach, dx, dy;
+    double red, green, blue, alpha;
+
+    if (cairo_surface_get_type (target) != CAIRO_SURFACE_TYPE_IMAGE ||
+	cairo_pattern_get_rgba (cairo_get_source (cr), &red, &green,
+				&blue, &alpha) != CAIRO_STATUS_SUCCESS) {
+	stroke_segment (toddlerfun, cr, segment);
+	return;
+    }
+
+    x1 = segment->from_x;
+    y1 = segment->from_y;
+    x2 = segment->x;
+    y2 = segment->y;
+
+    // Fades must be brought up to date before painting over them
+    radius = cairo_get_line_width (cr) / 2;
+    reach = brush_get_reach (toddlerfun->brush, radius) + 1;
+    add_user_rectangle_to_damage (toddlerfun, cr,
+				  MIN (x1, x2) - reach, MIN (y1, y2) - reach,
+				  MAX (x1, x2) + reach, MAX (y1, y2) + reach);
+
+    cairo_user_to_device (cr, &x1, &y1);
+    cairo_user_to_device (cr, &x2, &y2);
+    dx = radius;
+    dy = 0;
+    cairo_user_to_device_distance (cr, &dx, &dy);
+
+    cairo_surface_flush (target);
+    brush_stroke (cairo_image_surface_get_data (target),
+		  cairo_image_surface_get_stride (target),
+		  cairo_image_surface_get_width (target),
+		  cairo_image_surface_get_height (target),
+		  toddlerfun->brush, hypot (dx, dy), x1, y1, x2, y2,
+		  start_cap, red, green, blue, alpha);
+    cairo_surface_mark_dirty (target);
+}
+
+static void
+brush_segment (ToddlerFun *toddlerfun, cairo_t *cr,
+	       const ToddlerFunSegment *segment)
+{
+    paint_brush_segment (toddlerfun, cr, segment, !segment->has_previous);
+}
+
+static void
+draw_brush (ToddlerFun *toddlerfun, cairo_t *cr)
+{
+    ToddlerFunSegment segment;
+
+    current_segment (toddlerfun, &segment);
+    brush_segment (toddlerfun, cr, &segment);
+}
+
+static RsvgHandle *
+load_image (const gchar *file_name) 
+{
+    GError *error = NULL;
     RsvgHandle *handle;
-    RsvgDimensionData dimension;
-    gdouble hypothenuse, scale;
 
-    obj = theme_get_object(toddlerfun->theme, toddlerfun->object_num);
-    if (obj == NULL)
-	return;
+    handle = rsvg_handle_new_from_file (file_name, &error);
+    if (error != NULL) {
+	g_printerr (_("Can't load %s: %s\n"), file_name, error->message);
+	g_clear_error (&error);
+	return NULL;
+    }
+
+    return handle;
+}
+
+/*
+ * Whether OBJ has anything to draw when clicked
+ */
+static gboolean
+object_has_image (ToddlerFunThemeObject *obj)
+{
+    return obj->image_handle != NULL || obj->n_bundle_sprites > 0;
+}
+
+/*
+ * Get the SVG of OBJ.  Objects from a theme bundle come with their
+ * sprites rasterized, and only load the SVG when something else is
+ * asked for.
+ */
+static RsvgHandle *
+get_image_handle (ToddlerFunThemeObject *obj)
+{
+    if (obj->image_handle == NULL && obj->n_bundle_sprites > 0 &&
+	obj->image_file != NULL)
+	obj->image_handle = load_image (obj->image_file);
+
+    return obj->image_handle;
+}
+
+/*
+ * Render the SVG itself rather than a cached bitmap of it, for drawing
+ * to vector surfaces and at other scales, and for images that are no
+ * longer in the theme.
+ */
+static void
+draw_image_vector (ToddlerFun *toddlerfun, cairo_t *cr)
+{
+    RsvgHandle *handle = toddlerfun->image_handle;
+    RsvgDimensionData dimension;
+    gdouble hypothenuse, scale, reach;
 
-    handle = obj->image_handle;
     if (handle == NULL)
 	return;
 
+    // The image is rotated around its corner, so it can reach one and
+    // a half diagonals from its center
+    reach = toddlerfun_svg_size * 1.5;
+    add_user_rectangle_to_damage (toddlerfun, cr,
+				  toddlerfun->x - reach, toddlerfun->y - reach,
+				  toddlerfun->x + reach, toddlerfun->y + reach);
+
     cairo_save (cr);
 	
     rsvg_handle_get_dimensions (handle, &dimension);
@@ -243,14 +561,42 @@ draw_image(ToddlerFun *toddlerfun, cairo_t *cr)
     cairo_rotate (cr, toddlerfun->image_rotation);
     rsvg_handle_render_cairo (handle, cr);
 
-    add_user_rectangle_to_region (toddlerfun, cr, 0, 0, 
-				  dimension.width, dimension.height);
+    cairo_restore (cr);
+}
+
+static void
+draw_image(ToddlerFun *toddlerfun, cairo_t *cr)
+{
+    ToddlerFunSprite *sprite = toddlerfun->sprite;
+
+    if (toddlerfun->exporting || toddlerfun->image_handle != NULL) {
+	draw_image_vector (toddlerfun, cr);
+	return;
+    }
+
+    if (sprite == NULL)
+	return;
+
+    cairo_save (cr);
+
+    cairo_translate (cr, toddlerfun->x, toddlerfun->y);
+    add_user_rectangle_to_damage (toddlerfun, cr, 
+				  sprite->x_offset, sprite->y_offset,
+				  sprite->x_offset + sprite->width,
+				  sprite->y_offset + sprite->height);
+
+    cairo_set_source_surface (cr, sprite->surface, 
+			      sprite->x_offset, sprite->y_offset);
+    cairo_paint (cr);
 
     cairo_restore (cr);
 }
 
+/*
+ * Lay out and render the string itself, for vector surfaces
+ */
 static void
-draw_string (ToddlerFun *toddlerfun, cairo_t *cr)
+draw_string_vector (ToddlerFun *toddlerfun, cairo_t *cr)
 {
     gint width, height;
 
@@ -259,561 +605,2393 @@ draw_string (ToddlerFun *toddlerfun, cairo_t *cr)
     pango_layout_get_pixel_size (toddlerfun->layout, &width, &height);
     cairo_translate (cr, toddlerfun->letter_x - width / 2, 
 		     toddlerfun->letter_y - height / 2);
+    add_user_rectangle_to_damage (toddlerfun, cr, 0, 0, width, height);
+
     cairo_move_to (cr, 0, 0);
     pango_cairo_update_layout (cr, toddlerfun->layout);
     pango_cairo_show_layout (cr, toddlerfun->layout);
-
-    add_user_rectangle_to_region (toddlerfun, cr, 0, 0, width, height);
 	
     cairo_restore (cr);
 }
 
-//
-// Draw something using the active effect
-// 
-
-static void 
-draw_effect (ToddlerFun *toddlerfun,
-	     cairo_t *cr,
-	     ToddlerFunDrawFunc draw)
+static void
+draw_string (ToddlerFun *toddlerfun, cairo_t *cr)
 {
-    cairo_surface_t *surface = toddlerfun->surface;
-    int width = cairo_image_surface_get_width(surface);
-    int height = cairo_image_surface_get_height(surface);
-    int mirror = toddlerfun->effect_num > 0;
-    int rotations = toddlerfun->effect_num > 0 ? toddlerfun->effect_num : 1;
-    double angle_step = G_PI * 2 / rotations;
-    int center_x = width / 2;
-    int center_y = height / 2;
-    int rot;
-
-    cairo_save(cr);
-    for (rot = 0; rot < rotations; rot++) {
-        cairo_translate (cr, center_x, center_y);
-        cairo_rotate (cr, angle_step);
-        cairo_translate (cr, -center_x, -center_y);
-        (*draw) (toddlerfun, cr);
-        if (mirror) {
-            cairo_save (cr);
-            cairo_translate (cr, center_x, center_y);
-            cairo_scale (cr, -1, 1);
-            cairo_translate (cr, -center_x, -center_y);
-            (*draw) (toddlerfun, cr);
-            cairo_restore (cr);
-        }
-    }
-    cairo_restore(cr);
-	
+    ToddlerFunGlyph *glyph = toddlerfun->glyph;
+
+    if (toddlerfun->exporting) {
+	draw_string_vector (toddlerfun, cr);
+	return;
+    }
+
+    if (glyph == NULL)
+	return;
+
+    cairo_save (cr);
+
+    cairo_translate (cr, toddlerfun->letter_x, toddlerfun->letter_y);
+    add_user_rectangle_to_damage (toddlerfun, cr,
+				  glyph->x_offset, glyph->y_offset,
+				  glyph->x_offset + glyph->width,
+				  glyph->y_offset + glyph->height);
+
+    // The letter color is already the source
+    cairo_mask_surface (cr, glyph->mask, glyph->x_offset, glyph->y_offset);
+
+    cairo_restore (cr);
 }
 
+//
+// Helpers for setting up a draw
+//
+
 static void
-surface_clear (ToddlerFun *toddlerfun) 
+set_line_source (cairo_t *cr, gdouble hue)
 {
-    cairo_t *cr;
-
-    cr = cairo_create (toddlerfun->surface);
+    gdouble r, g, b;
 
-    cairo_set_source_rgb (cr, 1, 1, 1);
-    cairo_paint (cr);
-	
-    cairo_destroy(cr);
+    gtk_hsv_to_rgb (hue, 1.0, 1.0, &r, &g, &b);
+    cairo_set_source_rgba (cr, r, g, b, 0.7);
 }
 
 static void
-surface_brighten (ToddlerFun *toddlerfun)
+set_letter_source (cairo_t *cr, gdouble hue)
 {
-    cairo_t *cr;
-
-    cr = cairo_create (toddlerfun->surface);
+    gdouble r, g, b;
 
-    cairo_set_source_rgb (cr, 1, 1, 1);
-    cairo_paint_with_alpha (cr, 0.1);
-	
-    cairo_destroy(cr);
+    gtk_hsv_to_rgb (hue, 1.0, 0.8, &r, &g, &b);
+    cairo_set_source_rgb (cr, r, g, b);
 }
 
-static void
-render_message (ToddlerFun *toddlerfun) 
+static PangoLayout *
+create_letter_layout (cairo_t *cr, const gchar *s)
 {
-    cairo_t *cr;
     PangoLayout *layout;
     PangoFontDescription *desc;
-    gint width, height;
-
-    // Create surface if we haven't already
-    if (toddlerfun->message_surface == NULL) {
-	toddlerfun->message_surface = 
-	    cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
-					2000, 40);
-    }
 
-    cr = cairo_create (toddlerfun->message_surface);
-
-    // Clear surface
-    cairo_set_operator (cr, CAIRO_OPERATOR_CLEAR);
-    cairo_paint (cr);
-    cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
-
-    // Layout text
     layout = pango_cairo_create_layout (cr);
-    pango_layout_set_text (layout, toddlerfun_messages[toddlerfun->message_num], -1);
-    desc = pango_font_description_from_string ("Sans 20px");
+    pango_layout_set_text (layout, s, -1);
+    desc = pango_font_description_from_string (toddlerfun_letter_font);
     pango_layout_set_font_description (layout, desc);
     pango_font_description_free (desc);
-    cairo_translate (cr, 10, 10);
-    pango_cairo_update_layout (cr, layout);
-    pango_layout_get_pixel_size (layout, &width, &height);
-
-    // Draw rectangle
-    cairo_set_source_rgb (cr, 1, 1, 1);
-    cairo_rectangle (cr, 0, 0, width + 10, height + 10);
-    cairo_fill (cr);
 
-    // Draw text
-    cairo_set_source_rgb (cr, 0, 0, 0);
-    cairo_move_to (cr, 5, 5);
-    pango_cairo_show_layout (cr, layout);
-	
-    cairo_destroy (cr);
-    g_object_unref (layout);
+    return layout;
 }
 
-static void
-update_message (ToddlerFun *toddlerfun)
+/*
+ * Get the cached image for the current object and rotation, or NULL if
+ * the object has no image.
+ */
+static ToddlerFunSprite *
+lookup_sprite (ToddlerFun *toddlerfun)
 {
-    if (toddlerfun->message_timer == NULL)
-	toddlerfun->message_timer = g_timer_new ();
-    g_timer_start (toddlerfun->message_timer);
+    ToddlerFunThemeObject *obj;
+    ToddlerFunSprite *sprite;
 
-    toddlerfun->message_num = (toddlerfun->message_num + 1) % NUM_MESSAGES;
+    if (toddlerfun->object_num >= theme_get_n_objects (toddlerfun->theme))
+	return NULL;
+
+    obj = theme_get_object (toddlerfun->theme, toddlerfun->object_num);
+    if (!object_has_image (obj))
+	return NULL;
 
-    render_message (toddlerfun);
+    sprite = sprite_cache_get (toddlerfun->sprites, toddlerfun->object_num,
+			       NULL, toddlerfun_svg_size,
+			       toddlerfun->image_rotation);
+    if (sprite == NULL)
+	sprite = sprite_cache_get (toddlerfun->sprites,
+				   toddlerfun->object_num,
+				   get_image_handle (obj),
+				   toddlerfun_svg_size,
+				   toddlerfun->image_rotation);
+
+    return sprite;
 }
 
+//
+// Draw something using the active effect
+// 
+
+/*
+ * Compute the symmetry transforms for every effect number, for a
+ * surface of the given size.  Effect 0 is just the identity; effect n
+ * is n rotations around the center, each also mirrored.
+ */
 static void
-save_picture (ToddlerFun *toddlerfun)
+update_symmetries (ToddlerFun *toddlerfun, gint width, gint height)
 {
-    GDateTime *datetime;
-    gchar *dirname;
-    gchar *filename;
-    gchar *pathname;
- 
-    dirname = g_build_filename(g_get_home_dir(), "toddlerfun", NULL);
-
-    if(!g_file_test (dirname, G_FILE_TEST_EXISTS)) {
-        if (g_mkdir(dirname, 0750) < 0)
-            g_printerr(_("Failed to create directory '%s'\n"),
-		       dirname);
+    gint effect_num, rot;
+    double center_x = width / 2;
+    double center_y = height / 2;
+
+    if (toddlerfun->symmetries == NULL)
+	toddlerfun->symmetries = g_new0 (ToddlerFunSymmetry,
+					 toddlerfun_effect_max + 1);
+
+    for (effect_num = toddlerfun_effect_min;
+	 effect_num <= toddlerfun_effect_max; effect_num++) {
+	ToddlerFunSymmetry *symmetry = &toddlerfun->symmetries[effect_num];
+	int mirror = effect_num > 0;
+	int rotations = effect_num > 0 ? effect_num : 1;
+	double angle_step = G_PI * 2 / rotations;
+
+	g_assert (rotations * (mirror ? 2 : 1) <= MAX_SYMMETRY_COPIES);
+
+	symmetry->n_copies = 0;
+	for (rot = 0; rot < rotations; rot++) {
+	    cairo_matrix_t *m = &symmetry->copies[symmetry->n_copies++];
+	    cairo_matrix_init_translate (m, center_x, center_y);
+	    cairo_matrix_rotate (m, angle_step * (rot + 1));
+	    cairo_matrix_translate (m, -center_x, -center_y);
+	    if (mirror) {
+		cairo_matrix_t *mm = &symmetry->copies[symmetry->n_copies++];
+		*mm = *m;
+		cairo_matrix_translate (mm, center_x, center_y);
+		cairo_matrix_scale (mm, -1, 1);
+		cairo_matrix_translate (mm, -center_x, -center_y);
+	    }
+	}
     }
+}
 
-    datetime = g_date_time_new_now_local ();
-    filename = g_date_time_format (datetime, "%F_%H.%M.%S.png");
-    pathname = g_build_filename(dirname, filename, NULL);
-
-    if (cairo_surface_write_to_png(toddlerfun->surface, pathname) < 0)
-        g_printerr(_("Failed to create file '%s'\n"), pathname);
+static void 
+draw_effect (ToddlerFun *toddlerfun,
+	     cairo_t *cr,
+	     ToddlerFunDrawFunc draw)
+{
+    ToddlerFunSymmetry *symmetry;
+    int i;
 
-    g_free (filename);
-    g_free (dirname);
-    g_free (pathname);
-    g_date_time_unref (datetime);
+    symmetry = &toddlerfun->symmetries[toddlerfun->effect_num];
+    for (i = 0; i < symmetry->n_copies; i++) {
+        cairo_save (cr);
+        cairo_transform (cr, &symmetry->copies[i]);
+        (*draw) (toddlerfun, cr);
+        cairo_restore (cr);
+    }
 }
 
-/* 
- * Handle window resizing
+/*
+ * draw_effect for a SEGMENT given apart from the ToddlerFun state
  */
-static gboolean 
-on_configure(GtkWidget *widget,
-             GdkEventConfigure *event, 
-	     gpointer user_data)
+static void
+draw_effect_segment (ToddlerFun *toddlerfun,
+		     cairo_t *cr,
+		     ToddlerFunSegmentFunc draw,
+		     const ToddlerFunSegment *segment)
 {
-    ToddlerFun *toddlerfun;
-    gint width, height, old_width, old_height;
-    cairo_surface_t *old_surface = NULL;
-
-    toddlerfun = (ToddlerFun *) user_data;
-    width = gtk_widget_get_allocated_width (widget);
-    height = gtk_widget_get_allocated_height (widget);
-
-    old_surface = toddlerfun->surface;
-
-    if (old_surface != NULL) {
-	old_width = cairo_image_surface_get_width (old_surface);
-	old_height = cairo_image_surface_get_height (old_surface);
+    ToddlerFunSymmetry *symmetry;
+    int i;
 
-	if (old_width == width && old_height == height) 
-	    return TRUE;
+    symmetry = &toddlerfun->symmetries[toddlerfun->effect_num];
+    for (i = 0; i < symmetry->n_copies; i++) {
+	cairo_save (cr);
+	cairo_transform (cr, &symmetry->copies[i]);
+	(*draw) (toddlerfun, cr, segment);
+	cairo_restore (cr);
     }
-	
-    toddlerfun->surface = cairo_image_surface_create (CAIRO_FORMAT_RGB24,
-						      width, height);
-
-    if (old_surface != NULL) {
-	cairo_t *cr = cairo_create (toddlerfun->surface);
-	cairo_scale (cr, 
-		     (gdouble) width / (gdouble) old_width,
-		     (gdouble) height / (gdouble) old_height);
-	cairo_set_source_surface (cr, old_surface, 0, 0);
-	cairo_paint (cr);
-	cairo_destroy (cr);
-	cairo_surface_destroy (old_surface);
+}
+
+/*
+ * Like draw_effect_segment with stroke_segment, but all copies of
+ * SEGMENT go into one path that is stroked once.  Where copies cross,
+ * the translucent source is therefore painted once rather than blended
+ * over itself, so those pixels come out lighter than with draw_effect.
+ * The damage is computed from the transformed end points instead of
+ * asking cairo for the stroke extents of every copy.
+ */
+static void
+draw_effect_lines (ToddlerFun *toddlerfun,
+		   cairo_t *cr,
+		   const ToddlerFunSegment *segment)
+{
+    ToddlerFunSymmetry *symmetry;
+    double pad;
+    int i;
+
+    pad = cairo_get_line_width (cr) / 2 + 1;
+
+    symmetry = &toddlerfun->symmetries[toddlerfun->effect_num];
+    for (i = 0; i < symmetry->n_copies; i++) {
+	double x1 = segment->from_x, y1 = segment->from_y;
+	double x2 = segment->x, y2 = segment->y;
+
+	cairo_matrix_transform_point (&symmetry->copies[i], &x1, &y1);
+	cairo_matrix_transform_point (&symmetry->copies[i], &x2, &y2);
+	cairo_move_to (cr, x1, y1);
+	cairo_line_to (cr, x2, y2);
+	add_user_rectangle_to_damage (toddlerfun, cr,
+				      MIN (x1, x2) - pad, MIN (y1, y2) - pad,
+				      MAX (x1, x2) + pad, MAX (y1, y2) + pad);
+    }
+    cairo_stroke (cr);
+}
+
+//
+// Drawing the effect from several threads
+//
+
+typedef struct {
+    ToddlerFun *toddlerfun;
+    cairo_pattern_t *source;
+    gdouble line_width;
+    ToddlerFunDrawFunc draw;
+} ToddlerFunRenderJob;
+
+static void
+render_effect_band (cairo_t *cr, gpointer user_data)
+{
+    ToddlerFunRenderJob *job = (ToddlerFunRenderJob *) user_data;
+    ToddlerFunSegment segment;
+
+    cairo_set_source (cr, job->source);
+    cairo_set_line_width (cr, job->line_width);
+    if (job->draw == NULL) {
+	current_segment (job->toddlerfun, &segment);
+	draw_effect_lines (job->toddlerfun, cr, &segment);
+    } else
+	draw_effect (job->toddlerfun, cr, job->draw);
+}
+
+/*
+ * Draw using the active effect with the source and line width of CR.
+ * With a render pool and many copies to draw, the canvas is split into
+ * bands that are drawn in parallel; otherwise this is just draw_effect.
+ * A DRAW of NULL means the batched lines of draw_effect_lines.  DRAW
+ * must only read the ToddlerFun state, since it may run in several
+ * threads at once.
+ */
+static void
+render_effect (ToddlerFun *toddlerfun,
+	       cairo_t *cr,
+	       ToddlerFunDrawFunc draw)
+{
+    ToddlerFunRenderJob job;
+    ToddlerFunSegment segment;
+    ToddlerFunPerfDraw perf_draw;
+    gint64 start = g_get_monotonic_time ();
+
+    if (toddlerfun->render_pool == NULL ||
+	toddlerfun->effect_num < toddlerfun_threaded_effect_min) {
+	if (draw == NULL) {
+	    current_segment (toddlerfun, &segment);
+	    draw_effect_lines (toddlerfun, cr, &segment);
+	} else
+	    draw_effect (toddlerfun, cr, draw);
     } else {
-	surface_clear(toddlerfun);
+	job.toddlerfun = toddlerfun;
+	job.source = cairo_get_source (cr);
+	job.line_width = cairo_get_line_width (cr);
+	job.draw = draw;
+
+	render_pool_run (toddlerfun->render_pool, toddlerfun->canvas->surface,
+			 CANVAS_TILE_SIZE, render_effect_band, &job);
     }
 
-    toddlerfun->has_previous = FALSE;
-	
-    return TRUE;
+    perf_draw = draw == &draw_image ? PERF_DRAW_IMAGES : PERF_DRAW_LINES;
+    perf_series_add (&toddlerfun->perf.draw_time[perf_draw],
+		     g_get_monotonic_time () - start);
 }
 
-static gboolean 
-on_draw(GtkWidget *window, 
-	cairo_t *cr,
-        gpointer user_data)
+/*
+ * Draw N_SEGMENTS line segments using the active effect, each in its
+ * own hue.  A DRAW of NULL means draw_effect_lines.  The segments are
+ * handed to DRAW instead of being set as the position in TODDLERFUN,
+ * so that the bands can do this at once.
+ */
+static void
+draw_segments (ToddlerFun *toddlerfun,
+	       cairo_t *cr,
+	       ToddlerFunSegmentFunc draw,
+	       const ToddlerFunSegment *segments,
+	       guint n_segments)
 {
+    guint i;
+
+    for (i = 0; i < n_segments; i++) {
+	set_line_source (cr, segments[i].hue);
+	if (draw == NULL)
+	    draw_effect_lines (toddlerfun, cr, &segments[i]);
+	else
+	    draw_effect_segment (toddlerfun, cr, draw, &segments[i]);
+    }
+}
+
+typedef struct {
     ToddlerFun *toddlerfun;
+    gdouble line_width;
+    ToddlerFunSegmentFunc draw;
+    const ToddlerFunSegment *segments;
+    guint n_segments;
+} ToddlerFunSegmentJob;
+
+static void
+render_segments_band (cairo_t *cr, gpointer user_data)
+{
+    ToddlerFunSegmentJob *job = (ToddlerFunSegmentJob *) user_data;
+
+    cairo_set_line_width (cr, job->line_width);
+    draw_segments (job->toddlerfun, cr, job->draw,
+		   job->segments, job->n_segments);
+}
+
+/*
+ * Draw the segments of a frame like render_effect draws one, with the
+ * line width of CR.  Each band draws all the segments, so the render
+ * pool is only started and joined once per frame.
+ */
+static void
+render_segments (ToddlerFun *toddlerfun,
+		 cairo_t *cr,
+		 ToddlerFunSegmentFunc draw,
+		 const ToddlerFunSegment *segments,
+		 guint n_segments)
+{
+    ToddlerFunSegmentJob job;
+    gint64 start = g_get_monotonic_time ();
+
+    if (toddlerfun->render_pool == NULL ||
+	toddlerfun->effect_num < toddlerfun_threaded_effect_min) {
+	draw_segments (toddlerfun, cr, draw, segments, n_segments);
+    } else {
+	job.toddlerfun = toddlerfun;
+	job.line_width = cairo_get_line_width (cr);
+	job.draw = draw;
+	job.segments = segments;
+	job.n_segments = n_segments;
+
+	render_pool_run (toddlerfun->render_pool, toddlerfun->canvas->surface,
+			 CANVAS_TILE_SIZE, render_segments_band, &job);
+    }
+
+    perf_series_add (&toddlerfun->perf.draw_time[PERF_DRAW_LINES],
+		     g_get_monotonic_time () - start);
+}
+
+static void
+surface_brighten (ToddlerFun *toddlerfun)
+{
+    canvas_fade (toddlerfun->canvas);
+
+    toddlerfun->fade_count++;
+    display_list_prune (toddlerfun->display_list, toddlerfun->fade_count,
+			canvas_get_fades_to_settle ());
+}
+
+//
+// Display list - recording what is drawn and drawing it again
+//
+
+static void
+record_op (ToddlerFun *toddlerfun, ToddlerFunOp *op, ToddlerFunOpType type)
+{
+    op->type = type;
+    op->effect_num = toddlerfun->effect_num;
+    op->fade_count = toddlerfun->fade_count;
+    display_list_append (toddlerfun->display_list, op,
+			 toddlerfun->canvas->width,
+			 toddlerfun->canvas->height);
+}
+
+static void
+replay_fades (ToddlerFun *toddlerfun, cairo_t *cr, guint n)
+{
+    n = MIN (n, (guint) canvas_get_fades_to_settle ());
+
+    for (; n > 0; n--) {
+	if (toddlerfun->exporting) {
+	    cairo_save (cr);
+	    cairo_set_source_rgb (cr, 1, 1, 1);
+	    cairo_paint_with_alpha (cr, 0.1);
+	    cairo_restore (cr);
+	} else {
+	    canvas_fade (toddlerfun->canvas);
+	}
+    }
+}
+
+/*
+ * The number of the object of the current theme with an image from
+ * IMAGE_FILE, or -1 if there is none
+ */
+static gint
+find_image_object (ToddlerFun *toddlerfun, const gchar *image_file)
+{
+    gint i;
+
+    for (i = 0; i < theme_get_n_objects (toddlerfun->theme); i++) {
+	ToddlerFunThemeObject *obj = theme_get_object (toddlerfun->theme, i);
+
+	if (object_has_image (obj) &&
+	    g_strcmp0 (obj->image_file, image_file) == 0)
+	    return i;
+    }
+
+    return -1;
+}
+
+static void
+free_image_handle (gpointer handle)
+{
+    if (handle != NULL)
+	g_object_unref (handle);
+}
+
+/*
+ * Set up drawing the image from IMAGE_FILE again.  The theme might have
+ * been reloaded or switched since it was drawn, so it is found by file
+ * rather than by object number.  Images of the current theme are drawn
+ * from their sprites.  The rest, and all images when exporting, are
+ * drawn from their SVG, which is loaded once per replay.
+ */
+static void
+prepare_replay_image (ToddlerFun *toddlerfun, const gchar *image_file)
+{
+    GHashTable *images = toddlerfun->replay_images;
+    RsvgHandle *handle;
+    gint object_num = -1;
+
+    if (!toddlerfun->exporting)
+	object_num = find_image_object (toddlerfun, image_file);
+    if (object_num >= 0) {
+	toddlerfun->object_num = object_num;
+	toddlerfun->sprite = lookup_sprite (toddlerfun);
+	return;
+    }
+
+    // Files that fail to load are remembered as NULL
+    if (!g_hash_table_lookup_extended (images, image_file,
+				       NULL, (gpointer *) &handle)) {
+	handle = load_image (image_file);
+	g_hash_table_insert (images, (gpointer) image_file, handle);
+    }
+    toddlerfun->image_handle = handle;
+}
+
+/*
+ * A position from the display list, on the canvas being replayed to
+ */
+static gint
+replay_position (gfloat position, gdouble scale)
+{
+    return floor (position * scale + 0.5);
+}
+
+static void
+replay_op (ToddlerFun *toddlerfun, cairo_t *cr, ToddlerFunOp *op)
+{
+    gdouble scale_x = toddlerfun->replay_scale_x;
+    gdouble scale_y = toddlerfun->replay_scale_y;
+    ToddlerFunSegment segment;
+
+    toddlerfun->effect_num = op->effect_num;
+    toddlerfun->x = replay_position (op->x, scale_x);
+    toddlerfun->y = replay_position (op->y, scale_y);
+
+    cairo_save (cr);
+
+    switch (op->type) {
+    case TODDLERFUN_OP_LINE:
+	toddlerfun->previous_x = replay_position (op->u.line.from_x, scale_x);
+	toddlerfun->previous_y = replay_position (op->u.line.from_y, scale_y);
+	toddlerfun->has_previous = TRUE;
+	set_line_source (cr, op->u.line.hue);
+	cairo_set_line_width (cr, toddlerfun_line_width);
+	if (toddlerfun->use_brush)
+	    draw_effect (toddlerfun, cr, &draw_brush);
+	else {
+	    current_segment (toddlerfun, &segment);
+	    draw_effect_lines (toddlerfun, cr, &segment);
+	}
+	break;
+
+    case TODDLERFUN_OP_IMAGE:
+	toddlerfun->image_rotation = op->u.image.rotation;
+	prepare_replay_image (toddlerfun, op->u.image.image_file);
+	draw_effect (toddlerfun, cr, &draw_image);
+	toddlerfun->sprite = NULL;
+	toddlerfun->image_handle = NULL;
+	break;
+
+    case TODDLERFUN_OP_STRING:
+	toddlerfun->letter_x = toddlerfun->x;
+	toddlerfun->letter_y = toddlerfun->y;
+	set_letter_source (cr, op->u.string.hue);
+	if (toddlerfun->exporting) {
+	    toddlerfun->layout = create_letter_layout (cr, op->u.string.text);
+	    draw_effect (toddlerfun, cr, &draw_string);
+	    g_object_unref (toddlerfun->layout);
+	    toddlerfun->layout = NULL;
+	} else {
+	    toddlerfun->glyph = glyph_cache_get (toddlerfun->glyphs,
+						 op->u.string.text);
+	    draw_effect (toddlerfun, cr, &draw_string);
+	    toddlerfun->glyph = NULL;
+	}
+	break;
+    }
+
+    cairo_restore (cr);
+}
+
+/*
+ * Draw everything in the display list to CR, with the fades that
+ * happened in between, as on a canvas of WIDTH x HEIGHT.  This goes to
+ * the canvas unless exporting is set, in which case CR can be any
+ * surface, and images are drawn from their SVG.
+ */
+static void
+replay_display_list (ToddlerFun *toddlerfun, cairo_t *cr,
+		     gint width, gint height)
+{
+    ToddlerFunDisplayList *list = toddlerfun->display_list;
+    ToddlerFun saved = *toddlerfun;
+    guint i, n, fade_count;
+
+    display_list_get_scale (list, width, height,
+			    &toddlerfun->replay_scale_x,
+			    &toddlerfun->replay_scale_y);
+    toddlerfun->replay_images =
+	g_hash_table_new_full (g_direct_hash, g_direct_equal,
+			       NULL, free_image_handle);
+
+    n = display_list_get_n_ops (list);
+    fade_count = toddlerfun->fade_count;
+    if (n > 0)
+	fade_count = display_list_get_op (list, 0)->fade_count;
+
+    for (i = 0; i < n; i++) {
+	ToddlerFunOp *op = display_list_get_op (list, i);
+	replay_fades (toddlerfun, cr, op->fade_count - fade_count);
+	fade_count = op->fade_count;
+	replay_op (toddlerfun, cr, op);
+    }
+    replay_fades (toddlerfun, cr, toddlerfun->fade_count - fade_count);
+
+    g_hash_table_destroy (toddlerfun->replay_images);
+    toddlerfun->replay_images = NULL;
+
+    // Put back the drawing state
+    toddlerfun->x = saved.x;
+    toddlerfun->y = saved.y;
+    toddlerfun->previous_x = saved.previous_x;
+    toddlerfun->previous_y = saved.previous_y;
+    toddlerfun->has_previous = saved.has_previous;
+    toddlerfun->effect_num = saved.effect_num;
+    toddlerfun->object_num = saved.object_num;
+    toddlerfun->image_rotation = saved.image_rotation;
+    toddlerfun->letter_x = saved.letter_x;
+    toddlerfun->letter_y = saved.letter_y;
+}
+
+//
+// Exporting the picture in the saver thread
+//
+
+/*
+ * Everything needed to draw the picture again, copied so that the
+ * main thread can go on drawing meanwhile
+ */
+typedef struct {
+    ToddlerFun toddlerfun;
+    gint width;
     gint height;
+    gdouble scale;
+} ToddlerFunExport;
 
-    toddlerfun = (ToddlerFun *) user_data;
+static ToddlerFunExport *
+export_new (ToddlerFun *toddlerfun, gdouble scale)
+{
+    ToddlerFunExport *export = g_new (ToddlerFunExport, 1);
+
+    // Exporting only reads the state below, and never the canvas or
+    // the theme
+    export->toddlerfun = *toddlerfun;
+    export->toddlerfun.display_list =
+	display_list_copy (toddlerfun->display_list);
+    export->toddlerfun.symmetries =
+	g_memdup (toddlerfun->symmetries,
+		  (toddlerfun_effect_max + 1) * sizeof (ToddlerFunSymmetry));
+    export->toddlerfun.exporting = TRUE;
+    export->width = toddlerfun->canvas->width;
+    export->height = toddlerfun->canvas->height;
+    export->scale = scale;
+
+    return export;
+}
 
-    if (toddlerfun == NULL || toddlerfun->surface == NULL)
-	return TRUE;
-	
-    cairo_set_source_surface (cr, toddlerfun->surface, 0, 0);
+static void
+export_free (gpointer data)
+{
+    ToddlerFunExport *export = data;
+
+    display_list_free (export->toddlerfun.display_list);
+    g_free (export->toddlerfun.symmetries);
+    g_free (export);
+}
+
+/*
+ * Draw the picture of an export onto TARGET, scaled by its scale.  Runs
+ * in the saver thread.
+ */
+static void
+export_picture (cairo_surface_t *target, gpointer data)
+{
+    ToddlerFunExport *export = data;
+    cairo_t *cr = cairo_create (target);
+
+    cairo_scale (cr, export->scale, export->scale);
+    cairo_set_source_rgb (cr, 1, 1, 1);
     cairo_paint (cr);
 
-    if (toddlerfun->has_message) {
-	height = cairo_image_surface_get_height (toddlerfun->surface);
-	cairo_set_source_surface (cr, toddlerfun->message_surface,
-				  10, height - 50);
-	cairo_paint_with_alpha (cr, toddlerfun->message_alpha);
-    }
+    replay_display_list (&export->toddlerfun, cr,
+			 export->width, export->height);
 
-    return FALSE;
+    cairo_destroy (cr);
 }
 
+/*
+ * Lay out all messages once, each in a box of its own size, stacked in
+ * one surface.  Called after the messages have been translated.
+ */
 static void
-update_color (ToddlerFun *toddlerfun,
-	      cairo_t *cr)
+render_messages (ToddlerFun *toddlerfun) 
 {
-    gdouble hue, r, g, b;
-    if (toddlerfun->has_previous) {
-	gdouble new_distance;
-	gint xdiff, ydiff;
+    PangoContext *context;
+    PangoLayout *layouts[NUM_MESSAGES];
+    PangoFontDescription *desc;
+    cairo_rectangle_int_t *rects;
+    gint width = 1, height = 0;
+    cairo_t *cr;
+    guint i;
 
-	xdiff = toddlerfun->x - toddlerfun->previous_x;
-	ydiff = toddlerfun->y - toddlerfun->previous_y;
-	new_distance = sqrt(xdiff * xdiff + ydiff * ydiff);
+    context = pango_font_map_create_context (
+	pango_cairo_font_map_get_default ());
+    desc = pango_font_description_from_string ("Sans 20px");
+    rects = g_new0 (cairo_rectangle_int_t, NUM_MESSAGES);
 
-	toddlerfun->traveled_distance += new_distance;
-	while (toddlerfun->traveled_distance > toddlerfun_color_cycle_distance)
-	    toddlerfun->traveled_distance -= toddlerfun_color_cycle_distance;
+    for (i = 0; i < NUM_MESSAGES; i++) {
+	gint text_width, text_height;
+
+	layouts[i] = pango_layout_new (context);
+	pango_layout_set_font_description (layouts[i], desc);
+	pango_layout_set_text (layouts[i], toddlerfun_messages[i], -1);
+	pango_layout_get_pixel_size (layouts[i], &text_width, &text_height);
+
+	// The text has a margin of 5 pixels in its box
+	rects[i].x = 0;
+	rects[i].y = height;
+	rects[i].width = text_width + 10;
+	rects[i].height = text_height + 10;
+
+	width = MAX (width, rects[i].width);
+	height += rects[i].height;
     }
 
-    hue = toddlerfun->traveled_distance / toddlerfun_color_cycle_distance;
-    gtk_hsv_to_rgb (hue, 1.0, 1.0, &r, &g, &b);
+    // The boxes are opaque, so there is no need for alpha
+    toddlerfun->message_atlas =
+	cairo_image_surface_create (CAIRO_FORMAT_RGB24, width, MAX (height, 1));
+    toddlerfun->message_rects = rects;
 
-    cairo_set_source_rgba (cr, r, g, b, 0.7);
+    cr = cairo_create (toddlerfun->message_atlas);
+    cairo_set_source_rgb (cr, 1, 1, 1);
+    cairo_paint (cr);
+
+    cairo_set_source_rgb (cr, 0, 0, 0);
+    for (i = 0; i < NUM_MESSAGES; i++) {
+	cairo_move_to (cr, rects[i].x + 5, rects[i].y + 5);
+	pango_cairo_show_layout (cr, layouts[i]);
+	g_object_unref (layouts[i]);
+    }
+    cairo_destroy (cr);
+
+    pango_font_description_free (desc);
+    g_object_unref (context);
 }
 
-static gboolean
-on_motion_notify (GtkWidget *widget,
-		  GdkEventButton *event,
-		  ToddlerFun *toddlerfun)
+/*
+ * Get the area of the window covered by the current message
+ */
+static void
+get_message_area (ToddlerFun *toddlerfun, cairo_rectangle_int_t *area)
 {
-    cairo_t *cr = cairo_create (toddlerfun->surface);
-    cairo_set_source_rgba(cr, 1, 0, 0, 0.3);
-    cairo_set_line_width(cr, 5);
+    cairo_rectangle_int_t *rect;
 
-    toddlerfun->region = cairo_region_create ();
-    toddlerfun->x = event->x;
-    toddlerfun->y = event->y;
+    rect = &toddlerfun->message_rects[toddlerfun->message_num];
+    area->x = 20;
+    area->y = toddlerfun->canvas->height - 40;
+    area->width = rect->width;
+    area->height = rect->height;
+}
 
-    update_color (toddlerfun, cr);
+static void
+queue_message_area (ToddlerFun *toddlerfun)
+{
+    cairo_rectangle_int_t area;
 
-    //	draw_line (toddlerfun, cr);
-    draw_effect (toddlerfun, cr, &draw_line);
+    if (toddlerfun->darea == NULL || toddlerfun->canvas == NULL)
+	return;
 
-    cairo_destroy(cr);
+    get_message_area (toddlerfun, &area);
+    gtk_widget_queue_draw_area (toddlerfun->darea, area.x, area.y,
+				area.width, area.height);
+}
 
-    gtk_widget_queue_draw_region (widget, toddlerfun->region);
+/*
+ * Show the next message, starting its fade in at NOW
+ */
+static void
+update_message (ToddlerFun *toddlerfun, gint64 now)
+{
+    toddlerfun->message_start = now;
 
-    cairo_region_destroy(toddlerfun->region);
-    toddlerfun->region = NULL;
+    // The old message might be wider than the new one
+    queue_message_area (toddlerfun);
 
-    toddlerfun->previous_x = event->x;
-    toddlerfun->previous_y = event->y;
-    toddlerfun->has_previous = TRUE;
+    toddlerfun->message_num = (toddlerfun->message_num + 1) % NUM_MESSAGES;
+    toddlerfun->message_alpha = 0;
 
-    return TRUE;
-}				 
+    queue_message_area (toddlerfun);
+}
 
-static gboolean
-on_button_press (GtkWidget *widget,
-		 GdkEventButton *event,
-		 ToddlerFun *toddlerfun)
+/*
+ * Fade the current message in or out on each frame.  While the message
+ * is fully shown, nothing needs to be redrawn, so the animation sleeps
+ * until the fade out.
+ */
+static gint64
+on_message_frame (gint64 now, gpointer user_data)
 {
-    gint num_objects;
-    cairo_t *cr = cairo_create (toddlerfun->surface);
+    ToddlerFun *toddlerfun = (ToddlerFun *) user_data;
+    gdouble elapsed, fade, alpha;
 
-    toddlerfun->region = cairo_region_create ();
-    toddlerfun->x = event->x;
-    toddlerfun->y = event->y;
-    num_objects = theme_get_n_objects (toddlerfun->theme);
-    if (num_objects < 1)
-	return TRUE;
+    elapsed = (gdouble) (now - toddlerfun->message_start) / G_USEC_PER_SEC;
+    if (elapsed >= toddlerfun_message_duration) {
+	update_message (toddlerfun, now);
+	elapsed = 0;
+    }
+
+    fade = MIN (elapsed, toddlerfun_message_duration - elapsed) /
+	toddlerfun_message_fade_time;
+    alpha = toddlerfun_message_alpha * CLAMP (fade, 0, 1);
+
+    if (alpha != toddlerfun->message_alpha) {
+	toddlerfun->message_alpha = alpha;
+	queue_message_area (toddlerfun);
+    }
+
+    if (fade >= 1)
+	return toddlerfun->message_start +
+	    (toddlerfun_message_duration - toddlerfun_message_fade_time) *
+	    G_USEC_PER_SEC;
+
+    return ANIMATOR_NEXT_FRAME;
+}
+
+static void
+start_message_fade (ToddlerFun *toddlerfun)
+{
+    if (toddlerfun->animator == NULL || toddlerfun->message_id != 0)
+	return;
+
+    toddlerfun->message_id = animator_add (toddlerfun->animator,
+					   on_message_frame, toddlerfun);
+}
+
+static void
+on_picture_saved (const gchar *pathname,
+		  const GError *error,
+		  gpointer user_data)
+{
+    if (error != NULL)
+        g_printerr(_("Failed to create file '%s'\n"), pathname);
+}
+
+static void
+save_picture (ToddlerFun *toddlerfun)
+{
+    GDateTime *datetime;
+    gchar *dirname;
+    gchar *timestamp;
+    gchar *filename;
+    gchar *pathname;
+    gdouble width, height;
+    gint64 start = trace_begin (toddlerfun->trace);
+ 
+    dirname = g_build_filename(g_get_home_dir(), "toddlerfun", NULL);
+
+    if(!g_file_test (dirname, G_FILE_TEST_EXISTS)) {
+        if (g_mkdir(dirname, 0750) < 0)
+            g_printerr(_("Failed to create directory '%s'\n"),
+		       dirname);
+    }
+
+    datetime = g_date_time_new_now_local ();
+    timestamp = g_date_time_format (datetime, "%F_%H.%M.%S");
+    filename = g_strconcat (timestamp, ".", toddlerfun->save_format, NULL);
+    pathname = g_build_filename(dirname, filename, NULL);
+
+    width = toddlerfun->canvas->width * toddlerfun->save_scale;
+    height = toddlerfun->canvas->height * toddlerfun->save_scale;
+
+    // Anything but a PNG of the canvas as it is has to be drawn again
+    // from the display list, which is done in the saver thread too
+    if (g_strcmp0 (toddlerfun->save_format, "png") != 0 ||
+	toddlerfun->save_scale != 1.0) {
+	saver_render (toddlerfun->saver, toddlerfun->save_format,
+		      width, height, export_picture,
+		      export_new (toddlerfun, toddlerfun->save_scale),
+		      export_free, pathname);
+    } else {
+	saver_save (toddlerfun->saver, canvas_snapshot (toddlerfun->canvas),
+		    pathname);
+    }
+
+    g_free (timestamp);
+    g_free (filename);
+    g_free (dirname);
+    g_free (pathname);
+    g_date_time_unref (datetime);
+
+    trace_end (toddlerfun->trace, "save_picture", start, NULL, 0);
+}
+
+/*
+ * Set the line color from the distance traveled, and return its hue.
+ */
+static gdouble
+update_color (ToddlerFun *toddlerfun,
+	      cairo_t *cr)
+{
+    gdouble hue;
+    if (toddlerfun->has_previous) {
+	gdouble new_distance;
+	gint xdiff, ydiff;
+
+	xdiff = toddlerfun->x - toddlerfun->previous_x;
+	ydiff = toddlerfun->y - toddlerfun->previous_y;
+	new_distance = sqrt(xdiff * xdiff + ydiff * ydiff);
+
+	toddlerfun->traveled_distance += new_distance;
+	while (toddlerfun->traveled_distance > toddlerfun_color_cycle_distance)
+	    toddlerfun->traveled_distance -= toddlerfun_color_cycle_distance;
+    }
+
+    hue = toddlerfun->traveled_distance / toddlerfun_color_cycle_distance;
+    set_line_source (cr, hue);
+
+    return hue;
+}
+
+/*
+ * Draw all motion points queued since the last frame, one segment at a
+ * time so that the color still follows the traveled distance, but with
+ * a single cairo context and a single invalidation.  The segments are
+ * not joined into one polyline: a path is stroked in a single color,
+ * and the translucent line would also look different where the
+ * segments of a frame overlap than where those of two frames do.
+ */
+static void
+drain_motion (ToddlerFun *toddlerfun)
+{
+    GArray *points = toddlerfun->motion_points;
+    ToddlerFunSegment *segments;
+    ToddlerFunSegmentFunc draw;
+    gdouble hue = 0;
+    cairo_t *cr;
+    guint i;
+
+    if (points->len == 0 || toddlerfun->canvas == NULL)
+	return;
+
+    cr = cairo_create (toddlerfun->canvas->surface);
+    cairo_set_line_width(cr, toddlerfun_line_width);
+    segments = g_new (ToddlerFunSegment, points->len);
+
+    for (i = 0; i < points->len; i++) {
+	ToddlerFunPoint *point = &g_array_index (points, ToddlerFunPoint, i);
+	ToddlerFunSegment *segment = &segments[i];
+	ToddlerFunOp op;
+
+	toddlerfun->x = point->x;
+	toddlerfun->y = point->y;
+
+	segment->from_x = toddlerfun->has_previous ?
+	    toddlerfun->previous_x : point->x;
+	segment->from_y = toddlerfun->has_previous ?
+	    toddlerfun->previous_y : point->y;
+	segment->x = point->x;
+	segment->y = point->y;
+	segment->has_previous = toddlerfun->has_previous;
+	segment->hue = hue = update_color (toddlerfun, cr);
+
+	op.x = point->x;
+	op.y = point->y;
+	op.u.line.from_x = segment->from_x;
+	op.u.line.from_y = segment->from_y;
+	op.u.line.hue = hue;
+	record_op (toddlerfun, &op, TODDLERFUN_OP_LINE);
+
+	toddlerfun->previous_x = point->x;
+	toddlerfun->previous_y = point->y;
+	toddlerfun->has_previous = TRUE;
+    }
+
+    if (toddlerfun->use_brush)
+	draw = &brush_segment;
+    else
+	draw = toddlerfun->batch_strokes ? NULL : &stroke_segment;
+    render_segments (toddlerfun, cr, draw, segments, points->len);
+
+    g_free (segments);
+    cairo_destroy(cr);
+
+    queue_damage (toddlerfun);
+
+    if (toddlerfun->synth != NULL)
+	synth_update (toddlerfun->synth,
+		      (gdouble) toddlerfun->x / toddlerfun->canvas->width,
+		      (gdouble) toddlerfun->y / toddlerfun->canvas->height,
+		      hue);
+
+    g_array_set_size (points, 0);
+}
+
+/*
+ * Make a canvas that the display can show as it is, without converting
+ * or copying it first, when there is a window to ask how; otherwise a
+ * plain image surface
+ */
+static ToddlerFunCanvas *
+create_canvas (ToddlerFun *toddlerfun, gint width, gint height)
+{
+    GdkWindow *window = NULL;
+    cairo_surface_t *surface;
+
+    if (toddlerfun->native_surface && toddlerfun->darea != NULL)
+	window = gtk_widget_get_window (toddlerfun->darea);
+    if (window == NULL)
+	return canvas_new (width, height);
+
+    // Drawing and fading need the pixels, so it has to be an image
+    surface = gdk_window_create_similar_image_surface (window,
+						       CAIRO_FORMAT_RGB24,
+						       width, height, 1);
+    if (cairo_surface_status (surface) != CAIRO_STATUS_SUCCESS ||
+	cairo_surface_get_type (surface) != CAIRO_SURFACE_TYPE_IMAGE ||
+	cairo_image_surface_get_format (surface) != CAIRO_FORMAT_RGB24) {
+	cairo_surface_destroy (surface);
+	return canvas_new (width, height);
+    }
+
+    return canvas_new_for_surface (surface);
+}
+
+/*
+ * Make the canvas WIDTH x HEIGHT pixels, keeping the picture
+ */
+static void
+resize_canvas (ToddlerFun *toddlerfun, gint width, gint height)
+{
+    ToddlerFunCanvas *old_canvas = NULL;
+
+    drain_motion (toddlerfun);
+    old_canvas = toddlerfun->canvas;
+
+    if (old_canvas != NULL &&
+	old_canvas->width == width && old_canvas->height == height) 
+	return;
+	
+    toddlerfun->canvas = create_canvas (toddlerfun, width, height);
+    update_symmetries (toddlerfun, width, height);
+
+    // Draw the picture again at the new size rather than stretching
+    // the old pixels
+    if (old_canvas != NULL) {
+	cairo_t *cr = cairo_create (toddlerfun->canvas->surface);
+	replay_display_list (toddlerfun, cr, width, height);
+	canvas_touch (toddlerfun->canvas, 0, 0, width, height);
+	cairo_destroy (cr);
+	canvas_free (old_canvas);
+    }
+
+    toddlerfun->has_previous = FALSE;
+}
+
+/* 
+ * Handle window resizing
+ */
+static gboolean 
+on_configure(GtkWidget *widget,
+             GdkEventConfigure *event, 
+	     gpointer user_data)
+{
+    ToddlerFun *toddlerfun;
+    gint width, height;
+
+    toddlerfun = (ToddlerFun *) user_data;
+    width = gtk_widget_get_allocated_width (widget);
+    height = gtk_widget_get_allocated_height (widget);
+
+    record_event (toddlerfun, TODDLERFUN_JOURNAL_CONFIGURE, 0, width, height);
+    resize_canvas (toddlerfun, width, height);
+	
+    return TRUE;
+}
+
+//
+// Performance HUD
+//
+
+static gint
+count_audio_pipelines (ToddlerFun *toddlerfun)
+{
+    gint i, n = n_sound_pipelines;
+
+    if (toddlerfun->mixer != NULL)
+	n++;
+    if (toddlerfun->music != NULL) {
+	for (i = 0; i < G_N_ELEMENTS (toddlerfun->music->decks); i++)
+	    if (toddlerfun->music->decks[i].playbin != NULL)
+		n++;
+    }
+
+    return n;
+}
+
+/*
+ * Draw the counters in the top left corner, and remember where so
+ * that only that part is redrawn to update them
+ */
+static void
+draw_perf_hud (ToddlerFun *toddlerfun, cairo_t *cr)
+{
+    static const gint pad = 8;
+    PangoLayout *layout;
+    PangoFontDescription *font;
+    gchar *text;
+    gint width, height;
+
+    text = perf_format (&toddlerfun->perf, count_audio_pipelines (toddlerfun));
+    layout = pango_cairo_create_layout (cr);
+    font = pango_font_description_from_string (toddlerfun_perf_hud_font);
+    pango_layout_set_font_description (layout, font);
+    pango_layout_set_text (layout, text, -1);
+    pango_layout_get_pixel_size (layout, &width, &height);
+
+    toddlerfun->perf_hud_area.x = 0;
+    toddlerfun->perf_hud_area.y = 0;
+    toddlerfun->perf_hud_area.width = width + 2 * pad;
+    toddlerfun->perf_hud_area.height = height + 2 * pad;
+
+    cairo_set_source_rgba (cr, 0, 0, 0, 0.6);
+    cairo_rectangle (cr, 0, 0, width + 2 * pad, height + 2 * pad);
+    cairo_fill (cr);
+    cairo_set_source_rgb (cr, 1, 1, 1);
+    cairo_move_to (cr, pad, pad);
+    pango_cairo_show_layout (cr, layout);
+
+    pango_font_description_free (font);
+    g_object_unref (layout);
+    g_free (text);
+}
+
+static gint64
+on_perf_hud_frame (gint64 now, gpointer user_data)
+{
+    ToddlerFun *toddlerfun = (ToddlerFun *) user_data;
+    cairo_rectangle_int_t *area = &toddlerfun->perf_hud_area;
+
+    gtk_widget_queue_draw_area (toddlerfun->darea, area->x, area->y,
+				area->width, area->height);
+
+    return now + toddlerfun_perf_hud_interval;
+}
+
+static void
+toggle_perf_hud (ToddlerFun *toddlerfun)
+{
+    // Nothing to show it on when replaying
+    if (toddlerfun->darea == NULL)
+	return;
+
+    toddlerfun->show_perf_hud = !toddlerfun->show_perf_hud;
+    if (toddlerfun->show_perf_hud) {
+	toddlerfun->perf_hud_id = animator_add (toddlerfun->animator,
+						on_perf_hud_frame,
+						toddlerfun);
+    } else {
+	animator_remove (toddlerfun->animator, toddlerfun->perf_hud_id);
+	toddlerfun->perf_hud_id = 0;
+    }
+    gtk_widget_queue_draw (toddlerfun->darea);
+}
+
+static void
+save_perf_stats (ToddlerFun *toddlerfun, const gchar *filename)
+{
+    GError *error = NULL;
+
+    if (!perf_write (&toddlerfun->perf, count_audio_pipelines (toddlerfun),
+		     filename, &error)) {
+	g_printerr ("%s\n", error->message);
+	g_clear_error (&error);
+    }
+}
+
+/*
+ * Note the GDK time of an input that will be drawn, for the trace of
+ * the frame that draws it
+ */
+static void
+trace_input (ToddlerFun *toddlerfun, guint32 time)
+{
+    if (toddlerfun->trace != NULL && toddlerfun->trace_input_time == 0)
+	toddlerfun->trace_input_time = time;
+}
+
+static void
+report_startup (ToddlerFun *toddlerfun, const gchar *what)
+{
+    if (toddlerfun->report_startup)
+	g_printerr ("%s after %.1f ms\n", what,
+		    (g_get_monotonic_time () - toddlerfun->start_time) / 1000.0);
+}
+
+static gboolean 
+on_draw(GtkWidget *window, 
+	cairo_t *cr,
+        gpointer user_data)
+{
+    ToddlerFun *toddlerfun;
+    cairo_rectangle_list_t *clip;
+    gint64 start, trace_start, dirty_area = 0;
+    int i;
+
+    toddlerfun = (ToddlerFun *) user_data;
+
+    if (toddlerfun == NULL || toddlerfun->canvas == NULL)
+	return TRUE;
+
+    if (!toddlerfun->shown) {
+	toddlerfun->shown = TRUE;
+	report_startup (toddlerfun, "First drawn");
+    }
+
+    trace_start = trace_begin (toddlerfun->trace);
+
+    // GTK clips to the damaged tiles; only those need their fades
+    // applied before they are composited
+    start = g_get_monotonic_time ();
+    clip = cairo_copy_clip_rectangle_list (cr);
+    if (clip->status == CAIRO_STATUS_SUCCESS) {
+	for (i = 0; i < clip->num_rectangles; i++) {
+	    cairo_rectangle_t *r = &clip->rectangles[i];
+	    gint x = floor (r->x), y = floor (r->y);
+	    gint width = ceil (r->x + r->width) - x;
+	    gint height = ceil (r->y + r->height) - y;
+
+	    canvas_materialize (toddlerfun->canvas, x, y, width, height);
+	    dirty_area += (gint64) width * height;
+	}
+    } else {
+	canvas_materialize_all (toddlerfun->canvas);
+	dirty_area = (gint64) toddlerfun->canvas->width *
+	    toddlerfun->canvas->height;
+    }
+    cairo_rectangle_list_destroy (clip);
+    perf_series_add (&toddlerfun->perf.fade_time,
+		     g_get_monotonic_time () - start);
+	
+    start = g_get_monotonic_time ();
+    cairo_set_source_surface (cr, toddlerfun->canvas->surface, 0, 0);
+    cairo_paint (cr);
+    perf_series_add (&toddlerfun->perf.blit_time,
+		     g_get_monotonic_time () - start);
+
+    if (toddlerfun->has_message && toddlerfun->message_alpha > 0) {
+	cairo_rectangle_int_t area, *rect;
+
+	rect = &toddlerfun->message_rects[toddlerfun->message_num];
+	get_message_area (toddlerfun, &area);
+	cairo_save (cr);
+	cairo_set_source_surface (cr, toddlerfun->message_atlas,
+				  area.x - rect->x, area.y - rect->y);
+	cairo_rectangle (cr, area.x, area.y, area.width, area.height);
+	cairo_clip (cr);
+	cairo_paint_with_alpha (cr, toddlerfun->message_alpha);
+	cairo_restore (cr);
+    }
+
+    if (toddlerfun->show_perf_hud)
+	draw_perf_hud (toddlerfun, cr);
+
+    perf_frame (&toddlerfun->perf, g_get_monotonic_time (), dirty_area);
+
+    // Tells which input this frame was the first to show
+    if (toddlerfun->trace_input_time != 0) {
+	trace_end (toddlerfun->trace, "on_draw", trace_start,
+		   "input_time", toddlerfun->trace_input_time);
+	toddlerfun->trace_input_time = 0;
+    } else {
+	trace_end (toddlerfun->trace, "on_draw", trace_start, NULL, 0);
+    }
+
+    return FALSE;
+}
+
+static gint64
+on_motion_frame (gint64 now, gpointer user_data)
+{
+    ToddlerFun *toddlerfun = (ToddlerFun *) user_data;
+
+    record_event (toddlerfun, TODDLERFUN_JOURNAL_FRAME, 0, 0, 0);
+    perf_series_add (&toddlerfun->perf.motion_events,
+		     toddlerfun->motion_points->len);
+    drain_motion (toddlerfun);
+    toddlerfun->motion_frame_id = 0;
+
+    return ANIMATOR_DONE;
+}
+
+/*
+ * Queue the point at X, Y for the next frame
+ */
+static void
+queue_motion_point (ToddlerFun *toddlerfun, gint x, gint y)
+{
+    ToddlerFunPoint point;
+
+    point.x = x;
+    point.y = y;
+    g_array_append_val (toddlerfun->motion_points, point);
+
+    record_event (toddlerfun, TODDLERFUN_JOURNAL_MOTION, 0, x, y);
+}
+
+/*
+ * Queue the positions the pointer went through between the last motion
+ * event and EVENT, when the windowing system keeps a motion history.
+ * Events are not compressed (see on_realize), so this is mostly empty,
+ * but a device can still report several samples in one event.
+ * Replayed events have no device and get nothing from here; their
+ * history was journaled as motion events of its own.
+ */
+static void
+queue_motion_history (ToddlerFun *toddlerfun, GdkEventMotion *event)
+{
+    GdkTimeCoord **history;
+    gint i, n_history;
+
+    if (event->device == NULL || event->window == NULL ||
+	toddlerfun->last_motion_time == 0 ||
+	event->time <= toddlerfun->last_motion_time + 1)
+	return;
+
+    if (!gdk_device_get_history (event->device, event->window,
+				 toddlerfun->last_motion_time + 1,
+				 event->time - 1, &history, &n_history))
+	return;
+
+    for (i = 0; i < n_history; i++) {
+	gdouble x, y;
+
+	if (gdk_device_get_axis (event->device, history[i]->axes,
+				 GDK_AXIS_X, &x) &&
+	    gdk_device_get_axis (event->device, history[i]->axes,
+				 GDK_AXIS_Y, &y))
+	    queue_motion_point (toddlerfun, x, y);
+    }
+
+    gdk_device_free_history (history, n_history);
+}
+
+static gboolean
+on_motion_notify (GtkWidget *widget,
+		  GdkEventMotion *event,
+		  ToddlerFun *toddlerfun)
+{
+    gint64 start = trace_begin (toddlerfun->trace);
+
+    queue_motion_history (toddlerfun, event);
+    queue_motion_point (toddlerfun, event->x, event->y);
+    toddlerfun->last_motion_time = event->time;
+    perf_input (&toddlerfun->perf);
+    trace_input (toddlerfun, event->time);
+
+    // A replayed journal drains the points at the recorded frames
+    if (toddlerfun->animator != NULL && toddlerfun->motion_frame_id == 0)
+	toddlerfun->motion_frame_id =
+	    animator_add (toddlerfun->animator, on_motion_frame, toddlerfun);
+
+    trace_end (toddlerfun->trace, "on_motion_notify", start,
+	       "time", event->time);
+
+    return TRUE;
+}				 
+
+/*
+ * GDK normally merges motion events so that only one arrives per
+ * frame.  We want every point for smooth lines, and do our own
+ * per-frame batching in drain_motion.
+ */
+static void
+on_realize (GtkWidget *widget,
+	    ToddlerFun *toddlerfun)
+{
+    gdk_window_set_event_compression (gtk_widget_get_window (widget), FALSE);
+}
+
+/*
+ * Choose a random object among those that have been loaded, or return
+ * -1 if none has.
+ */
+static gint
+pick_object (ToddlerFun *toddlerfun)
+{
+    gint i, n_ready = 0, len;
+
+    len = theme_get_n_objects (toddlerfun->theme);
+    for (i = 0; i < len; i++)
+	if (theme_get_object (toddlerfun->theme, i)->ready)
+	    n_ready++;
+    if (n_ready == 0)
+	return -1;
+
+    n_ready = g_rand_int_range (toddlerfun->rand, 0, n_ready);
+    for (i = 0; i < len; i++) {
+	if (theme_get_object (toddlerfun->theme, i)->ready && n_ready-- == 0)
+	    return i;
+    }
+
+    return -1;
+}
+
+static gboolean
+handle_button_press (ToddlerFun *toddlerfun, GdkEventButton *event)
+{
+    ToddlerFunThemeObject *obj;
+    ToddlerFunOp op;
+    cairo_t *cr;
+
+    record_event (toddlerfun, TODDLERFUN_JOURNAL_BUTTON, 0,
+		  event->x, event->y);
+    perf_input (&toddlerfun->perf);
+    trace_input (toddlerfun, event->time);
+    drain_motion (toddlerfun);
+
+    toddlerfun->x = event->x;
+    toddlerfun->y = event->y;
+    toddlerfun->object_num = pick_object (toddlerfun);
+    if (toddlerfun->object_num < 0)
+	return TRUE;
+
+    toddlerfun->image_rotation = g_rand_double_range (toddlerfun->rand,
+						      toddlerfun_min_rotation,
+						      toddlerfun_max_rotation);
+
+    obj = theme_get_object (toddlerfun->theme, toddlerfun->object_num);
+
+    if (toddlerfun->play_sound_fx && obj->sound_file != NULL) {
+	gint64 start = trace_begin (toddlerfun->trace);
+
+	if (toddlerfun->mixer != NULL)
+	    sound_mixer_play (toddlerfun->mixer, obj->sound_file,
+			      toddlerfun_sound_fx_gain);
+	else
+	    play_sound (obj->sound_file);
+	trace_end (toddlerfun->trace, "play_sound", start, NULL, 0);
+    }
+
+    if (!object_has_image (obj))
+	return TRUE;
+
+    op.x = toddlerfun->x;
+    op.y = toddlerfun->y;
+    op.u.image.image_file = g_intern_string (obj->image_file);
+    op.u.image.rotation = toddlerfun->image_rotation;
+    record_op (toddlerfun, &op, TODDLERFUN_OP_IMAGE);
+
+    // Looked up once here, so draw_image only has to paint it
+    toddlerfun->sprite = lookup_sprite (toddlerfun);
+
+    cr = cairo_create (toddlerfun->canvas->surface);
+    render_effect (toddlerfun, cr, &draw_image);
+	
+    cairo_destroy(cr);
+    toddlerfun->sprite = NULL;
+
+    queue_damage (toddlerfun);
+
+    return TRUE;
+}
+
+static gboolean
+on_button_press (GtkWidget *widget,
+		 GdkEventButton *event,
+		 ToddlerFun *toddlerfun)
+{
+    gint64 start = trace_begin (toddlerfun->trace);
+    gboolean handled;
+
+    handled = handle_button_press (toddlerfun, event);
+    trace_end (toddlerfun->trace, "on_button_press", start,
+	       "time", event->time);
+
+    return handled;
+}
+
+static void
+print_string (gchar *s, ToddlerFun *toddlerfun)
+{
+    ToddlerFunOp op;
+    gint64 start, trace_start = trace_begin (toddlerfun->trace);
+    cairo_t *cr = cairo_create (toddlerfun->canvas->surface);
+
+    op.x = toddlerfun->letter_x;
+    op.y = toddlerfun->letter_y;
+    g_strlcpy (op.u.string.text, s, sizeof (op.u.string.text));
+    op.u.string.hue = toddlerfun->letter_hue;
+    record_op (toddlerfun, &op, TODDLERFUN_OP_STRING);
+
+    // Shaped and rendered only the first time this letter is typed
+    toddlerfun->glyph = glyph_cache_get (toddlerfun->glyphs, s);
+    set_letter_source (cr, toddlerfun->letter_hue);
+
+    start = g_get_monotonic_time ();
+    draw_effect (toddlerfun, cr, &draw_string);
+    perf_series_add (&toddlerfun->perf.draw_time[PERF_DRAW_LETTERS],
+		     g_get_monotonic_time () - start);
+	
+    cairo_destroy (cr);
+    toddlerfun->glyph = NULL;
+
+    queue_damage (toddlerfun);
+
+    trace_end (toddlerfun->trace, "print_string", trace_start, NULL, 0);
+}
+
+static void
+fade_step (ToddlerFun *toddlerfun)
+{
+    record_event (toddlerfun, TODDLERFUN_JOURNAL_TICK, 0, 0, 0);
+    surface_brighten(toddlerfun);
+    queue_damage (toddlerfun);
+}
+
+static void
+brighten_step (ToddlerFun *toddlerfun)
+{
+    record_event (toddlerfun, TODDLERFUN_JOURNAL_BRIGHTEN, 0, 0, 0);
+    surface_brighten(toddlerfun);
+    queue_damage (toddlerfun);
+}
+
+/*
+ * Fade the picture a little every toddlerfun_fade_interval
+ */
+static gint64
+on_fade_frame (gint64 now, gpointer user_data)
+{
+    ToddlerFun *toddlerfun = (ToddlerFun *) user_data;
+
+    if (toddlerfun->next_fade_time != 0)
+	fade_step (toddlerfun);
+
+    // Don't catch up after the whole program was stopped for a while
+    toddlerfun->next_fade_time += toddlerfun_fade_interval;
+    if (toddlerfun->next_fade_time <= now)
+	toddlerfun->next_fade_time = now + toddlerfun_fade_interval;
+
+    return toddlerfun->next_fade_time;
+}
+
+/*
+ * Take the brighten steps that are due by NOW, so that brightening
+ * takes the same time whatever the frame rate
+ */
+static gint64
+on_brighten_frame (gint64 now, gpointer user_data)
+{
+    ToddlerFun *toddlerfun = (ToddlerFun *) user_data;
+
+    if (toddlerfun->next_brighten_time == 0)
+	toddlerfun->next_brighten_time = now;
+
+    while (toddlerfun->brighten_count > 0 &&
+	   toddlerfun->next_brighten_time <= now) {
+	brighten_step (toddlerfun);
+	toddlerfun->brighten_count--;
+	toddlerfun->next_brighten_time += toddlerfun_brighten_interval;
+    }
+
+    if (toddlerfun->brighten_count == 0) {
+	toddlerfun->brighten_id = 0;
+	return ANIMATOR_DONE;
+    }
+
+    return toddlerfun->next_brighten_time;
+}
+
+/*
+ * Brighten the picture quickly for a while.  Doing it again while it
+ * is brightening makes it last longer, not go faster.
+ */
+static void 
+brighten_quickly(ToddlerFun *toddlerfun) 
+{
+    toddlerfun->brighten_count = toddlerfun_brighten_steps;
+    if (toddlerfun->animator != NULL && toddlerfun->brighten_id == 0) {
+	toddlerfun->next_brighten_time = 0;
+	toddlerfun->brighten_id = animator_add (toddlerfun->animator,
+						on_brighten_frame,
+						toddlerfun);
+    }
+}
+
+static void
+effect_up (ToddlerFun *toddlerfun)
+{
+    if (toddlerfun->effect_num < toddlerfun_effect_max) {
+	brighten_quickly (toddlerfun);
+	toddlerfun->effect_num++;
+    }
+}
+
+static void
+effect_down (ToddlerFun *toddlerfun)
+{
+    if (toddlerfun->effect_num > toddlerfun_effect_min) {
+	brighten_quickly (toddlerfun);
+	toddlerfun->effect_num--;
+    }
+}
+
+static gboolean
+on_scroll (GtkWidget *widget,
+	   GdkEventScroll *event,
+	   ToddlerFun *toddlerfun)
+{
+    record_event (toddlerfun, TODDLERFUN_JOURNAL_SCROLL, event->direction, 0, 0);
+
+    if (event->direction == GDK_SCROLL_UP) {
+	effect_up (toddlerfun);
+	return TRUE;
+    }
+    if (event->direction == GDK_SCROLL_DOWN) {
+	effect_down (toddlerfun);
+	return TRUE;
+    }
+    return FALSE;
+}
+
+static void cycle_theme (ToddlerFun *toddlerfun);
+
+static gboolean
+handle_key_press (ToddlerFun *toddlerfun, GdkEventKey *event)
+{
+    gunichar c;
+    gboolean is_key_repeat;
+
+    record_event (toddlerfun, TODDLERFUN_JOURNAL_KEY_PRESS,
+		  event->state & toddlerfun_parent_modifiers,
+		  event->keyval, 0);
+    drain_motion (toddlerfun);
+
+    // Control-Alt-N for the next theme, until there is a parental
+    // console to pick one from, and Control-Alt-P for the performance
+    // HUD
+    if ((event->state & toddlerfun_parent_modifiers) ==
+	toddlerfun_parent_modifiers) {
+	if (event->keyval == GDK_KEY_n || event->keyval == GDK_KEY_N)
+	    cycle_theme (toddlerfun);
+	else if (event->keyval == GDK_KEY_p || event->keyval == GDK_KEY_P)
+	    toggle_perf_hud (toddlerfun);
+	return TRUE;
+    }
+
+    is_key_repeat = event->keyval == toddlerfun->last_keyval;
+    toddlerfun->last_keyval = event->keyval;
+
+    switch (event->keyval) {
+    case GDK_KEY_space:
+	brighten_quickly (toddlerfun);
+	return TRUE;
+
+    case GDK_KEY_Escape:
+	if (toddlerfun->darea != NULL)
+	    gtk_main_quit();
+	return TRUE;
+
+    case GDK_KEY_Up:
+	effect_up (toddlerfun);
+        break;
+
+    case GDK_KEY_Down:
+	effect_down (toddlerfun);
+        break;
+
+    case GDK_KEY_Return:
+	// Not when replaying, which should not leave files behind
+	if (toddlerfun->darea != NULL)
+	    save_picture (toddlerfun);
+	break;
+
+    default:
+	c = gdk_keyval_to_unicode (event->keyval);
+	if (c >= 0 && g_unichar_isgraph (c) && toddlerfun->has_previous) {
+	    gchar outbuf[7];
+	    gint bytes_written;
+	    bytes_written = g_unichar_to_utf8 (c, outbuf);
+	    outbuf[bytes_written] = '\0';
+
+	    if (is_key_repeat) {
+		toddlerfun->letter_hue += 0.01;
+		if (toddlerfun->letter_hue >= 1.0) 
+		    toddlerfun->letter_hue -= 1.0;
+	    } else {
+		toddlerfun->letter_x = toddlerfun->previous_x;
+		toddlerfun->letter_y = toddlerfun->previous_y;
+		toddlerfun->letter_hue = g_rand_double (toddlerfun->rand);
+	    }
+
+	    perf_input (&toddlerfun->perf);
+	    trace_input (toddlerfun, event->time);
+	    print_string (outbuf, toddlerfun);
+	}	
+    }
+
+    return FALSE;
+}
+
+static gboolean
+on_key_press (GtkWidget *widget,
+	      GdkEventKey *event,
+	      ToddlerFun *toddlerfun)
+{
+    gint64 start = trace_begin (toddlerfun->trace);
+    gboolean handled;
+
+    handled = handle_key_press (toddlerfun, event);
+    trace_end (toddlerfun->trace, "on_key_press", start,
+	       "time", event->time);
+
+    return handled;
+}
+
+static gboolean
+on_key_release(GtkWidget *widget,
+	       GdkEventKey *event,
+	       ToddlerFun *toddlerfun)
+{
+    record_event (toddlerfun, TODDLERFUN_JOURNAL_KEY_RELEASE, 0,
+		  event->keyval, 0);
+    toddlerfun->last_keyval = GDK_KEY_VoidSymbol;
+
+    return FALSE;
+}
+
+static GtkWidget*
+create_window (ToddlerFun *toddlerfun, gboolean fullscreen)
+{
+    GtkWidget *window, *darea;
+
+    window = toddlerfun->window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+    darea = toddlerfun->darea = gtk_drawing_area_new ();
+    gtk_container_add (GTK_CONTAINER (window), darea);
+
+    gtk_window_set_title (GTK_WINDOW (window), "ToddlerFun");
+    if (fullscreen)
+	gtk_window_fullscreen (GTK_WINDOW (window));
+    else 
+	gtk_window_set_default_size (GTK_WINDOW (window), 1000, 800);
+
+    g_signal_connect (window, "destroy", G_CALLBACK (gtk_main_quit), NULL);
+    g_signal_connect (darea, "draw", G_CALLBACK (on_draw), toddlerfun);
+    g_signal_connect (darea, "realize",
+		      G_CALLBACK (on_realize), toddlerfun);
+    g_signal_connect (darea, "configure-event", 
+		      G_CALLBACK (on_configure), toddlerfun); 
+    g_signal_connect (darea, "motion-notify-event",
+		      G_CALLBACK (on_motion_notify), toddlerfun);
+    g_signal_connect (darea, "button-press-event", 
+		      G_CALLBACK (on_button_press), toddlerfun); 
+    g_signal_connect (darea, "scroll-event",
+		      G_CALLBACK (on_scroll), toddlerfun);
+    g_signal_connect (window, "key-press-event",
+		      G_CALLBACK (on_key_press), toddlerfun);
+    g_signal_connect (window, "key-release-event",
+		      G_CALLBACK (on_key_release), toddlerfun);
+    gtk_widget_set_events(darea,
+			  gtk_widget_get_events(window) | 
+			  GDK_BUTTON_PRESS_MASK |
+			  GDK_POINTER_MOTION_MASK |
+			  GDK_SCROLL_MASK);
+
+    toddlerfun->animator = animator_new (darea);
+    animator_add (toddlerfun->animator, on_fade_frame, toddlerfun);
+		
+    return window;
+}
+
+typedef struct {
+    ToddlerFun *toddlerfun;
+    ToddlerFunTheme *theme;
+    gint object_num;
+    RsvgHandle *image_handle;
+    gboolean load_sound;
+    ToddlerFunSample *sample;
+    gint64 image_mtime;
+    gint64 sound_mtime;
+} ToddlerFunLoadJob;
+
+/*
+ * The modification time of FILENAME in microseconds, or 0 if it
+ * doesn't exist
+ */
+static gint64
+get_file_mtime (const gchar *filename)
+{
+    GFile *file;
+    GFileInfo *info;
+    gint64 mtime = 0;
+
+    if (filename == NULL)
+	return 0;
+
+    file = g_file_new_for_path (filename);
+    info = g_file_query_info (file,
+			      G_FILE_ATTRIBUTE_TIME_MODIFIED ","
+			      G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC,
+			      G_FILE_QUERY_INFO_NONE, NULL, NULL);
+    if (info != NULL) {
+	mtime = g_file_info_get_attribute_uint64 (info,
+						  G_FILE_ATTRIBUTE_TIME_MODIFIED)
+	    * G_USEC_PER_SEC +
+	    g_file_info_get_attribute_uint32 (info,
+					      G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+	g_object_unref (info);
+    }
+    g_object_unref (file);
+
+    return mtime;
+}
+
+/*
+ * Load the image and sound of one object.  This only reads the theme,
+ * so it can run in any thread.  What a theme bundle already has
+ * rasterized or decoded is not loaded again, and neither is an image
+ * taken over from the theme being reloaded.
+ */
+static void
+load_object (ToddlerFunLoadJob *job)
+{
+    ToddlerFunThemeObject *obj;
+
+    obj = theme_get_object (job->theme, job->object_num);
+    job->image_mtime = get_file_mtime (obj->image_file);
+    job->sound_mtime = get_file_mtime (obj->sound_file);
+    if (obj->image_file != NULL && obj->image_handle == NULL &&
+	obj->n_bundle_sprites == 0)
+	job->image_handle = load_image (obj->image_file);
+    if (job->toddlerfun->mixer == NULL || !job->load_sound)
+	return;
+    if (obj->pcm != NULL) {
+	GMappedFile *bundle = g_mapped_file_ref (job->theme->bundle);
+	job->sample = sound_sample_new_static (obj->pcm, obj->pcm_n_frames,
+					       bundle, (GDestroyNotify)
+					       g_mapped_file_unref);
+    }
+    else if (obj->sound_file != NULL)
+	job->sample = sound_sample_decode (obj->sound_file);
+}
+
+static void start_queued_theme_load (ToddlerFun *toddlerfun);
+static void finish_theme_load (ToddlerFun *toddlerfun);
+
+/*
+ * Hand what load_object loaded over to the object, which can then be
+ * clicked.  Runs in the main thread.
+ */
+static gboolean
+on_object_loaded (gpointer user_data)
+{
+    ToddlerFunLoadJob *job = user_data;
+    ToddlerFun *toddlerfun = job->toddlerfun;
+    ToddlerFunThemeObject *obj;
+
+    obj = theme_get_object (job->theme, job->object_num);
+    if (job->image_handle != NULL)
+	obj->image_handle = job->image_handle;
+    if (job->sample != NULL)
+	sound_mixer_add_sample (toddlerfun->mixer, obj->sound_file,
+				job->sample);
+    obj->image_mtime = job->image_mtime;
+    obj->sound_mtime = job->sound_mtime;
+    obj->ready = TRUE;
+
+    if (job->theme == toddlerfun->theme) {
+	if (--toddlerfun->n_loading == 0) {
+	    report_startup (toddlerfun, "Theme loaded");
+	    start_queued_theme_load (toddlerfun);
+	}
+    } else {
+	if (--toddlerfun->n_reloading == 0)
+	    finish_theme_load (toddlerfun);
+    }
+    g_free (job);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void
+load_object_thread (gpointer data, gpointer user_data)
+{
+    load_object ((ToddlerFunLoadJob *) data);
+    g_idle_add (on_object_loaded, data);
+}
+
+/*
+ * Put the sprites of a theme bundle in the sprite cache.  They are
+ * painted straight from the mapped file.
+ */
+static void
+add_bundle_sprites (ToddlerFun *toddlerfun)
+{
+    ToddlerFunTheme *theme = toddlerfun->theme;
+    gint i, len;
+    guint j;
+
+    len = theme_get_n_objects (theme);
+    for (i = 0; i < len; i++) {
+	ToddlerFunThemeObject *obj = theme_get_object (theme, i);
+
+	for (j = 0; j < obj->n_bundle_sprites; j++) {
+	    const ToddlerFunBundleSprite *bundle_sprite;
+	    ToddlerFunSprite *sprite;
+	    guchar *data;
+
+	    bundle_sprite = &obj->bundle_sprites[j];
+	    data = (guchar *) theme->bundle_data + bundle_sprite->data_offset;
+
+	    sprite = g_new0 (ToddlerFunSprite, 1);
+	    sprite->x_offset = bundle_sprite->x_offset;
+	    sprite->y_offset = bundle_sprite->y_offset;
+	    sprite->width = bundle_sprite->width;
+	    sprite->height = bundle_sprite->height;
+	    sprite->surface =
+		cairo_image_surface_create_for_data (data, CAIRO_FORMAT_ARGB32,
+						     sprite->width,
+						     sprite->height,
+						     bundle_sprite->stride);
+	    sprite_cache_insert (toddlerfun->sprites, i, bundle_sprite->size,
+				 bundle_sprite->rotation_step, sprite);
+	}
+    }
+}
+
+/*
+ * Load the objects of THEME whose numbers are in OBJECT_NUMS, using
+ * N_THREADS threads or, with none, before returning.  A sound used by
+ * several of them is only decoded by the first.
+ */
+static void
+load_objects (ToddlerFun *toddlerfun, ToddlerFunTheme *theme,
+	      GArray *object_nums, gint n_threads)
+{
+    GThreadPool *pool = NULL;
+    GHashTable *sound_files;
+    guint i;
+
+    if (n_threads > 0)
+	pool = g_thread_pool_new (load_object_thread, NULL, n_threads,
+				  FALSE, NULL);
+    sound_files = g_hash_table_new (g_str_hash, g_str_equal);
+
+    for (i = 0; i < object_nums->len; i++) {
+	ToddlerFunLoadJob *job = g_new0 (ToddlerFunLoadJob, 1);
+	ToddlerFunThemeObject *obj;
+
+	job->toddlerfun = toddlerfun;
+	job->theme = theme;
+	job->object_num = g_array_index (object_nums, gint, i);
+
+	obj = theme_get_object (theme, job->object_num);
+	if (obj->sound_file != NULL &&
+	    !g_hash_table_contains (sound_files, obj->sound_file)) {
+	    g_hash_table_add (sound_files, obj->sound_file);
+	    job->load_sound = TRUE;
+	}
+
+	if (pool != NULL) {
+	    g_thread_pool_push (pool, job, NULL);
+	} else {
+	    load_object (job);
+	    on_object_loaded (job);
+	}
+    }
+
+    g_hash_table_destroy (sound_files);
+
+    // The threads finish the queued jobs and then go away
+    if (pool != NULL)
+	g_thread_pool_free (pool, FALSE, FALSE);
+}
+
+/*
+ * Read the theme FILENAME, and load the images and sounds of its
+ * objects using N_THREADS threads.  With threads, this returns right
+ * away and each object becomes ready when it has been loaded; with
+ * none, everything is loaded before returning.
+ */
+static void
+load_theme (ToddlerFun *toddlerfun, const gchar *filename, gint n_threads)
+{
+    GArray *object_nums;
+    gint i, len;
+
+    toddlerfun->theme = theme_new ();
+    toddlerfun->theme_file = g_strdup (filename);
+    toddlerfun->sprites = sprite_cache_new ();
+    toddlerfun->load_threads = n_threads;
+    theme_read (toddlerfun->theme, toddlerfun->theme_file);
+    if (!toddlerfun->theme->parsed_ok)
+	return;
+
+    if (toddlerfun->theme->bundle != NULL)
+	add_bundle_sprites (toddlerfun);
+
+    len = theme_get_n_objects (toddlerfun->theme);
+    toddlerfun->n_loading = len;
+    object_nums = g_array_sized_new (FALSE, FALSE, sizeof (gint), len);
+    for (i = 0; i < len; i++)
+	g_array_append_val (object_nums, i);
+    load_objects (toddlerfun, toddlerfun->theme, object_nums, n_threads);
+    g_array_free (object_nums, TRUE);
+}
+
+//
+// Switching themes, and reloading the theme when its files change
+//
+
+/*
+ * Find the object of the current theme that was loaded from FILENAME,
+ * as image if IMAGE is TRUE and as sound otherwise
+ */
+static ToddlerFunThemeObject *
+find_loaded_object (ToddlerFun *toddlerfun, const gchar *filename,
+		    gboolean image)
+{
+    gint i;
 
-    toddlerfun->object_num = g_random_int_range (0, num_objects);
-    toddlerfun->image_rotation = g_random_double_range (toddlerfun_min_rotation,
-							toddlerfun_max_rotation);
+    if (filename == NULL)
+	return NULL;
 
-    if (toddlerfun->play_sound_fx) {
+    for (i = 0; i < theme_get_n_objects (toddlerfun->theme); i++) {
 	ToddlerFunThemeObject *obj;
-	obj = theme_get_object (toddlerfun->theme, toddlerfun->object_num);
-	play_sound (obj->sound_file, FALSE);
-    }
-
-    draw_effect (toddlerfun, cr, &draw_image);
-	
-    cairo_destroy(cr);
 
-    gtk_widget_queue_draw_region (widget, toddlerfun->region);
-    cairo_region_destroy(toddlerfun->region);
-    toddlerfun->region = NULL;
+	obj = theme_get_object (toddlerfun->theme, i);
+	if (obj->ready &&
+	    g_strcmp0 (image ? obj->image_file : obj->sound_file,
+		       filename) == 0)
+	    return obj;
+    }
 
-    return TRUE;
+    return NULL;
 }
 
+/*
+ * Read the theme FILENAME, which is the current one when reloading it,
+ * and load the objects whose image or sound isn't loaded already, or
+ * changed since it was, in the background.  The rest are taken over
+ * from the current theme.  The current theme is used until everything
+ * has been loaded, and then swapped in one go.
+ */
 static void
-print_string (gchar *s, ToddlerFun *toddlerfun)
+start_theme_load (ToddlerFun *toddlerfun, const gchar *filename)
 {
-    gdouble r, g, b;
-    PangoFontDescription *desc;
-    cairo_t *cr = cairo_create (toddlerfun->surface);
+    ToddlerFunTheme *theme;
+    GArray *object_nums;
+    gint i, len;
 
-    toddlerfun->region = cairo_region_create ();
+    // One at a time, and not while the theme is still being loaded
+    if (toddlerfun->next_theme != NULL || toddlerfun->n_loading > 0) {
+	g_free (toddlerfun->queued_theme_file);
+	toddlerfun->queued_theme_file = g_strdup (filename);
+	return;
+    }
 
-    toddlerfun->layout = pango_cairo_create_layout (cr);
-    pango_layout_set_text (toddlerfun->layout, s, -1);
-    desc = pango_font_description_from_string ("Sans Bold 60px");
-    pango_layout_set_font_description (toddlerfun->layout, desc);
-    pango_font_description_free (desc);
+    theme = theme_new ();
+    theme_read (theme, (gchar *) filename);
+    if (!theme->parsed_ok) {
+	// Probably saved halfway; wait for the next change
+	theme_free (theme);
+	return;
+    }
 
-    gtk_hsv_to_rgb (toddlerfun->letter_hue, 1.0, 0.8, &r, &g, &b);
-    cairo_set_source_rgb (cr, r, g, b);
+    len = theme_get_n_objects (theme);
+    object_nums = g_array_new (FALSE, FALSE, sizeof (gint));
+    for (i = 0; i < len; i++) {
+	ToddlerFunThemeObject *obj = theme_get_object (theme, i);
+	ToddlerFunThemeObject *old_image, *old_sound;
+	gboolean load = FALSE;
+
+	old_image = find_loaded_object (toddlerfun, obj->image_file, TRUE);
+	if (old_image != NULL &&
+	    old_image->image_mtime == get_file_mtime (obj->image_file) &&
+	    (old_image->image_handle != NULL || obj->n_bundle_sprites > 0)) {
+	    if (old_image->image_handle != NULL)
+		obj->image_handle = g_object_ref (old_image->image_handle);
+	    obj->image_mtime = old_image->image_mtime;
+	} else if (obj->image_file != NULL) {
+	    // Whatever the bundle has is older than the file
+	    obj->n_bundle_sprites = 0;
+	    load = TRUE;
+	}
 
-    draw_effect (toddlerfun, cr, &draw_string);
-	
-    cairo_destroy (cr);
+	// The mixer already has the sample of an unchanged sound
+	old_sound = find_loaded_object (toddlerfun, obj->sound_file, FALSE);
+	if (old_sound != NULL &&
+	    old_sound->sound_mtime == get_file_mtime (obj->sound_file)) {
+	    obj->sound_mtime = old_sound->sound_mtime;
+	} else if (obj->sound_file != NULL) {
+	    obj->pcm = NULL;
+	    load = TRUE;
+	}
 
-    gtk_widget_queue_draw_region (toddlerfun->darea, toddlerfun->region);
+	if (load)
+	    g_array_append_val (object_nums, i);
+	else
+	    obj->ready = TRUE;
+    }
 
-    g_object_unref (toddlerfun->layout);
-    cairo_region_destroy (toddlerfun->region);
-    toddlerfun->region = NULL;
+    toddlerfun->next_theme = theme;
+    toddlerfun->next_theme_file = g_strdup (filename);
+    toddlerfun->n_reloading = object_nums->len;
+    if (object_nums->len > 0)
+	load_objects (toddlerfun, theme, object_nums,
+		      toddlerfun->load_threads);
+    else
+	finish_theme_load (toddlerfun);
+    g_array_free (object_nums, TRUE);
 }
 
-static gboolean
-on_tick (gpointer user_data)
+static void
+start_queued_theme_load (ToddlerFun *toddlerfun)
 {
-    ToddlerFun *toddlerfun = (ToddlerFun *) user_data;
+    gchar *filename = toddlerfun->queued_theme_file;
 
-    surface_brighten(toddlerfun);
-
-    if (g_timer_elapsed (toddlerfun->message_timer, NULL) >= 5)
-	update_message (toddlerfun);
-
-    gtk_widget_queue_draw (toddlerfun->darea);
-    return TRUE;
+    if (filename != NULL) {
+	toddlerfun->queued_theme_file = NULL;
+	start_theme_load (toddlerfun, filename);
+	g_free (filename);
+    }
 }
 
-static gboolean
-on_brighten_quickly_timeout (gpointer user_data)
+/*
+ * The theme that will be in use once nothing more is loading
+ */
+static const gchar *
+get_latest_theme_file (ToddlerFun *toddlerfun)
 {
-    ToddlerFun *toddlerfun = (ToddlerFun *) user_data;
-    surface_brighten(toddlerfun);
-    gtk_widget_queue_draw (toddlerfun->darea);
-    return (--toddlerfun->brighten_count > 0);
+    if (toddlerfun->queued_theme_file != NULL)
+	return toddlerfun->queued_theme_file;
+    if (toddlerfun->next_theme_file != NULL)
+	return toddlerfun->next_theme_file;
+    return toddlerfun->theme_file;
 }
 
-static void 
-brighten_quickly(ToddlerFun *toddlerfun) 
+static void
+start_music (ToddlerFun *toddlerfun)
 {
-    toddlerfun->brighten_count = 40;
-    g_timeout_add (1000 / 30, on_brighten_quickly_timeout, toddlerfun);
+    GPtrArray *tracks = toddlerfun->theme->music_tracks;
+
+    if (tracks->len > 0)
+	toddlerfun->music =
+	    music_new ((gchar **) tracks->pdata, tracks->len,
+		       toddlerfun->theme->music_crossfade);
+    else if (toddlerfun->theme->background_sound_file != NULL)
+	toddlerfun->music =
+	    music_new (&toddlerfun->theme->background_sound_file, 1, 0);
 }
 
+static void watch_theme (ToddlerFun *toddlerfun);
+
+/*
+ * Take the sounds of OLD_THEME that the current theme doesn't use out
+ * of the mixer, so that their samples, and the bundle they might point
+ * into, can go
+ */
 static void
-effect_up (ToddlerFun *toddlerfun)
+retire_theme_sounds (ToddlerFun *toddlerfun, ToddlerFunTheme *old_theme)
 {
-    if (toddlerfun->effect_num < toddlerfun_effect_max) {
-	brighten_quickly (toddlerfun);
-	toddlerfun->effect_num++;
+    GHashTable *sound_files;
+    gint i;
+
+    if (toddlerfun->mixer == NULL)
+	return;
+
+    sound_files = g_hash_table_new (g_str_hash, g_str_equal);
+    for (i = 0; i < theme_get_n_objects (toddlerfun->theme); i++) {
+	ToddlerFunThemeObject *obj = theme_get_object (toddlerfun->theme, i);
+
+	if (obj->sound_file != NULL)
+	    g_hash_table_add (sound_files, obj->sound_file);
+    }
+
+    for (i = 0; i < theme_get_n_objects (old_theme); i++) {
+	ToddlerFunThemeObject *obj = theme_get_object (old_theme, i);
+
+	if (obj->sound_file != NULL &&
+	    !g_hash_table_contains (sound_files, obj->sound_file))
+	    sound_mixer_remove_sample (toddlerfun->mixer, obj->sound_file);
     }
+
+    g_hash_table_destroy (sound_files);
 }
 
+/*
+ * Swap in the loaded theme.  Sprites are rendered again as they are
+ * needed, since the objects might have been renumbered, and sounds
+ * only the old theme had are dropped.  A theme switched to brings its
+ * own music, and its directory is watched instead.
+ */
 static void
-effect_down (ToddlerFun *toddlerfun)
+finish_theme_load (ToddlerFun *toddlerfun)
 {
-    if (toddlerfun->effect_num > toddlerfun_effect_min) {
-	brighten_quickly (toddlerfun);
-	toddlerfun->effect_num--;
+    ToddlerFunTheme *old_theme = toddlerfun->theme;
+    gboolean switched;
+
+    toddlerfun->theme = toddlerfun->next_theme;
+    toddlerfun->next_theme = NULL;
+    switched = g_strcmp0 (toddlerfun->next_theme_file,
+			  toddlerfun->theme_file) != 0;
+    g_free (toddlerfun->theme_file);
+    toddlerfun->theme_file = toddlerfun->next_theme_file;
+    toddlerfun->next_theme_file = NULL;
+
+    sprite_cache_clear (toddlerfun->sprites);
+    if (toddlerfun->theme->bundle != NULL)
+	add_bundle_sprites (toddlerfun);
+    retire_theme_sounds (toddlerfun, old_theme);
+    theme_free (old_theme);
+
+    if (switched) {
+	if (toddlerfun->music != NULL) {
+	    music_free (toddlerfun->music);
+	    toddlerfun->music = NULL;
+	}
+	if (toddlerfun->play_music)
+	    start_music (toddlerfun);
+
+	if (toddlerfun->theme_monitor != NULL) {
+	    g_file_monitor_cancel (toddlerfun->theme_monitor);
+	    g_object_unref (toddlerfun->theme_monitor);
+	    toddlerfun->theme_monitor = NULL;
+	    watch_theme (toddlerfun);
+	}
     }
+
+    start_queued_theme_load (toddlerfun);
 }
 
-static gboolean
-on_scroll (GtkWidget *widget,
-	   GdkEventScroll *event,
-	   ToddlerFun *toddlerfun)
+/*
+ * Switch to the next theme in the catalog
+ */
+static void
+cycle_theme (ToddlerFun *toddlerfun)
 {
-    if (event->direction == GDK_SCROLL_UP) {
-	effect_up (toddlerfun);
-	return TRUE;
-    }
-    if (event->direction == GDK_SCROLL_DOWN) {
-	effect_down (toddlerfun);
-	return TRUE;
-    }
-    return FALSE;
+    GPtrArray *entries = toddlerfun->catalog->entries;
+    ToddlerFunCatalogEntry *entry;
+    guint i;
+
+    if (entries->len == 0)
+	return;
+
+    entry = catalog_find_file (toddlerfun->catalog,
+			       get_latest_theme_file (toddlerfun));
+    for (i = 0; entry != NULL && i < entries->len; i++)
+	if (g_ptr_array_index (entries, i) == entry)
+	    break;
+    i = entry != NULL ? (i + 1) % entries->len : 0;
+
+    entry = g_ptr_array_index (entries, i);
+    start_theme_load (toddlerfun, entry->filename);
 }
 
 static gboolean
-on_key_press(GtkWidget *widget,
-	     GdkEventKey *event,
-	     ToddlerFun *toddlerfun)
+on_theme_reload_timeout (gpointer user_data)
 {
-    gunichar c;
-    gboolean is_key_repeat;
-
-    is_key_repeat = event->keyval == toddlerfun->last_keyval;
-    toddlerfun->last_keyval = event->keyval;
-
-    switch (event->keyval) {
-    case GDK_KEY_space:
-	brighten_quickly (toddlerfun);
-	return TRUE;
+    ToddlerFun *toddlerfun = user_data;
 
-    case GDK_KEY_Escape:
-	gtk_main_quit();
-	return TRUE;
+    toddlerfun->theme_reload_id = 0;
 
-    case GDK_KEY_Up:
-	effect_up (toddlerfun);
-        break;
+    // Changes to a theme that is being switched away from don't matter
+    if (g_strcmp0 (get_latest_theme_file (toddlerfun),
+		   toddlerfun->theme_file) == 0)
+	start_theme_load (toddlerfun, toddlerfun->theme_file);
 
-    case GDK_KEY_Down:
-	effect_down (toddlerfun);
-        break;
+    return G_SOURCE_REMOVE;
+}
 
-    case GDK_KEY_Return:
-	save_picture (toddlerfun);
-	break;
+/*
+ * Something in the theme directory changed.  Editors tend to write a
+ * file in several steps, so wait for them to settle first.
+ */
+static void
+on_theme_changed (GFileMonitor *monitor,
+		  GFile *file,
+		  GFile *other_file,
+		  GFileMonitorEvent event_type,
+		  ToddlerFun *toddlerfun)
+{
+    if (event_type == G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED)
+	return;
 
-    default:
-	c = gdk_keyval_to_unicode (event->keyval);
-	if (c >= 0 && g_unichar_isgraph (c) && toddlerfun->has_previous) {
-	    gchar outbuf[7];
-	    gint bytes_written;
-	    bytes_written = g_unichar_to_utf8 (c, outbuf);
-	    outbuf[bytes_written] = '\0';
+    if (toddlerfun->theme_reload_id != 0)
+	g_source_remove (toddlerfun->theme_reload_id);
+    toddlerfun->theme_reload_id =
+	g_timeout_add (toddlerfun_theme_reload_delay,
+		       on_theme_reload_timeout, toddlerfun);
+}
 
-	    if (is_key_repeat) {
-		toddlerfun->letter_hue += 0.01;
-		if (toddlerfun->letter_hue >= 1.0) 
-		    toddlerfun->letter_hue -= 1.0;
-	    } else {
-		toddlerfun->letter_x = toddlerfun->previous_x;
-		toddlerfun->letter_y = toddlerfun->previous_y;
-		toddlerfun->letter_hue = g_random_double ();
-	    }
+static void
+watch_theme (ToddlerFun *toddlerfun)
+{
+    GFile *file, *dir;
+    GError *error = NULL;
 
-	    print_string (outbuf, toddlerfun);
-	}	
+    file = g_file_new_for_path (toddlerfun->theme_file);
+    dir = g_file_get_parent (file);
+    toddlerfun->theme_monitor = g_file_monitor_directory (dir,
+							  G_FILE_MONITOR_NONE,
+							  NULL, &error);
+    if (toddlerfun->theme_monitor != NULL) {
+	g_signal_connect (toddlerfun->theme_monitor, "changed",
+			  G_CALLBACK (on_theme_changed), toddlerfun);
+    } else {
+	g_printerr ("%s\n", error->message);
+	g_clear_error (&error);
     }
 
-    return FALSE;
+    g_object_unref (dir);
+    g_object_unref (file);
 }
 
-static gboolean
-on_key_release(GtkWidget *widget,
-	       GdkEventKey *event,
-	       ToddlerFun *toddlerfun)
-{
-    toddlerfun->last_keyval = GDK_KEY_VoidSymbol;
+//
+// Replaying a journal
+//
 
-    return FALSE;
-}
+static const gchar *journal_event_names[TODDLERFUN_JOURNAL_N_TYPES] = {
+    NULL, "configure", "motion", "frame", "button", "scroll",
+    "key-press", "key-release", "tick", "brighten"
+};
 
-static GtkWidget*
-create_window (ToddlerFun *toddlerfun, gboolean fullscreen)
+static void
+dispatch_journal_event (ToddlerFun *toddlerfun,
+			ToddlerFunJournalEvent *je)
 {
-    GtkWidget *window, *darea;
-
-    window = toddlerfun->window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
-    darea = toddlerfun->darea = gtk_drawing_area_new ();
-    gtk_container_add (GTK_CONTAINER (window), darea);
+    switch (je->type) {
+    case TODDLERFUN_JOURNAL_CONFIGURE:
+	resize_canvas (toddlerfun, je->a, je->b);
+	break;
 
-    gtk_window_set_title (GTK_WINDOW (window), "ToddlerFun");
-    if (fullscreen)
-	gtk_window_fullscreen (GTK_WINDOW (window));
-    else 
-	gtk_window_set_default_size (GTK_WINDOW (window), 1000, 800);
+    case TODDLERFUN_JOURNAL_MOTION: {
+	GdkEventMotion event = { 0 };
+	event.type = GDK_MOTION_NOTIFY;
+	event.x = je->a;
+	event.y = je->b;
+	on_motion_notify (NULL, &event, toddlerfun);
+	break;
+    }
 
-    g_signal_connect (window, "destroy", G_CALLBACK (gtk_main_quit), NULL);
-    g_signal_connect (darea, "draw", G_CALLBACK (on_draw), toddlerfun);
-    g_signal_connect (darea, "configure-event", 
-		      G_CALLBACK (on_configure), toddlerfun); 
-    g_signal_connect (darea, "motion-notify-event",
-		      G_CALLBACK (on_motion_notify), toddlerfun);
-    g_signal_connect (darea, "button-press-event", 
-		      G_CALLBACK (on_button_press), toddlerfun); 
-    g_signal_connect (darea, "scroll-event",
-		      G_CALLBACK (on_scroll), toddlerfun);
-    g_signal_connect (window, "key-press-event",
-		      G_CALLBACK (on_key_press), toddlerfun);
-    g_signal_connect (window, "key-release-event",
-		      G_CALLBACK (on_key_release), toddlerfun);
-    gtk_widget_set_events(darea,
-			  gtk_widget_get_events(window) | 
-			  GDK_BUTTON_PRESS_MASK |
-			  GDK_POINTER_MOTION_MASK |
-			  GDK_SCROLL_MASK);
+    case TODDLERFUN_JOURNAL_FRAME:
+	on_motion_frame (0, toddlerfun);
+	break;
 
-    g_timeout_add_seconds(2, on_tick, toddlerfun);
-		
-    return window;
-}
+    case TODDLERFUN_JOURNAL_BUTTON: {
+	GdkEventButton event = { 0 };
+	event.type = GDK_BUTTON_PRESS;
+	event.x = je->a;
+	event.y = je->b;
+	on_button_press (NULL, &event, toddlerfun);
+	break;
+    }
 
-static RsvgHandle *
-load_image (const gchar *file_name) 
-{
-    GError *error = NULL;
-    RsvgHandle *handle;
+    case TODDLERFUN_JOURNAL_SCROLL: {
+	GdkEventScroll event = { 0 };
+	event.type = GDK_SCROLL;
+	event.direction = je->detail;
+	on_scroll (NULL, &event, toddlerfun);
+	break;
+    }
 
-    handle = rsvg_handle_new_from_file (file_name, &error);
-    if (error != NULL) {
-	g_printerr (_("Can't load %s: %s\n"), file_name, error->message);
-	g_clear_error (&error);
-	return NULL;
+    case TODDLERFUN_JOURNAL_KEY_PRESS:
+    case TODDLERFUN_JOURNAL_KEY_RELEASE: {
+	GdkEventKey event = { 0 };
+	event.keyval = je->a;
+	event.state = je->detail;
+	if (je->type == TODDLERFUN_JOURNAL_KEY_PRESS) {
+	    event.type = GDK_KEY_PRESS;
+	    on_key_press (NULL, &event, toddlerfun);
+	} else {
+	    event.type = GDK_KEY_RELEASE;
+	    on_key_release (NULL, &event, toddlerfun);
+	}
+	break;
     }
 
-    return handle;
+    case TODDLERFUN_JOURNAL_TICK:
+	fade_step (toddlerfun);
+	break;
+
+    case TODDLERFUN_JOURNAL_BRIGHTEN:
+	brighten_step (toddlerfun);
+	break;
+    }
 }
 
+/*
+ * Feed all events of JOURNAL through the event handlers as fast as
+ * possible, drawing to the canvas without any window, and print how
+ * long it took.
+ */
 static void
-load_theme (ToddlerFun *toddlerfun)
+replay_journal (ToddlerFun *toddlerfun, ToddlerFunJournal *journal)
 {
-    toddlerfun->theme = theme_new ();
-    theme_read (toddlerfun->theme, DATADIR "/defaulttheme/theme.xml");
-    if (toddlerfun->theme->parsed_ok) {
-	gint i;
-	gint len = theme_get_n_objects (toddlerfun->theme);
-	for (i = 0; i < len; i++) {
-	    ToddlerFunThemeObject *obj = theme_get_object (toddlerfun->theme, i);
-	    if (obj->image_file != NULL) {
-		obj->image_handle = load_image (obj->image_file);
-	    }
-	}
+    ToddlerFunJournalEvent je;
+    guint counts[TODDLERFUN_JOURNAL_N_TYPES] = { 0 };
+    gint64 costs[TODDLERFUN_JOURNAL_N_TYPES] = { 0 };
+    gint64 start, before, after;
+    guint n_events = 0;
+    gint i;
+
+    // Events before the first configure still need somewhere to draw
+    resize_canvas (toddlerfun, 1000, 800);
+
+    start = g_get_monotonic_time ();
+    while (journal_read (journal, &je)) {
+	if (je.type == 0 || je.type >= TODDLERFUN_JOURNAL_N_TYPES)
+	    continue;
+
+	before = g_get_monotonic_time ();
+	dispatch_journal_event (toddlerfun, &je);
+	after = g_get_monotonic_time ();
+
+	counts[je.type]++;
+	costs[je.type] += after - before;
+	n_events++;
+    }
+    drain_motion (toddlerfun);
+    canvas_materialize_all (toddlerfun->canvas);
+
+    g_print (_("Replayed %u events in %.3f s\n"), n_events,
+	     (g_get_monotonic_time () - start) / 1e6);
+    for (i = 1; i < TODDLERFUN_JOURNAL_N_TYPES; i++) {
+	if (counts[i] == 0)
+	    continue;
+	g_print ("  %-12s %8u %12.1f us/event\n", journal_event_names[i],
+		 counts[i], (gdouble) costs[i] / counts[i]);
     }
 }
 
@@ -828,6 +3006,8 @@ translate_messages (void)
 }
 #endif
 
+#ifndef TODDLERFUN_NO_MAIN
+
 int
 main (int argc, char *argv[])
 {
@@ -838,6 +3018,27 @@ main (int argc, char *argv[])
     gboolean no_fullscreen = FALSE;
     gboolean no_music = FALSE;
     gboolean no_sound_fx = FALSE;
+    gboolean no_motion_sound = FALSE;
+    gboolean no_batch_strokes = FALSE;
+    gboolean no_native_surface = FALSE;
+    gchar *brush_name = NULL;
+    gint render_threads = 0;
+    gint load_threads = g_get_num_processors ();
+    gboolean startup_time = FALSE;
+    gint64 start_time = g_get_monotonic_time ();
+    gint png_compression = 6;
+    gchar *save_format = NULL;
+    gdouble save_scale = 1.0;
+    gchar *record_file = NULL;
+    gchar *replay_file = NULL;
+    ToddlerFunJournal *replay = NULL;
+    gchar *theme_id = NULL;
+    gboolean list_themes = FALSE;
+    gboolean perf_hud = FALSE;
+    gchar *perf_stats_file = NULL;
+    gchar *trace_file = NULL;
+    const gchar *theme_file = toddlerfun_default_theme_file;
+    guint32 seed;
 
     GOptionEntry options [] =
 	{
@@ -847,6 +3048,53 @@ main (int argc, char *argv[])
 	      N_("Don't play music"), NULL },
 	    { "no-sound-fx", 'S', 0, G_OPTION_ARG_NONE, &no_sound_fx,
 	      N_("Don't play sound effects"), NULL },
+	    { "no-motion-sound", 0, 0, G_OPTION_ARG_NONE, &no_motion_sound,
+	      N_("Don't play a tone while drawing"), NULL },
+	    { "no-batch-strokes", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE,
+	      &no_batch_strokes,
+	      N_("Stroke each mirrored copy of a line separately"), NULL },
+	    { "no-native-surface", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE,
+	      &no_native_surface,
+	      N_("Draw on a plain image rather than one the display can show as is"),
+	      NULL },
+	    { "brush", 0, 0, G_OPTION_ARG_STRING, &brush_name,
+	      N_("Draw lines with a round, airbrush or stamp brush instead of cairo's stroker"),
+	      N_("BRUSH") },
+	    { "render-threads", 0, 0, G_OPTION_ARG_INT, &render_threads,
+	      N_("Draw mirror effects using N threads (0 to draw everything on the main thread)"),
+	      N_("N") },
+	    { "load-threads", 0, 0, G_OPTION_ARG_INT, &load_threads,
+	      N_("Load the theme using N threads (0 to load it before showing the window)"),
+	      N_("N") },
+	    { "startup-time", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE,
+	      &startup_time,
+	      N_("Report how long it takes to start"), NULL },
+	    { "png-compression", 0, 0, G_OPTION_ARG_INT, &png_compression,
+	      N_("Compression level of saved pictures, from 0 (fastest) to 9 (smallest)"),
+	      N_("LEVEL") },
+	    { "save-format", 0, 0, G_OPTION_ARG_STRING, &save_format,
+	      N_("Save pictures as png, svg or pdf"), N_("FORMAT") },
+	    { "save-scale", 0, 0, G_OPTION_ARG_DOUBLE, &save_scale,
+	      N_("Save pictures at FACTOR times the screen size"),
+	      N_("FACTOR") },
+	    { "record", 0, 0, G_OPTION_ARG_FILENAME, &record_file,
+	      N_("Record all input to FILE"), N_("FILE") },
+	    { "replay", 0, 0, G_OPTION_ARG_FILENAME, &replay_file,
+	      N_("Replay input recorded in FILE without a window, and report the time taken"),
+	      N_("FILE") },
+	    { "theme", 't', 0, G_OPTION_ARG_STRING, &theme_id,
+	      N_("Use the theme NAME"), N_("NAME") },
+	    { "list-themes", 0, 0, G_OPTION_ARG_NONE, &list_themes,
+	      N_("List the installed themes and exit"), NULL },
+	    { "perf-hud", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE,
+	      &perf_hud,
+	      N_("Show performance counters (toggled with Control-Alt-P)"),
+	      NULL },
+	    { "perf-stats", 0, 0, G_OPTION_ARG_FILENAME, &perf_stats_file,
+	      N_("Write performance counters to FILE on exit"), N_("FILE") },
+	    { "trace", 0, 0, G_OPTION_ARG_FILENAME, &trace_file,
+	      N_("Write a timeline of the event handlers to FILE, for chrome://tracing or Perfetto"),
+	      N_("FILE") },
 	    { NULL }
 	};
 
@@ -861,6 +3109,11 @@ main (int argc, char *argv[])
 #endif
 
     toddlerfun = g_new0(ToddlerFun, 1);
+    toddlerfun->motion_points = g_array_new (FALSE, FALSE,
+					     sizeof (ToddlerFunPoint));
+    toddlerfun->display_list = display_list_new ();
+    toddlerfun->glyphs = glyph_cache_new (toddlerfun_letter_font,
+					  toddlerfun_max_glyphs);
 
     g_set_prgname("toddlerfun");
     g_set_application_name(_("Toddler Fun"));
@@ -870,32 +3123,163 @@ main (int argc, char *argv[])
 				 _("A drawing toy for toddlers."));
     g_option_context_add_main_entries(option_context, options, 
                                       GETTEXT_PACKAGE);
-    g_option_context_add_group (option_context, gtk_get_option_group (TRUE));
+    // The display is opened by gtk_init, which --replay does not need
+    g_option_context_add_group (option_context, gtk_get_option_group (FALSE));
 
     if (!g_option_context_parse (option_context, &argc, &argv, &error)) {
 	g_print (_("option parsing failed: %s\n"), error->message);
 	return (1);
     }
 
-    gtk_init (&argc, &argv);
+    toddlerfun->catalog = catalog_new ();
+    if (list_themes) {
+	guint i;
+
+	for (i = 0; i < toddlerfun->catalog->entries->len; i++) {
+	    ToddlerFunCatalogEntry *entry;
+
+	    entry = g_ptr_array_index (toddlerfun->catalog->entries, i);
+	    g_print ("%-16s %s\n", entry->id, entry->name);
+	}
+	return 0;
+    }
+
+    if (theme_id != NULL) {
+	ToddlerFunCatalogEntry *entry;
+
+	entry = catalog_find (toddlerfun->catalog, theme_id);
+	if (entry == NULL) {
+	    g_printerr (_("Unknown theme '%s'\n"), theme_id);
+	    return 1;
+	}
+	theme_file = entry->filename;
+    }
+
+    if (replay_file != NULL) {
+	replay = journal_open (replay_file, &error);
+	if (replay == NULL) {
+	    g_printerr ("%s\n", error->message);
+	    return 1;
+	}
+	seed = replay->seed;
+	no_music = no_sound_fx = TRUE;
+    } else {
+	gtk_init (&argc, &argv);
+	seed = g_random_int ();
+    }
     gst_init (&argc, &argv);
 
-    load_theme (toddlerfun);
+    toddlerfun->rand = g_rand_new_with_seed (seed);
+    if (trace_file != NULL) {
+	toddlerfun->trace = trace_new (trace_file, &error);
+	if (toddlerfun->trace == NULL) {
+	    g_printerr ("%s\n", error->message);
+	    return 1;
+	}
+    }
+    if (record_file != NULL && replay == NULL) {
+	toddlerfun->journal = journal_create (record_file, seed, &error);
+	if (toddlerfun->journal == NULL) {
+	    g_printerr ("%s\n", error->message);
+	    return 1;
+	}
+    }
+
+    // Sound effects are decoded along with the theme
+    if (!no_sound_fx)
+	toddlerfun->mixer = sound_mixer_new ();
+    if (toddlerfun->mixer != NULL && !no_motion_sound) {
+	toddlerfun->synth = synth_new ();
+	sound_mixer_set_synth (toddlerfun->mixer, toddlerfun->synth);
+    }
+
+    // Journals assume that every object can be clicked from the start
+    toddlerfun->start_time = start_time;
+    toddlerfun->report_startup = startup_time;
+    if (replay != NULL || toddlerfun->journal != NULL)
+	load_threads = 0;
+    load_theme (toddlerfun, theme_file, load_threads);
 
-    if (!no_music && toddlerfun->theme->background_sound_file != NULL)
-	play_sound (toddlerfun->theme->background_sound_file, TRUE);
+    toddlerfun->play_music = !no_music;
+    if (toddlerfun->play_music)
+	start_music (toddlerfun);
 
     toddlerfun->play_sound_fx = !no_sound_fx;
+    toddlerfun->batch_strokes = !no_batch_strokes;
+    toddlerfun->native_surface = !no_native_surface;
+    if (brush_name != NULL) {
+	if (!brush_type_from_name (brush_name, &toddlerfun->brush)) {
+	    g_printerr (_("Unknown brush '%s'\n"), brush_name);
+	    return 1;
+	}
+	toddlerfun->use_brush = TRUE;
+    }
+    if (render_threads > 0)
+	toddlerfun->render_pool = render_pool_new (render_threads);
+    toddlerfun->saver = saver_new (png_compression, 2,
+				   on_picture_saved, toddlerfun);
+
+    if (save_format == NULL)
+	save_format = g_strdup ("png");
+    if (g_strcmp0 (save_format, "png") != 0 &&
+	g_strcmp0 (save_format, "svg") != 0 &&
+	g_strcmp0 (save_format, "pdf") != 0) {
+	g_printerr (_("Unknown picture format '%s'\n"), save_format);
+	return 1;
+    }
+    toddlerfun->save_format = save_format;
+    toddlerfun->save_scale = save_scale > 0 ? save_scale : 1.0;
 
+    render_messages (toddlerfun);
     toddlerfun->message_num = -1;
-    update_message (toddlerfun);
-    toddlerfun->message_alpha = 0.8;
+    update_message (toddlerfun, g_get_monotonic_time ());
     toddlerfun->has_message = TRUE;
 
+    if (replay != NULL) {
+	replay_journal (toddlerfun, replay);
+	journal_close (replay);
+	saver_free (toddlerfun->saver);
+	if (perf_stats_file != NULL)
+	    save_perf_stats (toddlerfun, perf_stats_file);
+	if (toddlerfun->trace != NULL)
+	    trace_free (toddlerfun->trace);
+	return 0;
+    }
+
     window = create_window (toddlerfun, !no_fullscreen);
+    toddlerfun->animator->trace = toddlerfun->trace;
     gtk_widget_show_all (window);
+    start_message_fade (toddlerfun);
+    if (perf_hud)
+	toggle_perf_hud (toddlerfun);
+
+    // A recorded session must be played back with the same theme
+    if (toddlerfun->journal == NULL)
+	watch_theme (toddlerfun);
 
     gtk_main ();
 
+    // While every pipeline is still counted
+    if (perf_stats_file != NULL)
+	save_perf_stats (toddlerfun, perf_stats_file);
+
+    if (toddlerfun->journal != NULL)
+	journal_close (toddlerfun->journal);
+    if (toddlerfun->trace != NULL)
+	trace_free (toddlerfun->trace);
+
+    // Don't lose a picture that is still being saved
+    saver_free (toddlerfun->saver);
+
+    // The mixer uses the synth until its pipeline is stopped
+    if (toddlerfun->mixer != NULL)
+	sound_mixer_free (toddlerfun->mixer);
+    if (toddlerfun->synth != NULL)
+	synth_free (toddlerfun->synth);
+    if (toddlerfun->music != NULL)
+	music_free (toddlerfun->music);
+
     return 0;
 }
+
+#endif /* TODDLERFUN_NO_MAIN */
@@ -0,0 +1,278 @@
+/*
+ * music.c
+ * Looping background music and playlists
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ * A single track is looped with segment seeks: when playback reaches
+ * the end of the segment, a non-flushing seek back to the start is
+ * queued in the same pipeline, so there is no gap and nothing is torn
+ * down.
+ *
+ * A playlist uses two playbins, or decks.  Shortly before the current
+ * track ends, the next one is prerolled on the other deck, and then
+ * faded in while the current one fades out.  The decks are reused for
+ * every track, so a session of any length keeps just two pipelines.
+ */
+
+#include <config.h>
+#include <glib.h>
+#include <glib/gi18n.h>
+#include <gst/gst.h>
+#include "music.h"
+
+// How often to check the position of the playing track, in ms
+static const guint music_poll_interval = 250;
+static const guint music_fade_interval = 40;
+
+// How long before a crossfade the next track is prerolled, in seconds
+static const gdouble music_preroll_time = 2;
+
+static void music_schedule_poll (ToddlerFunMusic *music, guint interval);
+
+static void
+deck_load (ToddlerFunMusicDeck *deck, const gchar *filename,
+	   GstState state)
+{
+    GError *error = NULL;
+    gchar *uri;
+
+    uri = gst_filename_to_uri (filename, &error);
+    if (uri == NULL) {
+	g_printerr ("%s\n", error->message);
+	g_clear_error (&error);
+	return;
+    }
+
+    gst_element_set_state (deck->playbin, GST_STATE_READY);
+    g_object_set (deck->playbin, "uri", uri, NULL);
+    deck->started = FALSE;
+    gst_element_set_state (deck->playbin, state);
+
+    g_free (uri);
+}
+
+static void
+deck_seek_to_start (ToddlerFunMusicDeck *deck, GstSeekFlags flags)
+{
+    gst_element_seek (deck->playbin, 1.0, GST_FORMAT_TIME,
+		      flags | GST_SEEK_FLAG_SEGMENT,
+		      GST_SEEK_TYPE_SET, 0,
+		      GST_SEEK_TYPE_NONE, GST_CLOCK_TIME_NONE);
+}
+
+/*
+ * Switch to the other deck once it has faded in, and stop the old one.
+ * READY releases its decoder but keeps the pipeline for the next track.
+ */
+static void
+music_finish_fade (ToddlerFunMusic *music)
+{
+    ToddlerFunMusicDeck *old = &music->decks[music->current];
+
+    gst_element_set_state (old->playbin, GST_STATE_READY);
+
+    music->current = 1 - music->current;
+    music->track_num = (music->track_num + 1) % music->n_tracks;
+    g_object_set (music->decks[music->current].playbin, "volume", 1.0, NULL);
+
+    music->fading = FALSE;
+    music->next_loaded = FALSE;
+}
+
+static void
+music_load_next (ToddlerFunMusic *music)
+{
+    ToddlerFunMusicDeck *next = &music->decks[1 - music->current];
+    gint next_num = (music->track_num + 1) % music->n_tracks;
+
+    // Prerolled silently, so that it can start right away
+    g_object_set (next->playbin, "volume", 0.0, NULL);
+    deck_load (next, music->tracks[next_num], GST_STATE_PAUSED);
+    music->next_loaded = TRUE;
+}
+
+static void
+music_start_fade (ToddlerFunMusic *music)
+{
+    if (!music->next_loaded)
+	music_load_next (music);
+
+    gst_element_set_state (music->decks[1 - music->current].playbin,
+			   GST_STATE_PLAYING);
+    music->fading = TRUE;
+    music->fade_start = g_get_monotonic_time ();
+    music_schedule_poll (music, music_fade_interval);
+}
+
+static gboolean
+on_music_poll (gpointer user_data)
+{
+    ToddlerFunMusic *music = user_data;
+    ToddlerFunMusicDeck *deck = &music->decks[music->current];
+    GstFormat format = GST_FORMAT_TIME;
+    gint64 position, duration;
+    gdouble remaining;
+
+    if (music->fading) {
+	gdouble t = (g_get_monotonic_time () - music->fade_start) /
+	    (music->crossfade * G_USEC_PER_SEC);
+
+	if (t >= 1) {
+	    music->poll_id = 0;
+	    music_finish_fade (music);
+	    music_schedule_poll (music, music_poll_interval);
+	    return G_SOURCE_REMOVE;
+	}
+
+	g_object_set (deck->playbin, "volume", 1 - t, NULL);
+	g_object_set (music->decks[1 - music->current].playbin,
+		      "volume", t, NULL);
+	return G_SOURCE_CONTINUE;
+    }
+
+    if (!gst_element_query_position (deck->playbin, &format, &position) ||
+	!gst_element_query_duration (deck->playbin, &format, &duration) ||
+	duration <= 0)
+	return G_SOURCE_CONTINUE;
+
+    remaining = (gdouble) (duration - position) / GST_SECOND;
+
+    if (!music->next_loaded &&
+	remaining <= music->crossfade + music_preroll_time)
+	music_load_next (music);
+
+    if (remaining <= music->crossfade) {
+	music->poll_id = 0;
+	music_start_fade (music);
+	return G_SOURCE_REMOVE;
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void
+music_schedule_poll (ToddlerFunMusic *music, guint interval)
+{
+    if (music->poll_id != 0)
+	g_source_remove (music->poll_id);
+    music->poll_id = g_timeout_add (interval, on_music_poll, music);
+}
+
+static gboolean
+on_music_bus_message (GstBus *bus, GstMessage *message, gpointer user_data)
+{
+    ToddlerFunMusicDeck *deck = user_data;
+    ToddlerFunMusic *music = deck->music;
+    GError *error = NULL;
+
+    switch (GST_MESSAGE_TYPE (message)) {
+    case GST_MESSAGE_ASYNC_DONE:
+	// Prerolled; a looping track starts with a flushing segment seek
+	if (deck->loop && !deck->started) {
+	    deck->started = TRUE;
+	    deck_seek_to_start (deck, GST_SEEK_FLAG_FLUSH);
+	    gst_element_set_state (deck->playbin, GST_STATE_PLAYING);
+	}
+	break;
+
+    case GST_MESSAGE_SEGMENT_DONE:
+	// Queue the next round; what is already decoded keeps playing
+	deck_seek_to_start (deck, 0);
+	break;
+
+    case GST_MESSAGE_EOS:
+	// A track too short for the crossfade, or of unknown length
+	if (!deck->loop && deck == &music->decks[music->current] &&
+	    !music->fading) {
+	    music_start_fade (music);
+	}
+	break;
+
+    case GST_MESSAGE_ERROR:
+	gst_message_parse_error (message, &error, NULL);
+	g_printerr ("%s\n", error->message);
+	g_clear_error (&error);
+	gst_element_set_state (deck->playbin, GST_STATE_NULL);
+	break;
+
+    default:
+	break;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Start playing the N_TRACKS files in TRACKS, in order and over again.
+ * A single track is looped without gaps; with several, each one fades
+ * into the next over CROSSFADE seconds.
+ */
+ToddlerFunMusic *
+music_new (gchar **tracks, gint n_tracks, gdouble crossfade)
+{
+    ToddlerFunMusic *music;
+    gint i;
+
+    if (n_tracks < 1)
+	return NULL;
+
+    music = g_new0 (ToddlerFunMusic, 1);
+    music->tracks = g_new0 (gchar *, n_tracks + 1);
+    for (i = 0; i < n_tracks; i++)
+	music->tracks[i] = g_strdup (tracks[i]);
+    music->n_tracks = n_tracks;
+    music->crossfade = MAX (crossfade, 0.1);
+
+    for (i = 0; i < 2; i++) {
+	ToddlerFunMusicDeck *deck = &music->decks[i];
+	GstBus *bus;
+
+	deck->music = music;
+	deck->loop = n_tracks == 1;
+	deck->playbin = gst_element_factory_make ("playbin", NULL);
+	if (deck->playbin == NULL) {
+	    g_printerr (_("Can't create a pipeline for music\n"));
+	    music_free (music);
+	    return NULL;
+	}
+
+	bus = gst_pipeline_get_bus (GST_PIPELINE (deck->playbin));
+	deck->bus_watch_id = gst_bus_add_watch (bus, on_music_bus_message,
+						deck);
+	gst_object_unref (bus);
+
+	// One deck is enough for looping
+	if (deck->loop)
+	    break;
+    }
+
+    if (n_tracks == 1) {
+	deck_load (&music->decks[0], music->tracks[0], GST_STATE_PAUSED);
+    } else {
+	deck_load (&music->decks[0], music->tracks[0], GST_STATE_PLAYING);
+	music_schedule_poll (music, music_poll_interval);
+    }
+
+    return music;
+}
+
+void
+music_free (ToddlerFunMusic *music)
+{
+    gint i;
+
+    if (music->poll_id != 0)
+	g_source_remove (music->poll_id);
+
+    for (i = 0; i < 2; i++) {
+	ToddlerFunMusicDeck *deck = &music->decks[i];
+	if (deck->playbin == NULL)
+	    continue;
+	g_source_remove (deck->bus_watch_id);
+	gst_element_set_state (deck->playbin, GST_STATE_NULL);
+	gst_object_unref (deck->playbin);
+    }
+
+    g_strfreev (music->tracks);
+    g_free (music);
+}
@@ -0,0 +1,36 @@
+/*
+ * music.h
+ * Looping background music and playlists
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ */
+
+typedef struct _ToddlerFunMusic ToddlerFunMusic;
+
+typedef struct {
+    ToddlerFunMusic *music;
+    GstElement *playbin;
+    guint bus_watch_id;
+    gboolean loop;
+    gboolean started;
+} ToddlerFunMusicDeck;
+
+struct _ToddlerFunMusic {
+    ToddlerFunMusicDeck decks[2];
+    gint current;
+
+    gchar **tracks;
+    gint n_tracks;
+    gint track_num;
+    gdouble crossfade;
+
+    // Playlist state
+    guint poll_id;
+    gboolean next_loaded;
+    gboolean fading;
+    gint64 fade_start;
+};
+
+ToddlerFunMusic *music_new (gchar **tracks, gint n_tracks,
+			    gdouble crossfade);
+void music_free (ToddlerFunMusic *music);
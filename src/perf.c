@@ -0,0 +1,199 @@
+/*
+ * perf.c
+ * Performance counters
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ * Counts what it costs to keep the picture moving: how far apart the
+ * frames are, how long input takes to show up, and how much work each
+ * frame does.  Adding a sample is a store and an add, so the counters
+ * are always on; percentiles are only worked out from the last
+ * PERF_SERIES_LEN samples when someone asks, for the HUD or the stats
+ * file.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include "perf.h"
+
+// Longer gaps between frames mean nothing was drawn, not a slow frame
+static const gint64 perf_max_frame_time = G_USEC_PER_SEC / 4;
+
+static const gchar *perf_draw_names[PERF_N_DRAWS] = {
+    "lines", "images", "letters"
+};
+
+static gint
+compare_values (gconstpointer a, gconstpointer b)
+{
+    gint64 x = *(const gint64 *) a, y = *(const gint64 *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+void
+perf_series_add (ToddlerFunPerfSeries *series, gint64 value)
+{
+    series->values[series->count % PERF_SERIES_LEN] = value;
+    series->count++;
+    series->sum += value;
+    series->max = MAX (series->max, value);
+}
+
+/*
+ * The PERCENT percentile of the recent samples, or 0 if there are none
+ */
+gint64
+perf_series_percentile (ToddlerFunPerfSeries *series, gint percent)
+{
+    gint64 sorted[PERF_SERIES_LEN];
+    gint n;
+
+    n = MIN (series->count, PERF_SERIES_LEN);
+    if (n == 0)
+	return 0;
+
+    memcpy (sorted, series->values, n * sizeof (gint64));
+    qsort (sorted, n, sizeof (gint64), compare_values);
+
+    return sorted[(n - 1) * percent / 100];
+}
+
+/*
+ * The mean of every sample ever added
+ */
+gdouble
+perf_series_mean (ToddlerFunPerfSeries *series)
+{
+    if (series->count == 0)
+	return 0;
+    return (gdouble) series->sum / series->count;
+}
+
+/*
+ * Input arrived that will be drawn in a coming frame
+ */
+void
+perf_input (ToddlerFunPerf *perf)
+{
+    if (perf->input_time == 0)
+	perf->input_time = g_get_monotonic_time ();
+}
+
+/*
+ * A frame was drawn at NOW, repainting DIRTY_AREA pixels
+ */
+void
+perf_frame (ToddlerFunPerf *perf, gint64 now, gint64 dirty_area)
+{
+    if (perf->last_frame != 0 && now - perf->last_frame < perf_max_frame_time)
+	perf_series_add (&perf->frame_time, now - perf->last_frame);
+    perf->last_frame = now;
+
+    if (perf->input_time != 0) {
+	perf_series_add (&perf->latency, now - perf->input_time);
+	perf->input_time = 0;
+    }
+
+    perf_series_add (&perf->dirty_area, dirty_area);
+}
+
+static void
+format_times (GString *s, const gchar *name, ToddlerFunPerfSeries *series)
+{
+    g_string_append_printf (s, "%-10s %6.2f %6.2f %6.2f ms\n", name,
+			    perf_series_percentile (series, 50) / 1000.0,
+			    perf_series_percentile (series, 95) / 1000.0,
+			    perf_series_percentile (series, 99) / 1000.0);
+}
+
+/*
+ * The counters as lines of text for the HUD, with N_PIPELINES audio
+ * pipelines running
+ */
+gchar *
+perf_format (ToddlerFunPerf *perf, gint n_pipelines)
+{
+    GString *s = g_string_new (NULL);
+    gint i;
+
+    g_string_append (s, "              p50    p95    p99\n");
+    format_times (s, "frame", &perf->frame_time);
+    format_times (s, "latency", &perf->latency);
+    for (i = 0; i < PERF_N_DRAWS; i++)
+	format_times (s, perf_draw_names[i], &perf->draw_time[i]);
+    format_times (s, "fade", &perf->fade_time);
+    format_times (s, "blit", &perf->blit_time);
+    g_string_append_printf (s, "motion     %6.1f events/frame\n",
+			    perf_series_mean (&perf->motion_events));
+    g_string_append_printf (s, "dirty      %6.0f kpixels/frame\n",
+			    perf_series_percentile (&perf->dirty_area, 50) /
+			    1000.0);
+    g_string_append_printf (s, "audio      %6d pipelines", n_pipelines);
+
+    return g_string_free (s, FALSE);
+}
+
+static void
+append_json_number (GString *s, gdouble value)
+{
+    gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+    g_string_append (s, g_ascii_formatd (buf, sizeof (buf), "%.3f", value));
+}
+
+/*
+ * Append SERIES as a JSON member, in units of SCALE
+ */
+static void
+append_json_series (GString *s, const gchar *name,
+		    ToddlerFunPerfSeries *series, gdouble scale)
+{
+    static const gint percents[] = { 50, 95, 99 };
+    gint i;
+
+    g_string_append_printf (s, "  \"%s\": {\"count\": %" G_GINT64_FORMAT
+			    ", \"mean\": ", name, series->count);
+    append_json_number (s, perf_series_mean (series) / scale);
+    for (i = 0; i < G_N_ELEMENTS (percents); i++) {
+	g_string_append_printf (s, ", \"p%d\": ", percents[i]);
+	append_json_number (s, perf_series_percentile (series, percents[i]) /
+			    scale);
+    }
+    g_string_append (s, ", \"max\": ");
+    append_json_number (s, series->max / scale);
+    g_string_append (s, "},\n");
+}
+
+/*
+ * Write the counters to FILENAME as a JSON object, times in
+ * milliseconds
+ */
+gboolean
+perf_write (ToddlerFunPerf *perf, gint n_pipelines,
+	    const gchar *filename, GError **error)
+{
+    GString *s = g_string_new ("{\n");
+    gchar *name;
+    gboolean ok;
+    gint i;
+
+    append_json_series (s, "frame_ms", &perf->frame_time, 1000);
+    append_json_series (s, "latency_ms", &perf->latency, 1000);
+    for (i = 0; i < PERF_N_DRAWS; i++) {
+	name = g_strdup_printf ("draw_%s_ms", perf_draw_names[i]);
+	append_json_series (s, name, &perf->draw_time[i], 1000);
+	g_free (name);
+    }
+    append_json_series (s, "fade_ms", &perf->fade_time, 1000);
+    append_json_series (s, "blit_ms", &perf->blit_time, 1000);
+    append_json_series (s, "motion_events", &perf->motion_events, 1);
+    append_json_series (s, "dirty_pixels", &perf->dirty_area, 1);
+    g_string_append_printf (s, "  \"audio_pipelines\": %d\n}\n", n_pipelines);
+
+    ok = g_file_set_contents (filename, s->str, s->len, error);
+    g_string_free (s, TRUE);
+
+    return ok;
+}
@@ -0,0 +1,49 @@
+/*
+ * perf.h
+ * Performance counters
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ */
+
+// Number of recent samples kept for the percentiles
+#define PERF_SERIES_LEN 256
+
+typedef enum {
+    PERF_DRAW_LINES,
+    PERF_DRAW_IMAGES,
+    PERF_DRAW_LETTERS,
+    PERF_N_DRAWS
+} ToddlerFunPerfDraw;
+
+typedef struct {
+    gint64 values[PERF_SERIES_LEN];
+    gint64 count;		// samples ever added
+    gint64 sum;
+    gint64 max;
+} ToddlerFunPerfSeries;
+
+/*
+ * All zero is a valid, empty set of counters
+ */
+typedef struct {
+    ToddlerFunPerfSeries frame_time;	// usec between frames
+    ToddlerFunPerfSeries latency;	// usec from input to the frame showing it
+    ToddlerFunPerfSeries motion_events;	// per drained frame
+    ToddlerFunPerfSeries dirty_area;	// pixels per frame
+    ToddlerFunPerfSeries draw_time[PERF_N_DRAWS];
+    ToddlerFunPerfSeries fade_time;	// usec applying fades per frame
+    ToddlerFunPerfSeries blit_time;	// usec painting the canvas per frame
+
+    gint64 last_frame;
+    gint64 input_time;		// earliest input not yet drawn
+} ToddlerFunPerf;
+
+void perf_series_add (ToddlerFunPerfSeries *series, gint64 value);
+gint64 perf_series_percentile (ToddlerFunPerfSeries *series, gint percent);
+gdouble perf_series_mean (ToddlerFunPerfSeries *series);
+
+void perf_input (ToddlerFunPerf *perf);
+void perf_frame (ToddlerFunPerf *perf, gint64 now, gint64 dirty_area);
+gchar *perf_format (ToddlerFunPerf *perf, gint n_pipelines);
+gboolean perf_write (ToddlerFunPerf *perf, gint n_pipelines,
+		     const gchar *filename, GError **error);
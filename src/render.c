@@ -0,0 +1,158 @@
+/*
+ * render.c
+ * Drawing to the canvas from several threads at once
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ * The canvas is split into horizontal bands, one per thread.  Each
+ * thread gets its own cairo image surface pointing into its rows of the
+ * canvas data, and runs the same drawing function on it, so every pixel
+ * is drawn by exactly one thread, in the same order as a single thread
+ * would.  The result does not depend on the number of threads or on how
+ * they are scheduled.
+ */
+
+#include <config.h>
+#include <glib.h>
+#include <cairo.h>
+#include "render.h"
+
+typedef struct {
+    ToddlerFunRenderPool *pool;
+    cairo_surface_t *surface;
+    gint y;
+    gint height;
+    ToddlerFunRenderFunc func;
+    gpointer user_data;
+} RenderBand;
+
+static cairo_user_data_key_t render_band_key;
+
+static void
+render_band (gpointer data, gpointer user_data)
+{
+    RenderBand *band = data;
+    ToddlerFunRenderPool *pool = band->pool;
+    cairo_surface_t *surface;
+    cairo_t *cr;
+    gint stride;
+
+    stride = cairo_image_surface_get_stride (band->surface);
+    surface = cairo_image_surface_create_for_data (
+	cairo_image_surface_get_data (band->surface) + band->y * stride,
+	cairo_image_surface_get_format (band->surface),
+	cairo_image_surface_get_width (band->surface),
+	band->height, stride);
+    cairo_surface_set_user_data (surface, &render_band_key, band, NULL);
+
+    // Keep using canvas coordinates
+    cr = cairo_create (surface);
+    cairo_translate (cr, 0, -band->y);
+    (*band->func) (cr, band->user_data);
+    cairo_destroy (cr);
+
+    cairo_surface_finish (surface);
+    cairo_surface_destroy (surface);
+
+    g_mutex_lock (&pool->mutex);
+    if (--pool->pending == 0)
+	g_cond_signal (&pool->done);
+    g_mutex_unlock (&pool->mutex);
+}
+
+ToddlerFunRenderPool *
+render_pool_new (gint n_threads)
+{
+    ToddlerFunRenderPool *pool;
+    GError *error = NULL;
+
+    pool = g_new0 (ToddlerFunRenderPool, 1);
+    pool->n_threads = n_threads;
+    g_mutex_init (&pool->mutex);
+    g_cond_init (&pool->done);
+
+    pool->threads = g_thread_pool_new (render_band, pool, n_threads,
+				       TRUE, &error);
+    if (error != NULL) {
+	g_printerr ("%s\n", error->message);
+	g_clear_error (&error);
+	render_pool_free (pool);
+	return NULL;
+    }
+
+    return pool;
+}
+
+void
+render_pool_free (ToddlerFunRenderPool *pool)
+{
+    if (pool->threads != NULL)
+	g_thread_pool_free (pool->threads, FALSE, TRUE);
+    g_mutex_clear (&pool->mutex);
+    g_cond_clear (&pool->done);
+    g_free (pool);
+}
+
+/*
+ * Run FUNC once for each band of SURFACE and wait for all of them to
+ * finish.  Band boundaries are multiples of BAND_ALIGNMENT rows, so
+ * that per-tile state of the canvas is only ever touched by one thread.
+ * FUNC gets a cairo context using the coordinates of the whole surface.
+ */
+void
+render_pool_run (ToddlerFunRenderPool *pool,
+		 cairo_surface_t *surface,
+		 gint band_alignment,
+		 ToddlerFunRenderFunc func,
+		 gpointer user_data)
+{
+    RenderBand *bands;
+    gint height, band_height, n_bands, i;
+
+    height = cairo_image_surface_get_height (surface);
+    band_height = (height + pool->n_threads - 1) / pool->n_threads;
+    band_height = ((band_height + band_alignment - 1) / band_alignment) *
+	band_alignment;
+    n_bands = (height + band_height - 1) / band_height;
+
+    cairo_surface_flush (surface);
+
+    bands = g_new0 (RenderBand, n_bands);
+    pool->pending = n_bands;
+    for (i = 0; i < n_bands; i++) {
+	bands[i].pool = pool;
+	bands[i].surface = surface;
+	bands[i].y = i * band_height;
+	bands[i].height = MIN (band_height, height - bands[i].y);
+	bands[i].func = func;
+	bands[i].user_data = user_data;
+	g_thread_pool_push (pool->threads, &bands[i], NULL);
+    }
+
+    g_mutex_lock (&pool->mutex);
+    while (pool->pending > 0)
+	g_cond_wait (&pool->done, &pool->mutex);
+    g_mutex_unlock (&pool->mutex);
+
+    g_free (bands);
+
+    cairo_surface_mark_dirty (surface);
+}
+
+/*
+ * If CR draws to one band of a surface in render_pool_run, get the
+ * rows of the band and return TRUE.
+ */
+gboolean
+render_get_band (cairo_t *cr, gint *y, gint *height)
+{
+    RenderBand *band;
+
+    band = cairo_surface_get_user_data (cairo_get_target (cr),
+					&render_band_key);
+    if (band == NULL)
+	return FALSE;
+
+    *y = band->y;
+    *height = band->height;
+    return TRUE;
+}
@@ -0,0 +1,27 @@
+/*
+ * render.h
+ * Drawing to the canvas from several threads at once
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ */
+
+typedef void (*ToddlerFunRenderFunc) (cairo_t *cr, gpointer user_data);
+
+typedef struct {
+    GThreadPool *threads;
+    gint n_threads;
+
+    // Join of the bands currently being rendered
+    GMutex mutex;
+    GCond done;
+    gint pending;
+} ToddlerFunRenderPool;
+
+ToddlerFunRenderPool *render_pool_new (gint n_threads);
+void render_pool_free (ToddlerFunRenderPool *pool);
+void render_pool_run (ToddlerFunRenderPool *pool,
+		      cairo_surface_t *surface,
+		      gint band_alignment,
+		      ToddlerFunRenderFunc func,
+		      gpointer user_data);
+gboolean render_get_band (cairo_t *cr, gint *y, gint *height);
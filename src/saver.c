@@ -0,0 +1,256 @@
+/*
+ * saver.c
+ * Saving pictures to files in a background thread
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ * PNG compression of a full screen picture takes far too long to do
+ * while the child is drawing.  saver_save takes a snapshot of the
+ * canvas and queues it; a single thread encodes the queued snapshots
+ * and reports back to the main loop.  If saves come in faster than
+ * they can be encoded, the newest snapshot replaces the last queued
+ * one instead of letting the queue grow.  Pictures that have to be
+ * drawn first, as SVG, PDF or at another size, are queued with
+ * saver_render and drawn by the same thread.
+ */
+
+#include <config.h>
+#include <math.h>
+#include <glib.h>
+#include <gtk/gtk.h>
+#include <cairo-pdf.h>
+#include <cairo-svg.h>
+#include "saver.h"
+
+typedef struct {
+    ToddlerFunSaver *saver;
+    cairo_surface_t *snapshot;
+    gchar *pathname;
+    GError *error;
+
+    // For saver_render
+    gchar *format;
+    gdouble width;
+    gdouble height;
+    ToddlerFunSaveRenderFunc render;
+    gpointer data;
+    GDestroyNotify data_free;
+} SaveJob;
+
+static void
+save_job_free (SaveJob *job)
+{
+    if (job->snapshot != NULL)
+	cairo_surface_destroy (job->snapshot);
+    if (job->data_free != NULL)
+	(*job->data_free) (job->data);
+    g_free (job->format);
+    g_clear_error (&job->error);
+    g_free (job->pathname);
+    g_free (job);
+}
+
+static gboolean
+save_job_done (gpointer user_data)
+{
+    SaveJob *job = (SaveJob *) user_data;
+    ToddlerFunSaver *saver = job->saver;
+
+    if (saver->done != NULL)
+	(*saver->done) (job->pathname, job->error, saver->user_data);
+
+    save_job_free (job);
+    return FALSE;
+}
+
+/*
+ * Draw the picture of a saver_render job.  Vector formats are written
+ * right away; an image is left as the snapshot to encode.
+ */
+static void
+save_job_render (SaveJob *job)
+{
+    cairo_surface_t *surface;
+    cairo_status_t status;
+
+    if (g_strcmp0 (job->format, "svg") == 0)
+	surface = cairo_svg_surface_create (job->pathname,
+					    job->width, job->height);
+    else if (g_strcmp0 (job->format, "pdf") == 0)
+	surface = cairo_pdf_surface_create (job->pathname,
+					    job->width, job->height);
+    else
+	surface = cairo_image_surface_create (CAIRO_FORMAT_RGB24,
+					      ceil (job->width),
+					      ceil (job->height));
+
+    (*job->render) (surface, job->data);
+
+    if (cairo_surface_get_type (surface) == CAIRO_SURFACE_TYPE_IMAGE) {
+	job->snapshot = surface;
+	return;
+    }
+
+    cairo_surface_finish (surface);
+    status = cairo_surface_status (surface);
+    if (status != CAIRO_STATUS_SUCCESS)
+	g_set_error_literal (&job->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+			     cairo_status_to_string (status));
+    cairo_surface_destroy (surface);
+}
+
+static void
+save_job_run (SaveJob *job)
+{
+    GdkPixbuf *pixbuf;
+    gchar *compression;
+
+    if (job->render != NULL) {
+	save_job_render (job);
+	if (job->snapshot == NULL)
+	    return;
+    }
+
+    pixbuf = gdk_pixbuf_get_from_surface (
+	job->snapshot, 0, 0,
+	cairo_image_surface_get_width (job->snapshot),
+	cairo_image_surface_get_height (job->snapshot));
+
+    // The pixels are in the pixbuf now
+    cairo_surface_destroy (job->snapshot);
+    job->snapshot = NULL;
+
+    compression = g_strdup_printf ("%d", job->saver->compression);
+    gdk_pixbuf_save (pixbuf, job->pathname, "png", &job->error,
+		     "compression", compression, NULL);
+    g_free (compression);
+    g_object_unref (pixbuf);
+}
+
+static gpointer
+saver_thread (gpointer data)
+{
+    ToddlerFunSaver *saver = (ToddlerFunSaver *) data;
+    SaveJob *job;
+
+    for (;;) {
+	g_mutex_lock (&saver->mutex);
+	while (g_queue_is_empty (saver->queue) && !saver->quit)
+	    g_cond_wait (&saver->cond, &saver->mutex);
+	job = g_queue_pop_head (saver->queue);
+	g_mutex_unlock (&saver->mutex);
+
+	if (job == NULL)
+	    break;
+
+	save_job_run (job);
+	g_idle_add (save_job_done, job);
+    }
+
+    return NULL;
+}
+
+/*
+ * Create a saver that writes PNG files with the given zlib COMPRESSION
+ * level, and keeps at most MAX_QUEUED snapshots waiting.  DONE is called
+ * in the main loop after each save.
+ */
+ToddlerFunSaver *
+saver_new (gint compression, gint max_queued,
+	   ToddlerFunSaveDoneFunc done,
+	   gpointer user_data)
+{
+    ToddlerFunSaver *saver;
+
+    saver = g_new0 (ToddlerFunSaver, 1);
+    saver->compression = CLAMP (compression, 0, 9);
+    saver->max_queued = MAX (max_queued, 1);
+    saver->done = done;
+    saver->user_data = user_data;
+    saver->queue = g_queue_new ();
+    g_mutex_init (&saver->mutex);
+    g_cond_init (&saver->cond);
+
+    saver->thread = g_thread_new ("saver", saver_thread, saver);
+
+    return saver;
+}
+
+/*
+ * Finish all queued saves, then free the saver.
+ */
+void
+saver_free (ToddlerFunSaver *saver)
+{
+    g_mutex_lock (&saver->mutex);
+    saver->quit = TRUE;
+    g_cond_signal (&saver->cond);
+    g_mutex_unlock (&saver->mutex);
+
+    g_thread_join (saver->thread);
+
+    g_queue_free (saver->queue);
+    g_mutex_clear (&saver->mutex);
+    g_cond_clear (&saver->cond);
+    g_free (saver);
+}
+
+static void
+saver_queue (ToddlerFunSaver *saver, SaveJob *job)
+{
+    g_mutex_lock (&saver->mutex);
+    if (g_queue_get_length (saver->queue) >= (guint) saver->max_queued)
+	save_job_free (g_queue_pop_tail (saver->queue));
+    g_queue_push_tail (saver->queue, job);
+    g_cond_signal (&saver->cond);
+    g_mutex_unlock (&saver->mutex);
+}
+
+/*
+ * Queue SNAPSHOT to be written to PATHNAME.  The saver takes over the
+ * reference to SNAPSHOT, which must not be drawn to afterwards.
+ */
+void
+saver_save (ToddlerFunSaver *saver,
+	    cairo_surface_t *snapshot,
+	    const gchar *pathname)
+{
+    SaveJob *job;
+
+    job = g_new0 (SaveJob, 1);
+    job->saver = saver;
+    job->snapshot = snapshot;
+    job->pathname = g_strdup (pathname);
+
+    saver_queue (saver, job);
+}
+
+/*
+ * Queue a picture of WIDTH x HEIGHT to be drawn by RENDER and written
+ * to PATHNAME as FORMAT, which is "svg", "pdf" or "png".  RENDER is
+ * called in the saver thread with DATA, which is then freed with
+ * DATA_FREE, so it must not share anything with the main thread.
+ */
+void
+saver_render (ToddlerFunSaver *saver,
+	      const gchar *format,
+	      gdouble width,
+	      gdouble height,
+	      ToddlerFunSaveRenderFunc render,
+	      gpointer data,
+	      GDestroyNotify data_free,
+	      const gchar *pathname)
+{
+    SaveJob *job;
+
+    job = g_new0 (SaveJob, 1);
+    job->saver = saver;
+    job->pathname = g_strdup (pathname);
+    job->format = g_strdup (format);
+    job->width = width;
+    job->height = height;
+    job->render = render;
+    job->data = data;
+    job->data_free = data_free;
+
+    saver_queue (saver, job);
+}
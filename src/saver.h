@@ -0,0 +1,42 @@
+/*
+ * saver.h
+ * Saving pictures to files in a background thread
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ */
+
+typedef void (*ToddlerFunSaveDoneFunc) (const gchar *pathname,
+					const GError *error,
+					gpointer user_data);
+
+typedef void (*ToddlerFunSaveRenderFunc) (cairo_surface_t *target,
+					  gpointer data);
+
+typedef struct {
+    GThread *thread;
+    GMutex mutex;
+    GCond cond;
+    GQueue *queue;
+    gboolean quit;
+
+    gint max_queued;
+    gint compression;
+    ToddlerFunSaveDoneFunc done;
+    gpointer user_data;
+} ToddlerFunSaver;
+
+ToddlerFunSaver *saver_new (gint compression, gint max_queued,
+			    ToddlerFunSaveDoneFunc done,
+			    gpointer user_data);
+void saver_free (ToddlerFunSaver *saver);
+void saver_save (ToddlerFunSaver *saver,
+		 cairo_surface_t *snapshot,
+		 const gchar *pathname);
+void saver_render (ToddlerFunSaver *saver,
+		   const gchar *format,
+		   gdouble width,
+		   gdouble height,
+		   ToddlerFunSaveRenderFunc render,
+		   gpointer data,
+		   GDestroyNotify data_free,
+		   const gchar *pathname);
@@ -0,0 +1,500 @@
+/*
+ * sound.c
+ * Sound effects mixed from samples decoded in advance
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ * Starting a new playbin for every click means finding, demuxing and
+ * decoding the file and negotiating with the sound card before
+ * anything is heard.  Instead, each sound file of the theme is decoded
+ * to 16 bit stereo PCM when the theme is loaded, and a single pipeline
+ * plays the mix of a fixed number of voices.  When all voices are busy,
+ * the one that started first is taken over by the new sound.
+ *
+ * The mixing runs in the streaming thread of that pipeline and must
+ * never wait for the main thread.  Sounds to play are passed through a
+ * single producer, single consumer ring of triggers, and the PCM is
+ * mixed into a ring of preallocated blocks.
+ */
+
+#include <config.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gi18n.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
+#include "synth.h"
+#include "sound.h"
+
+#define SOUND_RATE 44100
+#define SOUND_CHANNELS 2
+
+// About 6 ms of sound per buffer
+#define SOUND_BLOCK_FRAMES 256
+
+// Buffering in the audio sink, in microseconds
+#define SOUND_SINK_BUFFER_TIME 40000
+#define SOUND_SINK_LATENCY_TIME 10000
+
+static gchar *
+sound_caps_string (void)
+{
+    return g_strdup_printf ("audio/x-raw-int, rate=(int)%d, channels=(int)%d, "
+			    "width=(int)16, depth=(int)16, "
+			    "signed=(boolean)true, endianness=(int)%d",
+			    SOUND_RATE, SOUND_CHANNELS, G_BYTE_ORDER);
+}
+
+/*
+ * Make a sample of N_FRAMES frames of DATA, which is not copied, such
+ * as PCM in a mapped theme bundle.  The sample holds the reference
+ * OWNER, which keeps DATA around, and drops it with OWNER_UNREF.
+ */
+ToddlerFunSample *
+sound_sample_new_static (const gint16 *data, gsize n_frames,
+			 gpointer owner, GDestroyNotify owner_unref)
+{
+    ToddlerFunSample *sample;
+
+    sample = g_new0 (ToddlerFunSample, 1);
+    sample->data = (gint16 *) data;
+    sample->n_frames = n_frames;
+    sample->owner = owner;
+    sample->owner_unref = owner_unref;
+
+    return sample;
+}
+
+void
+sound_sample_free (ToddlerFunSample *sample)
+{
+    if (sample->owner_unref != NULL)
+	sample->owner_unref (sample->owner);
+    else
+	g_free (sample->data);
+    g_free (sample);
+}
+
+//
+// Decoding
+//
+
+static GstFlowReturn
+on_decoded_buffer (GstAppSink *sink, gpointer user_data)
+{
+    GByteArray *pcm = user_data;
+    GstBuffer *buffer;
+
+    buffer = gst_app_sink_pull_buffer (sink);
+    if (buffer != NULL) {
+	g_byte_array_append (pcm, GST_BUFFER_DATA (buffer),
+			     GST_BUFFER_SIZE (buffer));
+	gst_buffer_unref (buffer);
+    }
+
+    return GST_FLOW_OK;
+}
+
+/*
+ * Decode all of FILENAME into memory, or return NULL if it can't be
+ * decoded.  This does not touch any mixer, and can be called from any
+ * thread.
+ */
+ToddlerFunSample *
+sound_sample_decode (const gchar *filename)
+{
+    ToddlerFunSample *sample = NULL;
+    GstAppSinkCallbacks callbacks = { NULL };
+    GstElement *pipeline, *sink;
+    GstMessage *message;
+    GByteArray *pcm;
+    GError *error = NULL;
+    gchar *uri, *caps, *description;
+
+    uri = gst_filename_to_uri (filename, &error);
+    if (uri == NULL) {
+	g_printerr ("%s\n", error->message);
+	g_clear_error (&error);
+	return NULL;
+    }
+
+    caps = sound_caps_string ();
+    description = g_strdup_printf ("uridecodebin uri=%s ! audioconvert ! "
+				   "audioresample ! appsink name=sink "
+				   "sync=false caps=\"%s\"", uri, caps);
+    pipeline = gst_parse_launch (description, &error);
+    g_free (description);
+    g_free (caps);
+    g_free (uri);
+    if (pipeline == NULL) {
+	g_printerr ("%s\n", error->message);
+	g_clear_error (&error);
+	return NULL;
+    }
+
+    // Collect the buffers as they come, and wait on the bus for the end
+    pcm = g_byte_array_new ();
+    sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+    callbacks.new_buffer = on_decoded_buffer;
+    gst_app_sink_set_callbacks (GST_APP_SINK (sink), &callbacks, pcm, NULL);
+    gst_object_unref (sink);
+
+    gst_element_set_state (pipeline, GST_STATE_PLAYING);
+    message = gst_bus_timed_pop_filtered (GST_ELEMENT_BUS (pipeline),
+					  GST_CLOCK_TIME_NONE,
+					  GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+
+    // No more buffers after this
+    gst_element_set_state (pipeline, GST_STATE_NULL);
+
+    if (message != NULL && GST_MESSAGE_TYPE (message) == GST_MESSAGE_EOS) {
+	sample = g_new0 (ToddlerFunSample, 1);
+	sample->n_frames = pcm->len / (SOUND_CHANNELS * sizeof (gint16));
+	sample->data = (gint16 *) g_byte_array_free (pcm, FALSE);
+    } else {
+	if (message != NULL) {
+	    gst_message_parse_error (message, &error, NULL);
+	    g_printerr (_("Can't load %s: %s\n"), filename, error->message);
+	    g_clear_error (&error);
+	}
+	g_byte_array_free (pcm, TRUE);
+    }
+
+    if (message != NULL)
+	gst_message_unref (message);
+    gst_object_unref (pipeline);
+
+    return sample;
+}
+
+//
+// Mixing
+//
+
+/*
+ * Start the sounds triggered since the last buffer
+ */
+static void
+take_triggers (ToddlerFunSoundMixer *mixer)
+{
+    gint head, tail;
+
+    head = g_atomic_int_get (&mixer->trigger_head);
+    for (tail = mixer->trigger_tail; tail != head; tail++) {
+	ToddlerFunTrigger *trigger =
+	    &mixer->triggers[(guint) tail % SOUND_N_TRIGGERS];
+	ToddlerFunVoice *voice = NULL;
+	gint v;
+
+	// A free voice if there is one, otherwise the oldest
+	for (v = 0; v < SOUND_N_VOICES; v++) {
+	    ToddlerFunVoice *candidate = &mixer->voices[v];
+	    if (candidate->sample == NULL) {
+		voice = candidate;
+		break;
+	    }
+	    if (voice == NULL || candidate->serial < voice->serial)
+		voice = candidate;
+	}
+
+	voice->sample = trigger->sample;
+	voice->position = 0;
+	voice->gain = trigger->gain;
+	voice->serial = mixer->n_played++;
+    }
+    g_atomic_int_set (&mixer->trigger_tail, tail);
+}
+
+static void
+mix_voices (ToddlerFunSoundMixer *mixer, gint16 *out, gsize n_frames)
+{
+    gint32 mix[SOUND_BLOCK_FRAMES * SOUND_CHANNELS];
+    gsize n_samples = n_frames * SOUND_CHANNELS;
+    ToddlerFunSynth *synth;
+    gsize i;
+    gint v;
+
+    memset (mix, 0, sizeof (mix));
+
+    take_triggers (mixer);
+    for (v = 0; v < SOUND_N_VOICES; v++) {
+	ToddlerFunVoice *voice = &mixer->voices[v];
+	const gint16 *in;
+	gsize n;
+
+	if (voice->sample == NULL)
+	    continue;
+
+	n = MIN (n_frames, voice->sample->n_frames - voice->position);
+	in = voice->sample->data + voice->position * SOUND_CHANNELS;
+	for (i = 0; i < n * SOUND_CHANNELS; i++)
+	    mix[i] += (in[i] * voice->gain) >> 8;
+
+	voice->position += n;
+	if (voice->position >= voice->sample->n_frames)
+	    voice->sample = NULL;
+    }
+
+    synth = g_atomic_pointer_get (&mixer->synth);
+    if (synth != NULL)
+	synth_render (synth, mix, n_frames, SOUND_RATE);
+
+    for (i = 0; i < n_samples; i++)
+	out[i] = CLAMP (mix[i], G_MININT16, G_MAXINT16);
+}
+
+/*
+ * Called from the streaming thread when the pipeline wants more sound.
+ * There is always something to push, if only silence, so that a new
+ * sound can start as soon as the next buffer.
+ */
+static void
+on_need_data (GstAppSrc *src, guint length, gpointer user_data)
+{
+    ToddlerFunSoundMixer *mixer = user_data;
+    GstBuffer *buffer;
+    gint16 *block;
+
+    // At most two blocks are queued in appsrc and the sink copies what
+    // it gets, so a block is free again long before it comes around
+    block = mixer->blocks +
+	mixer->next_block * SOUND_BLOCK_FRAMES * SOUND_CHANNELS;
+    mixer->next_block = (mixer->next_block + 1) % SOUND_N_BLOCKS;
+    mix_voices (mixer, block, SOUND_BLOCK_FRAMES);
+    g_atomic_int_inc (&mixer->n_blocks_mixed);
+
+    // The buffer does not own the block
+    buffer = gst_buffer_new ();
+    GST_BUFFER_DATA (buffer) = (guint8 *) block;
+    GST_BUFFER_SIZE (buffer) = SOUND_BLOCK_FRAMES * SOUND_CHANNELS *
+	sizeof (gint16);
+
+    GST_BUFFER_TIMESTAMP (buffer) =
+	gst_util_uint64_scale_int (mixer->n_frames_pushed, GST_SECOND,
+				   SOUND_RATE);
+    GST_BUFFER_DURATION (buffer) =
+	gst_util_uint64_scale_int (SOUND_BLOCK_FRAMES, GST_SECOND,
+				   SOUND_RATE);
+    mixer->n_frames_pushed += SOUND_BLOCK_FRAMES;
+
+    gst_app_src_push_buffer (src, buffer);
+}
+
+/*
+ * autoaudiosink picks the real sink at runtime; keep its buffer small
+ * so that new sounds are heard quickly.
+ */
+static void
+on_sink_element_added (GstBin *bin, GstElement *element, gpointer user_data)
+{
+    GObjectClass *klass = G_OBJECT_GET_CLASS (element);
+
+    if (g_object_class_find_property (klass, "buffer-time") != NULL &&
+	g_object_class_find_property (klass, "latency-time") != NULL)
+	g_object_set (element,
+		      "buffer-time", (gint64) SOUND_SINK_BUFFER_TIME,
+		      "latency-time", (gint64) SOUND_SINK_LATENCY_TIME,
+		      NULL);
+}
+
+/*
+ * Create the mixer and start its pipeline.  Returns NULL if the
+ * pipeline can't be created, in which case no sounds are played.
+ */
+ToddlerFunSoundMixer *
+sound_mixer_new (void)
+{
+    ToddlerFunSoundMixer *mixer;
+    GstAppSrcCallbacks callbacks = { NULL };
+    GstElement *sink;
+    GstCaps *caps;
+    GError *error = NULL;
+    gchar *caps_string;
+
+    mixer = g_new0 (ToddlerFunSoundMixer, 1);
+    mixer->blocks = g_new0 (gint16, SOUND_N_BLOCKS * SOUND_BLOCK_FRAMES *
+			    SOUND_CHANNELS);
+    mixer->samples = g_hash_table_new_full (g_str_hash, g_str_equal,
+					    g_free,
+					    (GDestroyNotify) sound_sample_free);
+
+    mixer->pipeline = gst_parse_launch ("appsrc name=src ! audioconvert ! "
+					"audioresample ! "
+					"autoaudiosink name=sink", &error);
+    if (mixer->pipeline == NULL) {
+	g_printerr ("%s\n", error->message);
+	g_clear_error (&error);
+	sound_mixer_free (mixer);
+	return NULL;
+    }
+
+    mixer->src = gst_bin_get_by_name (GST_BIN (mixer->pipeline), "src");
+    caps_string = sound_caps_string ();
+    caps = gst_caps_from_string (caps_string);
+    g_free (caps_string);
+    gst_app_src_set_caps (GST_APP_SRC (mixer->src), caps);
+    gst_caps_unref (caps);
+
+    // Keep at most two buffers queued, so that the mix is done just
+    // before it is played
+    g_object_set (mixer->src,
+		  "is-live", TRUE,
+		  "format", GST_FORMAT_TIME,
+		  "max-bytes", (guint64) (2 * SOUND_BLOCK_FRAMES *
+					  SOUND_CHANNELS * sizeof (gint16)),
+		  NULL);
+    callbacks.need_data = on_need_data;
+    gst_app_src_set_callbacks (GST_APP_SRC (mixer->src), &callbacks,
+			       mixer, NULL);
+
+    sink = gst_bin_get_by_name (GST_BIN (mixer->pipeline), "sink");
+    g_signal_connect (sink, "element-added",
+		      G_CALLBACK (on_sink_element_added), NULL);
+    gst_object_unref (sink);
+
+    gst_element_set_state (mixer->pipeline, GST_STATE_PLAYING);
+
+    return mixer;
+}
+
+void
+sound_mixer_free (ToddlerFunSoundMixer *mixer)
+{
+    if (mixer->pipeline != NULL) {
+	gst_element_set_state (mixer->pipeline, GST_STATE_NULL);
+	gst_object_unref (mixer->src);
+	gst_object_unref (mixer->pipeline);
+    }
+    g_hash_table_destroy (mixer->samples);
+    g_slist_free_full (mixer->retired, (GDestroyNotify) sound_sample_free);
+    g_free (mixer->blocks);
+    g_free (mixer);
+}
+
+/*
+ * Decode FILENAME so that it can be played.  Returns FALSE if it can't
+ * be decoded.
+ */
+gboolean
+sound_mixer_load (ToddlerFunSoundMixer *mixer, const gchar *filename)
+{
+    ToddlerFunSample *sample;
+
+    if (g_hash_table_lookup (mixer->samples, filename) != NULL)
+	return TRUE;
+
+    sample = sound_sample_decode (filename);
+    if (sample == NULL)
+	return FALSE;
+
+    sound_mixer_add_sample (mixer, filename, sample);
+    return TRUE;
+}
+
+/*
+ * Free the retired samples that no voice can be playing any more
+ */
+static void
+free_retired_samples (ToddlerFunSoundMixer *mixer)
+{
+    gint n_blocks_mixed = g_atomic_int_get (&mixer->n_blocks_mixed);
+    GSList *l, *next;
+
+    for (l = mixer->retired; l != NULL; l = next) {
+	ToddlerFunSample *sample = l->data;
+
+	next = l->next;
+	if (n_blocks_mixed - sample->free_after >= 0) {
+	    mixer->retired = g_slist_delete_link (mixer->retired, l);
+	    sound_sample_free (sample);
+	}
+    }
+}
+
+/*
+ * Keep SAMPLE until the streaming thread is done with it.  A trigger
+ * queued before now is taken within the next two blocks, and a voice
+ * started from it plays for at most the length of the sample.
+ */
+static void
+retire_sample (ToddlerFunSoundMixer *mixer, ToddlerFunSample *sample)
+{
+    sample->free_after = g_atomic_int_get (&mixer->n_blocks_mixed) + 3 +
+	sample->n_frames / SOUND_BLOCK_FRAMES;
+    mixer->retired = g_slist_prepend (mixer->retired, sample);
+}
+
+/*
+ * Stop playing FILENAME from now on.  Its sample is freed once it can't
+ * be playing any more.
+ */
+void
+sound_mixer_remove_sample (ToddlerFunSoundMixer *mixer,
+			   const gchar *filename)
+{
+    gpointer old_filename, old_sample;
+
+    free_retired_samples (mixer);
+
+    if (g_hash_table_lookup_extended (mixer->samples, filename,
+				      &old_filename, &old_sample)) {
+	g_hash_table_steal (mixer->samples, filename);
+	g_free (old_filename);
+	retire_sample (mixer, old_sample);
+    }
+}
+
+/*
+ * Make SAMPLE, decoded from FILENAME, available for playing.  The mixer
+ * takes it over.  A sample that was added for FILENAME before is freed
+ * once it can't be playing any more.
+ */
+void
+sound_mixer_add_sample (ToddlerFunSoundMixer *mixer,
+			const gchar *filename,
+			ToddlerFunSample *sample)
+{
+    sound_mixer_remove_sample (mixer, filename);
+    g_hash_table_insert (mixer->samples, g_strdup (filename), sample);
+}
+
+/*
+ * Start playing FILENAME, which must have been loaded, at GAIN (1.0 is
+ * the volume of the file).
+ */
+void
+sound_mixer_play (ToddlerFunSoundMixer *mixer,
+		  const gchar *filename,
+		  gdouble gain)
+{
+    ToddlerFunSample *sample;
+    gint head, tail;
+
+    free_retired_samples (mixer);
+
+    sample = g_hash_table_lookup (mixer->samples, filename);
+    if (sample == NULL)
+	return;
+
+    // If the streaming thread is that far behind, this sound would be
+    // late anyway
+    head = mixer->trigger_head;
+    tail = g_atomic_int_get (&mixer->trigger_tail);
+    if ((guint) (head - tail) >= SOUND_N_TRIGGERS)
+	return;
+
+    mixer->triggers[(guint) head % SOUND_N_TRIGGERS].sample = sample;
+    mixer->triggers[(guint) head % SOUND_N_TRIGGERS].gain =
+	(gint) (CLAMP (gain, 0, 4) * 256);
+    g_atomic_int_set (&mixer->trigger_head, head + 1);
+}
+
+/*
+ * Mix the sound of SYNTH in from now on, or stop if it is NULL.  The
+ * synth must not be freed while it is set.
+ */
+void
+sound_mixer_set_synth (ToddlerFunSoundMixer *mixer, ToddlerFunSynth *synth)
+{
+    g_atomic_pointer_set (&mixer->synth, synth);
+}
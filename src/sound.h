@@ -0,0 +1,81 @@
+/*
+ * sound.h
+ * Sound effects mixed from samples decoded in advance
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ */
+
+#define SOUND_N_VOICES 8
+#define SOUND_N_TRIGGERS 16
+#define SOUND_N_BLOCKS 8
+
+typedef struct {
+    gint16 *data;
+    gsize n_frames;
+
+    // What DATA belongs to, if the sample doesn't own it
+    gpointer owner;
+    GDestroyNotify owner_unref;
+
+    // When retired, the n_blocks_mixed after which it can be freed
+    gint free_after;
+} ToddlerFunSample;
+
+typedef struct {
+    ToddlerFunSample *sample;
+    gsize position;
+    gint gain;
+    guint64 serial;
+} ToddlerFunVoice;
+
+typedef struct {
+    ToddlerFunSample *sample;
+    gint gain;
+} ToddlerFunTrigger;
+
+typedef struct {
+    GstElement *pipeline;
+    GstElement *src;
+    GHashTable *samples;
+
+    // Sounds to start, passed from the main thread to the streaming
+    // thread.  Only the main thread writes trigger_head and only the
+    // streaming thread writes trigger_tail.
+    ToddlerFunTrigger triggers[SOUND_N_TRIGGERS];
+    gint trigger_head;
+    gint trigger_tail;
+    ToddlerFunSynth *synth;
+
+    // Samples that have been replaced but might still be playing.  Only
+    // the streaming thread writes n_blocks_mixed.
+    GSList *retired;
+    gint n_blocks_mixed;
+
+    // Only used by the streaming thread
+    ToddlerFunVoice voices[SOUND_N_VOICES];
+    guint64 n_played;
+    gint16 *blocks;
+    gint next_block;
+    guint64 n_frames_pushed;
+} ToddlerFunSoundMixer;
+
+ToddlerFunSample *sound_sample_decode (const gchar *filename);
+ToddlerFunSample *sound_sample_new_static (const gint16 *data,
+					   gsize n_frames,
+					   gpointer owner,
+					   GDestroyNotify owner_unref);
+void sound_sample_free (ToddlerFunSample *sample);
+ToddlerFunSoundMixer *sound_mixer_new (void);
+void sound_mixer_free (ToddlerFunSoundMixer *mixer);
+gboolean sound_mixer_load (ToddlerFunSoundMixer *mixer,
+			   const gchar *filename);
+void sound_mixer_add_sample (ToddlerFunSoundMixer *mixer,
+			     const gchar *filename,
+			     ToddlerFunSample *sample);
+void sound_mixer_remove_sample (ToddlerFunSoundMixer *mixer,
+				const gchar *filename);
+void sound_mixer_play (ToddlerFunSoundMixer *mixer,
+		       const gchar *filename,
+		       gdouble gain);
+void sound_mixer_set_synth (ToddlerFunSoundMixer *mixer,
+			    ToddlerFunSynth *synth);
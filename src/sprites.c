@@ -0,0 +1,204 @@
+/*
+ * sprites.c
+ * Cache of pre-rasterized theme object images
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ */
+
+#include <config.h>
+#include <math.h>
+#include <glib.h>
+#include <cairo.h>
+#include <librsvg/rsvg.h>
+#include "sprites.h"
+
+/*
+ * Rotations are quantized to this many steps per full turn, so that
+ * the random rotation chosen for each click maps to a small set of
+ * cached surfaces.
+ */
+static const gint sprite_rotation_steps = 128;
+
+typedef struct {
+    gint object_num;
+    gint size_key;
+    gint rotation_step;
+} SpriteKey;
+
+static guint
+sprite_key_hash (gconstpointer v)
+{
+    const SpriteKey *key = v;
+    return (key->object_num * 31 + key->size_key) * 131 + key->rotation_step;
+}
+
+static gboolean
+sprite_key_equal (gconstpointer a, gconstpointer b)
+{
+    const SpriteKey *ka = a;
+    const SpriteKey *kb = b;
+    return (ka->object_num == kb->object_num &&
+	    ka->size_key == kb->size_key &&
+	    ka->rotation_step == kb->rotation_step);
+}
+
+static void
+sprite_key_init (SpriteKey *key, gint object_num, gdouble size,
+		 gint rotation_step)
+{
+    key->object_num = object_num;
+    key->size_key = (gint) floor (size * 64 + 0.5);
+    key->rotation_step = rotation_step;
+}
+
+void
+sprite_free (ToddlerFunSprite *sprite)
+{
+    cairo_surface_destroy (sprite->surface);
+    g_free (sprite);
+}
+
+/*
+ * The step that ROTATION (in radians) is rounded to
+ */
+gint
+sprite_get_rotation_step (gdouble rotation)
+{
+    return (gint) floor (rotation * sprite_rotation_steps / (G_PI * 2) + 0.5);
+}
+
+ToddlerFunSpriteCache *
+sprite_cache_new (void)
+{
+    ToddlerFunSpriteCache *cache = g_new0 (ToddlerFunSpriteCache, 1);
+    cache->sprites = g_hash_table_new_full (sprite_key_hash, sprite_key_equal,
+					    g_free,
+					    (GDestroyNotify) sprite_free);
+    return cache;
+}
+
+void
+sprite_cache_free (ToddlerFunSpriteCache *cache)
+{
+    g_hash_table_destroy (cache->sprites);
+    g_free (cache);
+}
+
+void
+sprite_cache_clear (ToddlerFunSpriteCache *cache)
+{
+    g_hash_table_remove_all (cache->sprites);
+}
+
+/*
+ * Render an SVG the same way draw_image used to do it directly: scaled
+ * so that its diagonal is SIZE pixels, centered on the origin and then
+ * rotated by ROTATION_STEP steps around its (scaled) top left corner.
+ * The surface is made just large enough to hold the transformed image.
+ */
+ToddlerFunSprite *
+sprite_new_from_svg (RsvgHandle *handle, gdouble size, gint rotation_step)
+{
+    ToddlerFunSprite *sprite;
+    RsvgDimensionData dimension;
+    cairo_matrix_t matrix;
+    cairo_t *cr;
+    gdouble x[4], y[4];
+    gdouble x_min, y_min, x_max, y_max;
+    gdouble hypothenuse, scale, rotation;
+    gint i;
+
+    rsvg_handle_get_dimensions (handle, &dimension);
+    hypothenuse = sqrt (dimension.width * dimension.width +
+			dimension.height * dimension.height);
+    scale = size / hypothenuse;
+    rotation = rotation_step * G_PI * 2 / sprite_rotation_steps;
+
+    cairo_matrix_init_scale (&matrix, scale, scale);
+    cairo_matrix_translate (&matrix, -dimension.width / 2.0,
+			    -dimension.height / 2.0);
+    cairo_matrix_rotate (&matrix, rotation);
+
+    x[0] = 0;               y[0] = 0;
+    x[1] = dimension.width; y[1] = 0;
+    x[2] = 0;               y[2] = dimension.height;
+    x[3] = dimension.width; y[3] = dimension.height;
+
+    for (i = 0; i < 4; i++)
+	cairo_matrix_transform_point (&matrix, &x[i], &y[i]);
+
+    x_min = x_max = x[0];
+    y_min = y_max = y[0];
+    for (i = 1; i < 4; i++) {
+	x_min = MIN (x_min, x[i]);
+	y_min = MIN (y_min, y[i]);
+	x_max = MAX (x_max, x[i]);
+	y_max = MAX (y_max, y[i]);
+    }
+
+    // One pixel of slack for antialiased edges
+    sprite = g_new0 (ToddlerFunSprite, 1);
+    sprite->x_offset = (gint) floor (x_min) - 1;
+    sprite->y_offset = (gint) floor (y_min) - 1;
+    sprite->width = (gint) ceil (x_max) + 1 - sprite->x_offset;
+    sprite->height = (gint) ceil (y_max) + 1 - sprite->y_offset;
+
+    sprite->surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+						  sprite->width,
+						  sprite->height);
+
+    cr = cairo_create (sprite->surface);
+    cairo_translate (cr, -sprite->x_offset, -sprite->y_offset);
+    cairo_transform (cr, &matrix);
+    rsvg_handle_render_cairo (handle, cr);
+    cairo_destroy (cr);
+
+    return sprite;
+}
+
+/*
+ * Get a pre-rasterized image of object OBJECT_NUM, rendering it from
+ * HANDLE if it isn't in the cache yet.  Returns NULL if it isn't and
+ * HANDLE is NULL.  The sprite should be painted with its offset
+ * relative to the point where the image is placed.
+ */
+ToddlerFunSprite *
+sprite_cache_get (ToddlerFunSpriteCache *cache,
+		  gint object_num,
+		  RsvgHandle *handle,
+		  gdouble size,
+		  gdouble rotation)
+{
+    ToddlerFunSprite *sprite;
+    SpriteKey key;
+
+    sprite_key_init (&key, object_num, size,
+		     sprite_get_rotation_step (rotation));
+
+    sprite = g_hash_table_lookup (cache->sprites, &key);
+    if (sprite == NULL && handle != NULL) {
+	sprite = sprite_new_from_svg (handle, size, key.rotation_step);
+	g_hash_table_insert (cache->sprites, g_memdup (&key, sizeof (key)),
+			     sprite);
+    }
+
+    return sprite;
+}
+
+/*
+ * Add a sprite rendered elsewhere, such as one from a theme bundle.
+ * The cache takes over SPRITE.
+ */
+void
+sprite_cache_insert (ToddlerFunSpriteCache *cache,
+		     gint object_num,
+		     gdouble size,
+		     gint rotation_step,
+		     ToddlerFunSprite *sprite)
+{
+    SpriteKey key;
+
+    sprite_key_init (&key, object_num, size, rotation_step);
+    g_hash_table_replace (cache->sprites, g_memdup (&key, sizeof (key)),
+			  sprite);
+}
@@ -0,0 +1,39 @@
+/*
+ * sprites.h
+ * Cache of pre-rasterized theme object images
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ */
+
+// Images are drawn rotated by up to this much either way
+#define SPRITE_MAX_ROTATION (G_PI * 0.2)
+
+typedef struct {
+    cairo_surface_t *surface;
+    gint x_offset;
+    gint y_offset;
+    gint width;
+    gint height;
+} ToddlerFunSprite;
+
+typedef struct {
+    GHashTable *sprites;
+} ToddlerFunSpriteCache;
+
+gint sprite_get_rotation_step (gdouble rotation);
+ToddlerFunSprite *sprite_new_from_svg (RsvgHandle *handle, gdouble size,
+				       gint rotation_step);
+void sprite_free (ToddlerFunSprite *sprite);
+ToddlerFunSpriteCache *sprite_cache_new (void);
+void sprite_cache_free (ToddlerFunSpriteCache *cache);
+void sprite_cache_clear (ToddlerFunSpriteCache *cache);
+ToddlerFunSprite *sprite_cache_get (ToddlerFunSpriteCache *cache,
+				    gint object_num,
+				    RsvgHandle *handle,
+				    gdouble size,
+				    gdouble rotation);
+void sprite_cache_insert (ToddlerFunSpriteCache *cache,
+			  gint object_num,
+			  gdouble size,
+			  gint rotation_step,
+			  ToddlerFunSprite *sprite);
@@ -0,0 +1,132 @@
+/*
+ * synth.c
+ * A synthesizer voice that follows the pointer
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ * While the child draws, a tone plays whose pitch follows the height
+ * of the pointer, panned to its side of the screen, and brighter or
+ * duller along with the color of the line.  It fades out shortly after
+ * the pointer stops.
+ *
+ * The main thread only stores the parameters with atomic writes, and
+ * the audio thread reads them once per buffer and glides towards them.
+ * Nothing here locks or allocates once the synth has been created.
+ * The parameters are separate atomics, so a buffer might see a new pan
+ * with an old pitch; the glide makes that inaudible.
+ */
+
+#include <config.h>
+#include <math.h>
+#include <glib.h>
+#include "synth.h"
+
+// Parameters are passed as fixed point integers with this scale
+#define SYNTH_ONE 65536
+
+static const gdouble synth_min_frequency = 220;
+static const gdouble synth_octaves = 2;
+static const gfloat synth_volume = 0.15;
+static const gdouble synth_hold_time = 0.1;
+
+// Fraction of the distance to the target covered per sample
+static const gfloat synth_glide = 0.002;
+static const gfloat synth_attack = 0.01;
+static const gfloat synth_release = 0.0002;
+
+ToddlerFunSynth *
+synth_new (void)
+{
+    ToddlerFunSynth *synth = g_new0 (ToddlerFunSynth, 1);
+
+    synth->pan = SYNTH_ONE / 2;
+    synth->pitch = SYNTH_ONE / 2;
+    synth->cur_pan = 0.5;
+    synth->cur_frequency = synth_min_frequency * 2;
+    return synth;
+}
+
+void
+synth_free (ToddlerFunSynth *synth)
+{
+    g_free (synth);
+}
+
+/*
+ * Called from the main thread whenever the pointer has moved.  X and Y
+ * are the position relative to the size of the window, from 0 to 1,
+ * and BRIGHTNESS is from 0 (a pure tone) to 1.
+ */
+void
+synth_update (ToddlerFunSynth *synth,
+	      gdouble x, gdouble y, gdouble brightness)
+{
+    g_atomic_int_set (&synth->pan, (gint) (CLAMP (x, 0, 1) * SYNTH_ONE));
+    g_atomic_int_set (&synth->pitch,
+		      (gint) (CLAMP (1 - y, 0, 1) * SYNTH_ONE));
+    g_atomic_int_set (&synth->brightness,
+		      (gint) (CLAMP (brightness, 0, 1) * SYNTH_ONE));
+    g_atomic_int_inc (&synth->motion_serial);
+}
+
+/*
+ * Called from the audio thread to add N_FRAMES of stereo sound at RATE
+ * to MIX.
+ */
+void
+synth_render (ToddlerFunSynth *synth,
+	      gint32 *mix, gsize n_frames, gint rate)
+{
+    gfloat target_pan, target_frequency, target_brightness, target_amplitude;
+    gint serial;
+    gsize i;
+
+    // Keep sounding for a while after each move, since moves come at
+    // the frame rate, which is slower than buffers are mixed
+    serial = g_atomic_int_get (&synth->motion_serial);
+    if (serial != synth->last_serial)
+	synth->hold = rate * synth_hold_time;
+    else
+	synth->hold = MAX (synth->hold - (gint) n_frames, 0);
+    synth->last_serial = serial;
+    target_amplitude = synth->hold > 0 ? 1 : 0;
+
+    // Nothing to do while silent
+    if (target_amplitude == 0 && synth->amplitude < 1e-4) {
+	synth->amplitude = 0;
+	return;
+    }
+
+    target_pan = (gfloat) g_atomic_int_get (&synth->pan) / SYNTH_ONE;
+    target_frequency = synth_min_frequency *
+	pow (2, synth_octaves * g_atomic_int_get (&synth->pitch) / SYNTH_ONE);
+    target_brightness = (gfloat) g_atomic_int_get (&synth->brightness) /
+	SYNTH_ONE;
+
+    for (i = 0; i < n_frames; i++) {
+	gfloat value, left, right;
+
+	synth->cur_pan += (target_pan - synth->cur_pan) * synth_glide;
+	synth->cur_frequency +=
+	    (target_frequency - synth->cur_frequency) * synth_glide;
+	synth->cur_brightness +=
+	    (target_brightness - synth->cur_brightness) * synth_glide;
+	synth->amplitude += (target_amplitude - synth->amplitude) *
+	    (target_amplitude > synth->amplitude ?
+	     synth_attack : synth_release);
+
+	// Frequency modulation by the octave; more of it sounds brighter
+	value = sinf (synth->phase +
+		      synth->cur_brightness * 2 * sinf (synth->phase * 2));
+	value *= synth->amplitude * synth_volume * G_MAXINT16;
+
+	synth->phase += 2 * G_PI * synth->cur_frequency / rate;
+	if (synth->phase >= 2 * G_PI)
+	    synth->phase -= 2 * G_PI;
+
+	// Equal power panning
+	left = value * cosf (synth->cur_pan * G_PI / 2);
+	right = value * sinf (synth->cur_pan * G_PI / 2);
+	mix[i * 2] += (gint32) left;
+	mix[i * 2 + 1] += (gint32) right;
+    }
+}
@@ -0,0 +1,30 @@
+/*
+ * synth.h
+ * A synthesizer voice that follows the pointer
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ */
+
+typedef struct {
+    // Written by the main thread, read by the audio thread
+    gint pan;
+    gint pitch;
+    gint brightness;
+    gint motion_serial;
+
+    // Only used by the audio thread
+    gint last_serial;
+    gint hold;
+    gfloat amplitude;
+    gfloat cur_pan;
+    gfloat cur_frequency;
+    gfloat cur_brightness;
+    gdouble phase;
+} ToddlerFunSynth;
+
+ToddlerFunSynth *synth_new (void);
+void synth_free (ToddlerFunSynth *synth);
+void synth_update (ToddlerFunSynth *synth,
+		   gdouble x, gdouble y, gdouble brightness);
+void synth_render (ToddlerFunSynth *synth,
+		   gint32 *mix, gsize n_frames, gint rate);
@@ -0,0 +1,320 @@
+/*
+ * theme-compile.c
+ * Compiles a theme into a bundle that Toddler Fun can map and use as is
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ * The bundle holds the objects of theme.xml, their images rasterized
+ * at the sizes and rotations Toddler Fun draws them at, and their
+ * sounds decoded to the format the sound mixer plays.  Loading it is a
+ * matter of mapping the file, so no SVG or Ogg has to be read at
+ * startup.  See theme.h for the format.
+ */
+
+#include <config.h>
+#include <locale.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <cairo.h>
+#include <librsvg/rsvg.h>
+#include <gst/gst.h>
+#include "theme.h"
+#include "sprites.h"
+#include "synth.h"
+#include "sound.h"
+
+typedef struct {
+    GByteArray *data;
+    gchar *dirname;
+} ToddlerFunBundleWriter;
+
+static guint32
+writer_align (ToddlerFunBundleWriter *writer)
+{
+    static const guchar zeros[THEME_BUNDLE_ALIGN] = { 0 };
+    guint pad;
+
+    pad = (THEME_BUNDLE_ALIGN - writer->data->len % THEME_BUNDLE_ALIGN) %
+	THEME_BUNDLE_ALIGN;
+    g_byte_array_append (writer->data, zeros, pad);
+
+    return writer->data->len;
+}
+
+/*
+ * Append LEN bytes of DATA, aligned, and return their offset
+ */
+static guint32
+writer_add (ToddlerFunBundleWriter *writer, gconstpointer data, gsize len)
+{
+    guint32 offset = writer_align (writer);
+
+    g_byte_array_append (writer->data, data, len);
+    return offset;
+}
+
+/*
+ * Append the name of the file PATH relative to the theme directory, or
+ * return 0 if PATH is NULL
+ */
+static guint32
+writer_add_file (ToddlerFunBundleWriter *writer, const gchar *path)
+{
+    const gchar *name = path;
+    gsize dir_len = strlen (writer->dirname);
+
+    if (path == NULL)
+	return 0;
+
+    if (strncmp (path, writer->dirname, dir_len) == 0 &&
+	G_IS_DIR_SEPARATOR (path[dir_len]))
+	name = path + dir_len + 1;
+
+    return writer_add (writer, name, strlen (name) + 1);
+}
+
+/*
+ * Rasterize HANDLE at each of SIZES and every rotation step in the
+ * range, appending the pixels to the bundle and the sprites to SPRITES
+ */
+static void
+add_sprites (ToddlerFunBundleWriter *writer, RsvgHandle *handle,
+	     const gint *sizes, gint n_sizes, GArray *sprites)
+{
+    gint min_step, max_step, step, i;
+
+    min_step = sprite_get_rotation_step (-SPRITE_MAX_ROTATION);
+    max_step = sprite_get_rotation_step (SPRITE_MAX_ROTATION);
+
+    for (i = 0; i < n_sizes; i++) {
+	for (step = min_step; step <= max_step; step++) {
+	    ToddlerFunBundleSprite bundle_sprite;
+	    ToddlerFunSprite *sprite;
+
+	    sprite = sprite_new_from_svg (handle, sizes[i], step);
+	    cairo_surface_flush (sprite->surface);
+
+	    bundle_sprite.size = sizes[i];
+	    bundle_sprite.rotation_step = step;
+	    bundle_sprite.x_offset = sprite->x_offset;
+	    bundle_sprite.y_offset = sprite->y_offset;
+	    bundle_sprite.width = sprite->width;
+	    bundle_sprite.height = sprite->height;
+	    bundle_sprite.stride =
+		cairo_image_surface_get_stride (sprite->surface);
+	    bundle_sprite.data_offset =
+		writer_add (writer,
+			    cairo_image_surface_get_data (sprite->surface),
+			    bundle_sprite.stride * bundle_sprite.height);
+	    g_array_append_val (sprites, bundle_sprite);
+
+	    sprite_free (sprite);
+	}
+    }
+}
+
+/*
+ * Write the bundle of THEME, read from XML_FILE, to OUTPUT
+ */
+static gboolean
+compile_theme (ToddlerFunTheme *theme, const gchar *xml_file,
+	       const gchar *output, const gint *sizes, gint n_sizes,
+	       GError **error)
+{
+    ToddlerFunBundleWriter writer;
+    ToddlerFunBundleHeader header;
+    ToddlerFunBundleObject *objects;
+    GArray *tracks;
+    gint i, n_objects;
+    guint j;
+    gboolean ok;
+
+    writer.data = g_byte_array_new ();
+    writer.dirname = g_path_get_dirname (xml_file);
+
+    // Filled in at the end
+    memset (&header, 0, sizeof (header));
+    g_byte_array_append (writer.data, (const guint8 *) &header,
+			 sizeof (header));
+
+    memcpy (header.magic, THEME_BUNDLE_MAGIC, 4);
+    header.version = THEME_BUNDLE_VERSION;
+    header.byte_order = G_BYTE_ORDER;
+    theme_get_file_checksum (xml_file, header.xml_sha1);
+
+    n_objects = theme_get_n_objects (theme);
+    objects = g_new0 (ToddlerFunBundleObject, n_objects);
+
+    for (i = 0; i < n_objects; i++) {
+	ToddlerFunThemeObject *obj = theme_get_object (theme, i);
+	ToddlerFunBundleObject *bundle_obj = &objects[i];
+
+	bundle_obj->sound_offset = writer_add_file (&writer, obj->sound_file);
+	bundle_obj->image_offset = writer_add_file (&writer, obj->image_file);
+	if (obj->sound_file != NULL)
+	    theme_get_file_checksum (obj->sound_file, bundle_obj->sound_sha1);
+	if (obj->image_file != NULL)
+	    theme_get_file_checksum (obj->image_file, bundle_obj->image_sha1);
+
+	// Objects that can't be decoded or rendered here are left for
+	// Toddler Fun to load the usual way
+	if (obj->sound_file != NULL) {
+	    ToddlerFunSample *sample = sound_sample_decode (obj->sound_file);
+
+	    if (sample != NULL) {
+		bundle_obj->pcm_n_frames = sample->n_frames;
+		bundle_obj->pcm_offset =
+		    writer_add (&writer, sample->data,
+				sample->n_frames * 2 * sizeof (gint16));
+		sound_sample_free (sample);
+	    }
+	}
+
+	if (obj->image_file != NULL) {
+	    RsvgHandle *handle;
+	    GError *image_error = NULL;
+
+	    handle = rsvg_handle_new_from_file (obj->image_file, &image_error);
+	    if (handle != NULL) {
+		GArray *sprites;
+
+		sprites = g_array_new (FALSE, FALSE,
+				       sizeof (ToddlerFunBundleSprite));
+		add_sprites (&writer, handle, sizes, n_sizes, sprites);
+		bundle_obj->n_sprites = sprites->len;
+		bundle_obj->sprites_offset =
+		    writer_add (&writer, sprites->data,
+				sprites->len * sizeof (ToddlerFunBundleSprite));
+		g_array_free (sprites, TRUE);
+		g_object_unref (handle);
+	    } else {
+		g_printerr ("%s\n", image_error->message);
+		g_clear_error (&image_error);
+	    }
+	}
+    }
+
+    header.n_objects = n_objects;
+    header.objects_offset =
+	writer_add (&writer, objects, n_objects * sizeof (*objects));
+    g_free (objects);
+
+    header.background_offset =
+	writer_add_file (&writer, theme->background_sound_file);
+
+    tracks = g_array_new (FALSE, FALSE, sizeof (guint32));
+    for (j = 0; j < theme->music_tracks->len; j++) {
+	guint32 offset;
+
+	offset = writer_add_file (&writer,
+				  g_ptr_array_index (theme->music_tracks, j));
+	g_array_append_val (tracks, offset);
+    }
+    header.n_tracks = tracks->len;
+    header.tracks_offset =
+	writer_add (&writer, tracks->data, tracks->len * sizeof (guint32));
+    g_array_free (tracks, TRUE);
+
+    header.crossfade_ms = (guint32) (theme->music_crossfade * 1000 + 0.5);
+
+    writer_align (&writer);
+    header.file_size = writer.data->len;
+    memcpy (writer.data->data, &header, sizeof (header));
+
+    ok = g_file_set_contents (output, (const gchar *) writer.data->data,
+			      writer.data->len, error);
+
+    g_byte_array_free (writer.data, TRUE);
+    g_free (writer.dirname);
+
+    return ok;
+}
+
+/*
+ * Parse a comma separated list of sizes
+ */
+static gint *
+parse_sizes (const gchar *list, gint *n_sizes)
+{
+    gchar **parts;
+    gint *sizes;
+    gint i, n = 0;
+
+    parts = g_strsplit (list, ",", -1);
+    sizes = g_new0 (gint, g_strv_length (parts));
+    for (i = 0; parts[i] != NULL; i++) {
+	gint size = atoi (parts[i]);
+	if (size > 0)
+	    sizes[n++] = size;
+    }
+    g_strfreev (parts);
+
+    *n_sizes = n;
+    return sizes;
+}
+
+int
+main (int argc, char *argv[])
+{
+    ToddlerFunTheme *theme;
+    GOptionContext *option_context;
+    GError *error = NULL;
+    gchar *size_list = NULL;
+    gchar *output, *dirname;
+    gint *sizes, n_sizes;
+
+    GOptionEntry options [] =
+	{
+	    { "sizes", 's', 0, G_OPTION_ARG_STRING, &size_list,
+	      "Rasterize images with diagonals of SIZES pixels "
+	      "(default 100)", "SIZE,..." },
+	    { NULL }
+	};
+
+    setlocale (LC_ALL, "");
+
+    option_context = g_option_context_new ("THEME.XML [OUTPUT]");
+    g_option_context_set_summary (option_context,
+				  "Compile a Toddler Fun theme into a "
+				  "bundle, by default theme.bundle next "
+				  "to it.");
+    g_option_context_add_main_entries (option_context, options, NULL);
+    g_option_context_add_group (option_context, gst_init_get_option_group ());
+    if (!g_option_context_parse (option_context, &argc, &argv, &error)) {
+	g_printerr ("option parsing failed: %s\n", error->message);
+	return 1;
+    }
+
+    if (argc < 2 || argc > 3) {
+	gchar *help = g_option_context_get_help (option_context, TRUE, NULL);
+	g_printerr ("%s", help);
+	g_free (help);
+	return 1;
+    }
+
+    sizes = parse_sizes (size_list != NULL ? size_list : "100", &n_sizes);
+
+    theme = theme_new ();
+    theme_read_xml (theme, argv[1]);
+    if (!theme->parsed_ok)
+	return 1;
+
+    if (argc == 3) {
+	output = g_strdup (argv[2]);
+    } else {
+	dirname = g_path_get_dirname (argv[1]);
+	output = g_build_filename (dirname, THEME_BUNDLE_NAME, NULL);
+	g_free (dirname);
+    }
+
+    if (!compile_theme (theme, argv[1], output, sizes, n_sizes, &error)) {
+	g_printerr ("%s\n", error->message);
+	return 1;
+    }
+
+    g_free (output);
+    g_free (sizes);
+    g_option_context_free (option_context);
+
+    return 0;
+}
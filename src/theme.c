@@ -41,7 +41,14 @@ static void parser_start_element (GMarkupParseContext *context,
 {
 	ToddlerFunThemeParser *parser = (ToddlerFunThemeParser *) user_data;
 
-	if (strcmp (element_name, "objects") == 0) {
+	if (strcmp (element_name, "toddler_theme") == 0) {
+		const gchar *name = get_attribute ("name",
+										   attribute_names,
+										   attribute_values);
+		g_free (parser->theme->name);
+		parser->theme->name = g_strdup (name);
+
+	} else if (strcmp (element_name, "objects") == 0) {
 		guint size = sizeof (ToddlerFunThemeObject);
 		if (parser->theme->theme_objects == NULL) 
 			parser->theme->theme_objects = g_array_new (FALSE, TRUE, size);
@@ -77,6 +84,24 @@ static void parser_start_element (GMarkupParseContext *context,
 		gchar *path = g_build_filename (parser->dirname,
 										basename, NULL);
 		parser->theme->background_sound_file = path;
+
+	} else if (strcmp (element_name, "music") == 0) {
+		const gchar *crossfade = get_attribute ("crossfade",
+												attribute_names,
+												attribute_values);
+		if (crossfade != NULL)
+			parser->theme->music_crossfade = g_ascii_strtod (crossfade,
+															 NULL);
+
+	} else if (strcmp (element_name, "track") == 0) {
+		const gchar *basename = get_attribute ("sound",
+											   attribute_names,
+											   attribute_values);
+		if (basename != NULL) {
+			gchar *path = g_build_filename (parser->dirname,
+											basename, NULL);
+			g_ptr_array_add (parser->theme->music_tracks, path);
+		}
 	}
 }
 
@@ -105,11 +130,39 @@ static GMarkupParser parser = {
 	
 ToddlerFunTheme *theme_new (void) 
 {
-	return g_new0 (ToddlerFunTheme, 1);
+	ToddlerFunTheme *theme = g_new0 (ToddlerFunTheme, 1);
+	theme->music_tracks = g_ptr_array_new_with_free_func (g_free);
+	theme->music_crossfade = 3.0;
+	return theme;
 }
 
 void
-theme_read (ToddlerFunTheme *theme, gchar *filename)
+theme_free (ToddlerFunTheme *theme)
+{
+	gint i;
+
+	for (i = 0; i < theme_get_n_objects (theme); i++) {
+		ToddlerFunThemeObject *obj = theme_get_object (theme, i);
+		g_free (obj->sound_file);
+		g_free (obj->image_file);
+		if (obj->image_handle != NULL)
+			g_object_unref (obj->image_handle);
+	}
+	if (theme->theme_objects != NULL)
+		g_array_free (theme->theme_objects, TRUE);
+	g_free (theme->name);
+	g_free (theme->background_sound_file);
+	g_ptr_array_free (theme->music_tracks, TRUE);
+	if (theme->bundle != NULL)
+		g_mapped_file_unref (theme->bundle);
+	g_free (theme);
+}
+
+/*
+ * Parse the theme.xml FILENAME, without looking for a bundle
+ */
+void
+theme_read_xml (ToddlerFunTheme *theme, gchar *filename)
 {
 	ToddlerFunThemeParser parseinfo;
 	GMarkupParseContext *context;
@@ -149,6 +202,249 @@ theme_read_cleanup:
 	g_free (parseinfo.dirname);
 }
 
+/*
+ * Put the SHA-1 digest of FILENAME in SHA1, which has room for 20
+ * bytes.  A bundle records the digest of the theme.xml it was made
+ * from, and of every sound and image it holds the contents of, which
+ * tells whether it is still up to date.  Unlike modification times,
+ * digests survive the files being copied by "make install".
+ */
+gboolean
+theme_get_file_checksum (const gchar *filename, guint8 *sha1)
+{
+	GChecksum *checksum;
+	gchar *contents;
+	gsize length, digest_len = 20;
+
+	if (!g_file_get_contents (filename, &contents, &length, NULL))
+		return FALSE;
+
+	checksum = g_checksum_new (G_CHECKSUM_SHA1);
+	g_checksum_update (checksum, (const guchar *) contents, length);
+	g_checksum_get_digest (checksum, sha1, &digest_len);
+	g_checksum_free (checksum);
+	g_free (contents);
+
+	return TRUE;
+}
+
+/*
+ * Whether FILENAME still has the SHA1 digest of the file that a bundle
+ * was made from, which is all 0 for no file
+ */
+static gboolean
+bundle_check_file (const gchar *filename, const guint8 *sha1)
+{
+	static const guint8 none[20] = { 0 };
+	guint8 file_sha1[20];
+
+	if (filename == NULL)
+		return memcmp (sha1, none, 20) == 0;
+
+	return (theme_get_file_checksum (filename, file_sha1) &&
+			memcmp (file_sha1, sha1, 20) == 0);
+}
+
+/*
+ * Check that LEN bytes at OFFSET are within the bundle and aligned to
+ * ALIGN
+ */
+static gboolean
+bundle_check_range (gsize file_size, guint32 offset, guint64 len,
+					guint align)
+{
+	return (offset % align == 0 &&
+			offset <= file_size &&
+			len <= file_size - offset);
+}
+
+/*
+ * Get the file name stored at OFFSET in the bundle, made absolute, or
+ * NULL if OFFSET is 0.  Sets *OK to FALSE if the string is not within
+ * the bundle.
+ */
+static gchar *
+bundle_get_file (const guchar *data, gsize file_size, guint32 offset,
+				 const gchar *dirname, gboolean *ok)
+{
+	const gchar *basename;
+
+	if (offset == 0)
+		return NULL;
+
+	if (offset >= file_size || memchr (data + offset, '\0',
+									   file_size - offset) == NULL) {
+		*ok = FALSE;
+		return NULL;
+	}
+
+	basename = (const gchar *) data + offset;
+	return g_build_filename (dirname, basename, NULL);
+}
+
+/*
+ * Fill in THEME from the mapped bundle, checking that everything it
+ * points to is within the file.  THEME is left as it was if it isn't.
+ */
+static gboolean
+theme_load_bundle (ToddlerFunTheme *theme, GMappedFile *mapped,
+				   const gchar *dirname, const guint8 *xml_sha1)
+{
+	const guchar *data = (const guchar *) g_mapped_file_get_contents (mapped);
+	gsize file_size = g_mapped_file_get_length (mapped);
+	const ToddlerFunBundleHeader *header;
+	const ToddlerFunBundleObject *objects;
+	const guint32 *tracks;
+	GArray *theme_objects;
+	GPtrArray *music_tracks;
+	gchar *background;
+	gboolean ok = TRUE;
+	guint i, j;
+
+	header = (const ToddlerFunBundleHeader *) data;
+	if (file_size < sizeof (ToddlerFunBundleHeader) ||
+		memcmp (header->magic, THEME_BUNDLE_MAGIC, 4) != 0 ||
+		header->byte_order != G_BYTE_ORDER ||
+		header->version != THEME_BUNDLE_VERSION ||
+		header->file_size != file_size)
+		return FALSE;
+
+	// Made from another theme.xml than the one there now
+	if (memcmp (header->xml_sha1, xml_sha1, 20) != 0)
+		return FALSE;
+
+	if (!bundle_check_range (file_size, header->objects_offset,
+							 (guint64) header->n_objects *
+							 sizeof (ToddlerFunBundleObject), 4) ||
+		!bundle_check_range (file_size, header->tracks_offset,
+							 (guint64) header->n_tracks *
+							 sizeof (guint32), 4))
+		return FALSE;
+
+	objects = (const ToddlerFunBundleObject *) (data + header->objects_offset);
+	tracks = (const guint32 *) (data + header->tracks_offset);
+
+	theme_objects = g_array_new (FALSE, TRUE, sizeof (ToddlerFunThemeObject));
+	music_tracks = g_ptr_array_new_with_free_func (g_free);
+
+	for (i = 0; ok && i < header->n_objects; i++) {
+		const ToddlerFunBundleObject *bundle_obj = &objects[i];
+		ToddlerFunThemeObject obj;
+
+		memset (&obj, 0, sizeof (ToddlerFunThemeObject));
+		obj.sound_file = bundle_get_file (data, file_size,
+										  bundle_obj->sound_offset,
+										  dirname, &ok);
+		obj.image_file = bundle_get_file (data, file_size,
+										  bundle_obj->image_offset,
+										  dirname, &ok);
+
+		// A sound or image edited since the bundle was made
+		if (!bundle_check_file (obj.sound_file, bundle_obj->sound_sha1) ||
+			!bundle_check_file (obj.image_file, bundle_obj->image_sha1))
+			ok = FALSE;
+
+		if (bundle_obj->pcm_offset != 0) {
+			if (!bundle_check_range (file_size, bundle_obj->pcm_offset,
+									 (guint64) bundle_obj->pcm_n_frames *
+									 2 * sizeof (gint16), 4))
+				ok = FALSE;
+			obj.pcm = (const gint16 *) (data + bundle_obj->pcm_offset);
+			obj.pcm_n_frames = bundle_obj->pcm_n_frames;
+		}
+
+		if (!bundle_check_range (file_size, bundle_obj->sprites_offset,
+								 (guint64) bundle_obj->n_sprites *
+								 sizeof (ToddlerFunBundleSprite), 4))
+			ok = FALSE;
+		obj.bundle_sprites = (const ToddlerFunBundleSprite *)
+			(data + bundle_obj->sprites_offset);
+		obj.n_bundle_sprites = bundle_obj->n_sprites;
+
+		for (j = 0; ok && j < obj.n_bundle_sprites; j++) {
+			const ToddlerFunBundleSprite *sprite = &obj.bundle_sprites[j];
+
+			if (sprite->stride < sprite->width * 4 ||
+				!bundle_check_range (file_size, sprite->data_offset,
+									 (guint64) sprite->stride *
+									 sprite->height, 4))
+				ok = FALSE;
+		}
+
+		// Added before checking, so that it is freed along with the rest
+		g_array_append_val (theme_objects, obj);
+	}
+
+	for (i = 0; ok && i < header->n_tracks; i++) {
+		gchar *path = bundle_get_file (data, file_size, tracks[i],
+									   dirname, &ok);
+		if (path != NULL)
+			g_ptr_array_add (music_tracks, path);
+	}
+
+	background = bundle_get_file (data, file_size,
+								  header->background_offset, dirname, &ok);
+
+	if (!ok) {
+		for (i = 0; i < theme_objects->len; i++) {
+			ToddlerFunThemeObject *obj;
+			obj = &g_array_index (theme_objects, ToddlerFunThemeObject, i);
+			g_free (obj->sound_file);
+			g_free (obj->image_file);
+		}
+		g_array_free (theme_objects, TRUE);
+		g_ptr_array_free (music_tracks, TRUE);
+		g_free (background);
+		return FALSE;
+	}
+
+	theme->theme_objects = theme_objects;
+	g_ptr_array_free (theme->music_tracks, TRUE);
+	theme->music_tracks = music_tracks;
+	theme->background_sound_file = background;
+	theme->music_crossfade = header->crossfade_ms / 1000.0;
+	theme->bundle = g_mapped_file_ref (mapped);
+	theme->bundle_data = data;
+	theme->parsed_ok = TRUE;
+
+	return TRUE;
+}
+
+/*
+ * Read the theme FILENAME, which is a theme.xml.  If there is an up to
+ * date bundle next to it, that is used instead, and the objects point
+ * into it.
+ */
+void
+theme_read (ToddlerFunTheme *theme, gchar *filename)
+{
+	GMappedFile *mapped;
+	gchar *dirname, *bundle_file;
+	guint8 xml_sha1[20];
+
+	dirname = g_path_get_dirname (filename);
+	bundle_file = g_build_filename (dirname, THEME_BUNDLE_NAME, NULL);
+
+	mapped = g_mapped_file_new (bundle_file, FALSE, NULL);
+	if (mapped != NULL) {
+		gboolean loaded;
+
+		loaded = (theme_get_file_checksum (filename, xml_sha1) &&
+				  theme_load_bundle (theme, mapped, dirname, xml_sha1));
+		g_mapped_file_unref (mapped);
+
+		if (!loaded)
+			g_printerr (_("Ignoring theme bundle %s, which is out of date "
+						  "or damaged\n"), bundle_file);
+	}
+
+	g_free (bundle_file);
+	g_free (dirname);
+
+	if (!theme->parsed_ok)
+		theme_read_xml (theme, filename);
+}
+
 ToddlerFunThemeObject *
 theme_get_object (ToddlerFunTheme *theme, gint i)
 {
@@ -1,18 +1,91 @@
 /* -*- Mode: C; indent-tabs-mode: t; c-basic-offset: 4; tab-width: 4 -*- */
 
+/*
+ * A theme bundle, made by toddlerfun-theme-compile, holds a parsed
+ * theme.xml together with its images rasterized and its sounds decoded,
+ * so that it can be mapped into memory and used as is.  All numbers are
+ * in the byte order of the machine that wrote it, and all offsets are
+ * from the start of the file.  Strings are nul terminated file names
+ * relative to the theme directory.
+ */
+#define THEME_BUNDLE_MAGIC "TFTB"
+#define THEME_BUNDLE_VERSION 3
+#define THEME_BUNDLE_NAME "theme.bundle"
+#define THEME_BUNDLE_ALIGN 16
+
+typedef struct {
+	gchar magic[4];
+	guint32 version;
+	guint32 byte_order;			// G_BYTE_ORDER of the writer
+	guint32 file_size;
+	guint8 xml_sha1[20];		// of the theme.xml it was made from
+	guint32 n_objects;
+	guint32 objects_offset;		// ToddlerFunBundleObject[n_objects]
+	guint32 background_offset;	// string, or 0
+	guint32 n_tracks;
+	guint32 tracks_offset;		// guint32[n_tracks] string offsets
+	guint32 crossfade_ms;
+} ToddlerFunBundleHeader;
+
+typedef struct {
+	guint32 sound_offset;		// string, or 0
+	guint32 image_offset;		// string, or 0
+	guint32 pcm_offset;			// interleaved stereo gint16, or 0
+	guint32 pcm_n_frames;
+	guint32 sprites_offset;		// ToddlerFunBundleSprite[n_sprites]
+	guint32 n_sprites;
+
+	// SHA-1 digests of the files the sound and sprites were made
+	// from, all 0 if there was no file
+	guint8 sound_sha1[20];
+	guint8 image_sha1[20];
+} ToddlerFunBundleObject;
+
+typedef struct {
+	guint32 size;				// diagonal in pixels
+	gint32 rotation_step;		// see sprite_get_rotation_step ()
+	gint32 x_offset;
+	gint32 y_offset;
+	guint32 width;
+	guint32 height;
+	guint32 stride;
+	guint32 data_offset;		// premultiplied ARGB32 pixels
+} ToddlerFunBundleSprite;
+
 typedef struct {
 	gchar *sound_file;
 	gchar *image_file;
 	RsvgHandle *image_handle;
+	gboolean ready;
+
+	// Modification times of the files when they were loaded
+	gint64 image_mtime;
+	gint64 sound_mtime;
+
+	// Only set when the theme was read from a bundle, and pointing
+	// into it
+	const ToddlerFunBundleSprite *bundle_sprites;
+	guint n_bundle_sprites;
+	const gint16 *pcm;
+	guint pcm_n_frames;
 } ToddlerFunThemeObject;
 
 typedef struct {
+	gchar *name;
 	GArray *theme_objects;
 	gchar *background_sound_file;
+	GPtrArray *music_tracks;
+	gdouble music_crossfade;
 	gboolean parsed_ok;
+
+	GMappedFile *bundle;
+	const guchar *bundle_data;
 } ToddlerFunTheme;
 
 ToddlerFunTheme *theme_new (void);
+void theme_free (ToddlerFunTheme *theme);
 void theme_read (ToddlerFunTheme *theme, gchar *filename);
+void theme_read_xml (ToddlerFunTheme *theme, gchar *filename);
+gboolean theme_get_file_checksum (const gchar *filename, guint8 *sha1);
 ToddlerFunThemeObject *theme_get_object (ToddlerFunTheme *theme, gint i);
 gint theme_get_n_objects (ToddlerFunTheme *theme);
@@ -0,0 +1,165 @@
+/*
+ * trace.c
+ * Recording a timeline of the event handlers
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ * Writes spans in the Chrome trace event format, which chrome://tracing
+ * and Perfetto can show, so that an input can be followed through the
+ * handlers to the frame that draws it.
+ *
+ * Recording a span only fills in a slot of a preallocated ring; a
+ * thread of its own wakes up every trace_flush_interval and writes out
+ * what has been filled, so the main thread never formats or writes
+ * anything.  Spans are only recorded from the main thread.  If the
+ * writer falls a whole ring behind, new spans are dropped and counted.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <stdio.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "trace.h"
+
+static const gint64 trace_flush_interval = G_USEC_PER_SEC / 10;
+
+/*
+ * Write the spans recorded since the last call
+ */
+static void
+write_events (ToddlerFunTrace *trace)
+{
+    guint head = g_atomic_int_get (&trace->head);
+    guint tail = trace->tail;
+
+    for (; tail != head; tail++) {
+	ToddlerFunTraceEvent *event = &trace->events[tail % TRACE_RING_LEN];
+
+	fprintf (trace->file,
+		 "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, "
+		 "\"ts\": %" G_GINT64_FORMAT ", \"dur\": %" G_GINT64_FORMAT,
+		 trace->first ? "" : ",\n", event->name,
+		 event->start - trace->start_time, event->duration);
+	if (event->arg_name != NULL)
+	    fprintf (trace->file, ", \"args\": {\"%s\": %" G_GINT64_FORMAT "}",
+		     event->arg_name, event->arg);
+	fputc ('}', trace->file);
+	trace->first = FALSE;
+    }
+
+    g_atomic_int_set (&trace->tail, tail);
+}
+
+static gpointer
+writer_thread (gpointer data)
+{
+    ToddlerFunTrace *trace = (ToddlerFunTrace *) data;
+
+    g_mutex_lock (&trace->mutex);
+    while (!trace->stopping) {
+	g_cond_wait_until (&trace->cond, &trace->mutex,
+			   g_get_monotonic_time () + trace_flush_interval);
+	g_mutex_unlock (&trace->mutex);
+	write_events (trace);
+	g_mutex_lock (&trace->mutex);
+    }
+    g_mutex_unlock (&trace->mutex);
+
+    // Whatever was recorded after the last write
+    write_events (trace);
+
+    return NULL;
+}
+
+ToddlerFunTrace *
+trace_new (const gchar *filename, GError **error)
+{
+    ToddlerFunTrace *trace;
+    FILE *file;
+
+    file = g_fopen (filename, "w");
+    if (file == NULL) {
+	int saved_errno = errno;
+
+	g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+		     "%s: %s", filename, g_strerror (saved_errno));
+	return NULL;
+    }
+    fputs ("[\n", file);
+
+    trace = g_new0 (ToddlerFunTrace, 1);
+    trace->events = g_new0 (ToddlerFunTraceEvent, TRACE_RING_LEN);
+    trace->start_time = g_get_monotonic_time ();
+    trace->file = file;
+    trace->first = TRUE;
+    g_mutex_init (&trace->mutex);
+    g_cond_init (&trace->cond);
+    trace->thread = g_thread_new ("trace", writer_thread, trace);
+
+    return trace;
+}
+
+/*
+ * Write out everything recorded and close the file
+ */
+void
+trace_free (ToddlerFunTrace *trace)
+{
+    g_mutex_lock (&trace->mutex);
+    trace->stopping = TRUE;
+    g_cond_signal (&trace->cond);
+    g_mutex_unlock (&trace->mutex);
+    g_thread_join (trace->thread);
+
+    fputs ("\n]\n", trace->file);
+    fclose (trace->file);
+
+    if (trace->n_dropped > 0)
+	g_printerr ("%d trace events dropped\n", trace->n_dropped);
+
+    g_mutex_clear (&trace->mutex);
+    g_cond_clear (&trace->cond);
+    g_free (trace->events);
+    g_free (trace);
+}
+
+/*
+ * The start time of a span, to pass to trace_end.  TRACE may be NULL
+ * when not tracing.
+ */
+gint64
+trace_begin (ToddlerFunTrace *trace)
+{
+    return trace != NULL ? g_get_monotonic_time () : 0;
+}
+
+/*
+ * Record the span NAME from START until now, with ARG called ARG_NAME
+ * unless that is NULL
+ */
+void
+trace_end (ToddlerFunTrace *trace, const gchar *name, gint64 start,
+	   const gchar *arg_name, gint64 arg)
+{
+    ToddlerFunTraceEvent *event;
+    guint head;
+
+    if (trace == NULL)
+	return;
+
+    // Only this thread moves the head
+    head = trace->head;
+    if (head - g_atomic_int_get (&trace->tail) >= TRACE_RING_LEN) {
+	trace->n_dropped++;
+	return;
+    }
+
+    event = &trace->events[head % TRACE_RING_LEN];
+    event->name = name;
+    event->arg_name = arg_name;
+    event->start = start;
+    event->duration = g_get_monotonic_time () - start;
+    event->arg = arg;
+
+    g_atomic_int_set (&trace->head, head + 1);
+}
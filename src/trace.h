@@ -0,0 +1,38 @@
+/*
+ * trace.h
+ * Recording a timeline of the event handlers
+ * Copyright (C) 2013 Simon Kågedal Reimer <simon@helgo.net>
+ *
+ */
+
+// A power of two, so that the ring indexes can wrap around
+#define TRACE_RING_LEN 65536
+
+typedef struct {
+    const gchar *name;		// a static string
+    const gchar *arg_name;	// NULL if there is no argument
+    gint64 start;
+    gint64 duration;
+    gint64 arg;
+} ToddlerFunTraceEvent;
+
+typedef struct {
+    ToddlerFunTraceEvent *events;
+    guint head;			// next to fill, advanced by the main thread
+    guint tail;			// next to write, advanced by the writer
+    gint n_dropped;
+    gint64 start_time;
+
+    FILE *file;
+    gboolean first;
+    GThread *thread;
+    GMutex mutex;
+    GCond cond;
+    gboolean stopping;
+} ToddlerFunTrace;
+
+ToddlerFunTrace *trace_new (const gchar *filename, GError **error);
+void trace_free (ToddlerFunTrace *trace);
+gint64 trace_begin (ToddlerFunTrace *trace);
+void trace_end (ToddlerFunTrace *trace, const gchar *name, gint64 start,
+		const gchar *arg_name, gint64 arg);